@@ -3,7 +3,7 @@ let outputs = [];
 let currentEditId = null;
 let statusPollInterval = null;
 let currentCommMode = 1; // Default WS
-const TOTAL_OUTPUTS = 20; // KONSTANTA PENTING!
+let TOTAL_OUTPUTS = 20; // Diupdate dari /api/status (totalOutputs)
 
 // ==================== HTTP REQUEST HELPER ====================
 async function apiRequest(url, method = 'GET', data = null) {
@@ -20,6 +20,10 @@ async function apiRequest(url, method = 'GET', data = null) {
         }
         
         const response = await fetch(url, options);
+        if (response.status === 429) {
+            // Rate limit ESP32 (per client), perintah tidak dijalankan
+            showToast('Terlalu banyak perintah, coba lagi sebentar!', 'error');
+        }
         return await response.json();
     } catch (error) {
         console.error('API Request Error:', error);
@@ -34,6 +38,7 @@ async function fetchStatus() {
     if (data && data.outputs) {
         outputs = data.outputs;
         currentCommMode = data.commMode;
+        TOTAL_OUTPUTS = data.totalOutputs || outputs.length;
         
         console.log(`Received ${outputs.length} outputs from server`);
         
@@ -134,7 +139,7 @@ function renderOutputs() {
     
     console.log(`Rendering ${TOTAL_OUTPUTS} output cards...`);
     
-    // PASTIKAN render SEMUA 20 output
+    // PASTIKAN render SEMUA output
     for (let i = 0; i < TOTAL_OUTPUTS; i++) {
         const output = outputs[i];
         if (output) {
@@ -265,48 +270,54 @@ async function saveOutput() {
     const maxToggles = parseInt(document.getElementById('maxToggles').value);
     
     const currentOutput = outputs[currentEditId] || createDefaultOutput(currentEditId);
+    const results = [];
     
     // Set name
     if (name !== currentOutput.name) {
-        await apiRequest('/api/output', 'POST', {
+        results.push(await apiRequest('/api/output', 'POST', {
             action: 'setName',
             id: currentEditId,
             name: name
-        });
+        }));
     }
     
     // Set interval
     if (intervalOn !== currentOutput.intervalOn || intervalOff !== currentOutput.intervalOff) {
-        await apiRequest('/api/output', 'POST', {
+        results.push(await apiRequest('/api/output', 'POST', {
             action: 'setInterval',
             id: currentEditId,
             intervalOn: intervalOn,
             intervalOff: intervalOff
-        });
+        }));
     }
     
     // Set auto mode
     if (autoMode !== currentOutput.autoMode) {
-        await apiRequest('/api/output', 'POST', {
+        results.push(await apiRequest('/api/output', 'POST', {
             action: 'setAutoMode',
             id: currentEditId,
             autoMode: autoMode
-        });
+        }));
     }
 
     // Cek jika nilai maxToggles berubah
     if (maxToggles !== (currentOutput.maxToggles || 0)) {
-    await apiRequest('/api/output', 'POST', {
+    results.push(await apiRequest('/api/output', 'POST', {
       action: 'setToggleLimit',
       id: currentEditId,
       limit: maxToggles
-    });
+    }));
     // Counter direset oleh backend secara otomatis
   }
     
+    setTimeout(fetchStatus, 100);
+    if (results.some(r => !r || !r.success)) {
+        showToast('Sebagian pengaturan gagal disimpan!', 'error');
+        return;
+    }
+    
     closeModal('editModal');
     showToast('Pengaturan disimpan!');
-    setTimeout(fetchStatus, 100);
 }
 
 async function resetCounter() {
@@ -341,40 +352,19 @@ async function allOutputsOn() {
     if (confirm(`Nyalakan SEMUA ${TOTAL_OUTPUTS} output dan matikan mode interval/auto?`)) {
         showToast(`Menyalakan ${TOTAL_OUTPUTS} output...`, 'info');
         
-        const promises = [];
-        
-        // 1. Matikan auto mode untuk SEMUA output dulu
-        console.log(`Disabling auto mode for ${TOTAL_OUTPUTS} outputs...`);
-        for (let i = 0; i < TOTAL_OUTPUTS; i++) {
-            promises.push(
-                apiRequest('/api/output', 'POST', {
-                    action: 'setAutoMode',
-                    id: i,
-                    autoMode: false
-                })
-            );
-        }
-        
-        await Promise.all(promises);
-        console.log('✓ Auto mode disabled for all');
+        // Satu request untuk semua output: auto mode OFF, lalu semua ON
+        const result = await apiRequest('/api/output', 'POST', {
+            action: 'setAll',
+            autoMode: false,
+            state: true
+        });
         
-        // 2. Baru nyalakan semua output SERENTAK
-        const onPromises = [];
-        console.log(`Turning ON ${TOTAL_OUTPUTS} outputs...`);
-        for (let i = 0; i < TOTAL_OUTPUTS; i++) {
-            onPromises.push(
-                apiRequest('/api/output', 'POST', {
-                    action: 'setState',
-                    id: i,
-                    state: true
-                })
-            );
+        if (result && result.success) {
+            console.log('✓ All outputs turned ON');
+            showToast(`✓ Semua ${TOTAL_OUTPUTS} output ON, auto mode OFF!`, 'success');
+        } else {
+            showToast('Gagal menyalakan semua output!', 'error');
         }
-        
-        await Promise.all(onPromises);
-        console.log('✓ All outputs turned ON');
-        
-        showToast(`✓ Semua ${TOTAL_OUTPUTS} output ON, auto mode OFF!`, 'success');
         setTimeout(fetchStatus, 500);
     }
 }
@@ -383,47 +373,19 @@ async function allOutputsOff() {
     if (confirm(`Matikan SEMUA ${TOTAL_OUTPUTS} output dan matikan mode interval/auto?`)) {
         showToast(`Mematikan ${TOTAL_OUTPUTS} output...`, 'info');
         
-        const promises = [];
-        
-        // 1. Matikan auto mode untuk SEMUA output dulu
-        console.log(`Disabling auto mode for ${TOTAL_OUTPUTS} outputs...`);
-        for (let i = 0; i < TOTAL_OUTPUTS; i++) {
-            promises.push(
-                apiRequest('/api/output', 'POST', {
-                    action: 'setAutoMode',
-                    id: i,
-                    autoMode: false
-                })
-            );
-        }
-        
-        await Promise.all(promises);
-        console.log('✓ Auto mode disabled for all');
-        
-        // 2. Baru matikan semua output SERENTAK
-        const offPromises = [];
-        console.log(`Turning OFF ${TOTAL_OUTPUTS} outputs...`);
-        for (let i = 0; i < TOTAL_OUTPUTS; i++) {
-            offPromises.push(
-                apiRequest('/api/output', 'POST', {
-                    action: 'setState',
-                    id: i,
-                    state: false
-                })
-            );
-        }
-        
-        await Promise.all(offPromises);
-        console.log('✓ All outputs turned OFF');
-
-        // 4. Trigger rebuild sync groups di ESP32
-        console.log('Rebuilding sync groups...');
-        await apiRequest('/api/output', 'POST', {
-            action: 'rebuildGroups'
+        // Satu request untuk semua output, sync groups ikut di-rebuild di ESP32
+        const result = await apiRequest('/api/output', 'POST', {
+            action: 'setAll',
+            autoMode: false,
+            state: false
         });
-        console.log('✓ Sync groups rebuilt');
         
-        showToast(`✓ Semua ${TOTAL_OUTPUTS} output OFF, auto mode OFF!`, 'success');
+        if (result && result.success) {
+            console.log('✓ All outputs turned OFF');
+            showToast(`✓ Semua ${TOTAL_OUTPUTS} output OFF, auto mode OFF!`, 'success');
+        } else {
+            showToast('Gagal mematikan semua output!', 'error');
+        }
         setTimeout(fetchStatus, 500);
     }
 }
@@ -460,64 +422,22 @@ async function setAllInterval() {
   if (confirm(confirmText)) {
     showToast(`Menerapkan ke ${TOTAL_OUTPUTS} output...`, 'info');
     
-    console.log(`Setting toggle limit to ${maxToggles} for ${TOTAL_OUTPUTS} outputs...`);
-    const limitPromises = [];
-    for (let i = 0; i < TOTAL_OUTPUTS; i++) {
-      limitPromises.push(
-        apiRequest('/api/output', 'POST', {
-          action: 'setToggleLimit',
-          id: i,
-          limit: maxToggles
-        })
-      );
-    }
-    await Promise.all(limitPromises);
-    console.log('✓ Toggle limits set for all outputs (counters reset)');
-    
-    console.log(`Setting interval for ${TOTAL_OUTPUTS} outputs...`);
-    const intervalPromises = [];
-    for (let i = 0; i < TOTAL_OUTPUTS; i++) {
-      intervalPromises.push(
-        apiRequest('/api/output', 'POST', {
-          action: 'setInterval',
-          id: i,
-          intervalOn: intervalOn,
-          intervalOff: intervalOff
-        })
-      );
-    }
-    await Promise.all(intervalPromises);
-    console.log('✓ Intervals set for all outputs');
-    
-    console.log(`Setting auto mode to ${autoMode} for ${TOTAL_OUTPUTS} outputs...`);
-    const autoPromises = [];
-    for (let i = 0; i < TOTAL_OUTPUTS; i++) {
-      autoPromises.push(
-        apiRequest('/api/output', 'POST', {
-          action: 'setAutoMode',
-          id: i,
-          autoMode: autoMode
-        })
-      );
-    }
-    await Promise.all(autoPromises);
-    console.log('✓ Auto mode set for all outputs');
+    // Satu request: limit (meteran di-reset), interval, auto mode, lalu state
+    const request = {
+      action: 'setAll',
+      limit: maxToggles,
+      intervalOn: intervalOn,
+      intervalOff: intervalOff,
+      autoMode: autoMode
+    };
+    if (turnOnAll) request.state = true;
     
-    if (turnOnAll) {
-      console.log(`Turning ON ${TOTAL_OUTPUTS} outputs...`);
-      const onPromises = [];
-      for (let i = 0; i < TOTAL_OUTPUTS; i++) {
-        onPromises.push(
-          apiRequest('/api/output', 'POST', {
-            action: 'setState',
-            id: i,
-            state: true
-          })
-        );
-      }
-      await Promise.all(onPromises);
-      console.log('✓ All outputs turned ON');
+    const result = await apiRequest('/api/output', 'POST', request);
+    if (!result || !result.success) {
+      showToast('Gagal menerapkan pengaturan massal!', 'error');
+      return;
     }
+    console.log(`✓ Bulk settings applied to ${TOTAL_OUTPUTS} outputs`);
     
     closeModal('setAllModal');
     showToast(`✓ Pengaturan massal diterapkan ke ${TOTAL_OUTPUTS} output!`, 'success');
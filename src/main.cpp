@@ -1,13 +1,20 @@
 #include <Arduino.h>
 #include <WiFi.h>
+#include <WiFiUdp.h>
 #include <WebServer.h>
 #include <Wire.h>
 #include <LittleFS.h>
 #include <ArduinoJson.h>
 #include <PubSubClient.h>
 #include <WebSocketsClient.h>
-#include <PCF8574.h>
 #include <LiquidCrystal_I2C.h>
+#include <mbedtls/md.h>
+#include <lwip/sockets.h>
+#include <lwip/dns.h>
+#include <atomic>
+#include <esp_attr.h>
+#include <esp_system.h>
+#include <sys/time.h>
 
 // ==================== ALAMAT I2C ====================
 #define ADDR_PCF1 0x20
@@ -15,30 +22,154 @@
 #define ADDR_LCD 0x27
 
 // ==================== KONFIGURASI ====================
-#define TOTAL_OUTPUTS 20
+#define MAX_OUTPUTS 128  // Channel limit of any topology, see CHANNEL MAPPING
+#define MAX_IO_DEVICES 8 // I2C expanders
 #define CONFIG_FILE "/config.json"
 #define AP_SSID "ESP32-Control"
 #define AP_PASSWORD "12345678"
+#define UDP_CTRL_DEFAULT_PORT 4210
 
 // ==================== ENUMS ====================
-enum IOType
+// Output backend. IO_ESP is a plain GPIO, the others are I2C expanders.
+enum IOType : uint8_t
 {
-  IO_ESP,
-  IO_PCF1,
-  IO_PCF2
+  IO_ESP = 0,
+  IO_PCF8574,  // 8 bit, quasi-bidirectional
+  IO_PCF8575,  // 16 bit, quasi-bidirectional
+  IO_MCP23017, // 16 bit, IODIR + OLAT registers
+  IO_VIRTUAL,  // 16 bit, no hardware (benchmarks, bench-top testing)
+  IO_TYPE_COUNT
 };
 
+// Transport id, index into transports[]. The legacy "mode" API enables one
+// exclusively, config can enable any subset.
 enum CommMode
 {
   MODE_MQTT = 0,
-  MODE_WEBSOCKET = 1
+  MODE_WEBSOCKET = 1,
+  TRANSPORT_COUNT
+};
+
+// Origin of a command, recorded in the event trace
+enum CmdSource : uint8_t
+{
+  SRC_UNKNOWN = 0,
+  SRC_BOOT,
+  SRC_HTTP,
+  SRC_WS,
+  SRC_MQTT,
+  SRC_SERIAL,
+  SRC_SCHEDULER,
+  SRC_UDP,
+  CMD_SOURCE_COUNT
+};
+
+enum MqttConnState
+{
+  MQTT_CONN_IDLE,
+  MQTT_CONN_BACKOFF,
+  MQTT_CONN_DNS,
+  MQTT_CONN_TCP,
+  MQTT_CONN_CONNECT, // Sending CONNECT
+  MQTT_CONN_CONNACK, // Waiting for CONNACK
+  MQTT_CONN_UP
+};
+
+enum MqttDnsResult
+{
+  MQTT_DNS_NONE,
+  MQTT_DNS_PENDING,
+  MQTT_DNS_OK,
+  MQTT_DNS_FAIL
+};
+
+enum WifiState
+{
+  WIFI_STATE_CONNECTING,
+  WIFI_STATE_CONNECTED,
+  WIFI_STATE_AP
+};
+
+// What a config save touched, decides which subsystem is restarted
+enum ConfigChange : uint8_t
+{
+  CFG_CHANGE_WIFI = 1 << 0,        // SSID / password: reconnect WiFi
+  CFG_CHANGE_MQTT = 1 << 1,        // MQTT endpoint / enable: re-init MQTT only
+  CFG_CHANGE_WS = 1 << 2,          // WS endpoint / enable: re-init WS only
+  CFG_CHANGE_UDP = 1 << 3,         // UDP listener settings
+  CFG_CHANGE_CREDENTIALS = 1 << 4  // Web login: nothing to restart
 };
 
 // ==================== STRUCTS ====================
+// Output state bitset, bit n = CH(n+1)
+#define OUTPUT_WORDS (MAX_OUTPUTS / 32)
+
+struct OutputBits
+{
+  uint32_t words[OUTPUT_WORDS];
+
+  bool get(int i) const { return (words[i >> 5] >> (i & 31)) & 1; }
+  void set(int i, bool on)
+  {
+    if (on)
+      words[i >> 5] |= 1UL << (i & 31);
+    else
+      words[i >> 5] &= ~(1UL << (i & 31));
+  }
+  void clear() { memset(words, 0, sizeof(words)); }
+  bool any() const
+  {
+    for (int w = 0; w < OUTPUT_WORDS; w++)
+      if (words[w])
+        return true;
+    return false;
+  }
+  // First set bit at or after i, -1 if none
+  int next(int i) const
+  {
+    while (i < MAX_OUTPUTS)
+    {
+      uint32_t w = words[i >> 5] >> (i & 31);
+      if (w)
+        return i + __builtin_ctz(w);
+      i = (i | 31) + 1;
+    }
+    return -1;
+  }
+  bool operator==(const OutputBits &o) const { return memcmp(words, o.words, sizeof(words)) == 0; }
+};
+
+// One I2C expander of the topology, see CHANNEL MAPPING
+struct IoDeviceConfig
+{
+  IOType type;
+  uint8_t addr;
+};
+
+// One channel of the topology
 struct ChannelMap
+{
+  int8_t device;  // Index into ioDevices[], IO_DEVICE_GPIO = ESP32 pin
+  uint8_t pin;    // GPIO number or expander port bit
+  bool activeLow; // Relay ON = LOW
+};
+
+// Runtime state of an expander: the whole port is written from shadow
+struct IoDevice
 {
   IOType type;
-  uint8_t pin;
+  uint8_t addr;
+  uint16_t usedMask; // Port bits that drive a channel
+  uint16_t shadow;   // Port value to write
+  uint16_t latched;  // Last value written and read back
+  uint16_t readback; // Pin levels of the last port read
+  bool dirty;
+  bool writeOk; // Result of the last flush
+  bool present;
+  int8_t bus; // Index into i2cDevices[], -1 = not on the bus (virtual)
+  unsigned long writes;
+  unsigned long errors;
+  unsigned long repairs; // Port found changed by ioAudit() and rewritten
 };
 
 struct OutputChannel
@@ -51,22 +182,130 @@ struct OutputChannel
   bool autoMode;
   int maxToggles;
   int currentToggles;
+  uint16_t phaseMs; // Delay after a group tick, see outputScheduleMask()
+};
+
+struct TransportConfig
+{
+  bool enabled;
+  String host;
+  int port;
+  String path;                     // MQTT: topic (non-ThingsBoard), WS: URL path
+  String token;                    // MQTT: ThingsBoard access token
+  unsigned long publishIntervalMs; // Periodic full state, 0 = off
+  bool publishOnChange;            // Publish right after a command changed outputs
 };
 
 struct Config
 {
   String wifiSSID;
   String wifiPassword;
-  String serverIP;
-  int serverPort;
-  String serverPath;
-  String serverToken;
+  TransportConfig mqtt;
+  TransportConfig ws;
   String webUsername;
   String webPassword;
-  CommMode commMode;
+  bool udpEnabled;
+  int udpPort;
+  String udpKey;
+  bool traceSpill;
+  uint16_t syncStaggerMs; // Spacing between members of an implicit sync group
+};
+
+// Registry entry, filled by transportsRegister(). Any subset of transports
+// runs at the same time, each with its own publish policy (TransportConfig).
+struct Transport
+{
+  const char *name;
+  TransportConfig *cfg;
+  void (*begin)();
+  void (*stop)();
+  void (*service)(); // Called every loop() while enabled
+  bool (*publish)(); // Full state, false if not sent
+  bool *connected;
+  bool reconnecting;
+  unsigned long disconnectTime;
+  unsigned long lastPublish;
+  unsigned long publishes;
+};
+
+// Debounced settings file write, see DEFERRED SAVES
+struct DeferredSave
+{
+  const char *name;
+  unsigned long delayMs;
+  unsigned long maxDelayMs;
+  bool pending;
+  unsigned long firstRequest;
+  unsigned long lastRequest;
+  unsigned long requests;
+  unsigned long writes;
+};
+
+// Toggle that happened while MQTT was down, see OFFLINE TELEMETRY
+struct __attribute__((packed)) TelemetryEvent
+{
+  uint32_t uptimeMs; // millis() at commit, turned into a wall-clock ts on upload
+  uint8_t channel;   // 1-based
+  uint8_t state;
+};
+
+// One-shot callback run from loop(), see DEFERRED ACTIONS
+struct DeferredAction
+{
+  void (*fn)(int); // nullptr = free slot
+  int arg;
+  unsigned long due;
+};
+
+// Reply of a recent ThingsBoard RPC, replayed when the request is retried
+struct RpcCacheEntry
+{
+  uint32_t requestId;
+  uint32_t requestHash; // CRC32 of the request payload (method + params)
+  uint32_t lastUse;     // 0 = empty
+  String response;
+};
+
+// Command rate limit, see ADMISSION CONTROL
+struct TokenBucket
+{
+  uint16_t ratePerSec; // 0 = unlimited
+  uint16_t burst;
+  uint32_t milliTokens; // 1000 = one command
+  unsigned long lastRefill;
+};
+
+struct ClientBucket
+{
+  uint32_t ip; // IPv4, 0 = free
+  TokenBucket bucket;
+};
+
+// User-defined group from config.json "groups", see NAMED GROUPS
+#define MAX_NAMED_GROUPS 8
+#define GROUP_NAME_LEN 16
+
+struct NamedGroup
+{
+  char name[GROUP_NAME_LEN];
+  OutputBits members;
+  bool autoMode;
+  unsigned long intervalOn; // ms
+  unsigned long intervalOff;
+  unsigned long lastToggle;
+  bool currentState;
+  uint16_t phaseMs;   // Delay of the whole group after its tick
+  uint16_t staggerMs; // Extra delay per member, in channel order
 };
 
 // ==================== SYNC GROUP SYSTEM ====================
+// Auto-mode channels with the same (intervalOn, intervalOff) toggle together,
+// except members of a named group (NAMED GROUPS), which follow the group.
+// Groups live in a small open-addressing table keyed by the interval pair;
+// a slot with memberCount 0 is free. Channels join and leave one at a time,
+// so the other groups keep their phase.
+#define SYNC_GROUP_SLOTS 8 // Power of two, lookup probes at most all of them
+
 struct SyncGroup
 {
   unsigned long intervalOn;
@@ -74,41 +313,165 @@ struct SyncGroup
   unsigned long lastToggle;
   bool currentState;
   int memberCount;
+  OutputBits members;
 };
 
 // ==================== GLOBAL OBJECTS ====================
-SyncGroup syncGroups[5];           // Maksimal 5 grup berbeda
-int outputGroupMap[TOTAL_OUTPUTS]; // Map output ke grup mana
-int activeSyncGroups = 0;
-
-ChannelMap chMap[TOTAL_OUTPUTS + 1];
-OutputChannel outputs[TOTAL_OUTPUTS];
+SyncGroup syncGroups[SYNC_GROUP_SLOTS]; // Maksimal 8 grup berbeda
+int outputGroupMap[MAX_OUTPUTS];      // Map output ke grup mana, -1 = tidak ada
+int activeSyncGroups = 0;             // Slots in use
+NamedGroup namedGroups[MAX_NAMED_GROUPS];
+int namedGroupCount = 0;
+OutputBits namedGroupMembers; // Union of all members
+
+OutputChannel outputs[MAX_OUTPUTS];
+OutputBits outputState; // Mirrors outputs[].state
 Config config;
 
-PCF8574 pcf1(ADDR_PCF1);
-PCF8574 pcf2(ADDR_PCF2);
+// Output topology, filled from BOARD_LAYOUT or config.json "io"
+IoDevice ioDevices[MAX_IO_DEVICES];
+int ioDeviceCount = 0;
+ChannelMap outputMap[MAX_OUTPUTS];
+int outputCount = 0;
+bool ioTopologyCustom = false; // Loaded from config.json, written back on save
+
 LiquidCrystal_I2C lcd(ADDR_LCD, 16, 2);
 WebServer server(80);
 
-WiFiClient espClient;
+// Socket PubSubClient runs on once the state machine has the session up,
+// see MQTT CONNECT STATE MACHINE
+class MqttSocketClient : public WiFiClient
+{
+public:
+  MqttSocketClient() {}
+  MqttSocketClient(int fd, const uint8_t *connack);
+
+  size_t write(uint8_t data) override;
+  size_t write(const uint8_t *buf, size_t size) override;
+  int available() override;
+  int read() override;
+  int peek() override;
+
+private:
+  uint8_t replay[4] = {};   // CONNACK handed to PubSubClient::connect()
+  uint8_t replayLeft = 0;
+  bool dropConnect = false; // PubSubClient's own CONNECT is not sent
+};
+
+MqttSocketClient espClient;
 PubSubClient mqttClient(espClient);
 WebSocketsClient wsClient;
+WiFiUDP udpCtrl;
 
 // ==================== GLOBAL VARIABLES ====================
 bool wifiConnected = false;
-bool remoteConnected = false;
+bool remoteConnected = false; // Any transport connected
+bool mqttConnected = false;
+bool wsConnected = false;
 bool modeSwitching = false;
 bool lcdNeedsRedraw = true;
-bool isRemoteReconnecting = false;
 
-unsigned long lastRemotePublish = 0;
-unsigned long lastRemoteReconnect = 0;
-unsigned long remoteDisconnectTime = 0;
+Transport transports[TRANSPORT_COUNT];
+unsigned long snapshotRenders = 0; // Shared state JSON rebuilt
+unsigned long snapshotHits = 0;    // Served from cache
+
 unsigned long lastLcdPageSwap = 0;
 
-int lcdOutputPage = 0;
+// UDP binary control counters
+bool udpCtrlRunning = false;
+uint32_t udpLastSeq = 0;
+uint32_t udpSeqReserved = 0; // Persisted high-water mark, see udpSeqReserve()
+unsigned long udpRxFrames = 0;
+unsigned long udpBadFrames = 0;
+unsigned long udpBadTags = 0;
+unsigned long udpReplays = 0;
+
+WifiState wifiState = WIFI_STATE_CONNECTING;
+unsigned long wifiConnectStart = 0;
+bool networkServicesStarted = false;
+
+// MQTT connect state machine + counters
+MqttConnState mqttConnState = MQTT_CONN_IDLE;
+int mqttSockFd = -1;
+unsigned long mqttConnStarted = 0;
+unsigned long mqttBackoffMs = 0;
+unsigned long mqttNextAttempt = 0;
+unsigned long mqttReconnectAttempts = 0;
+unsigned long mqttDisconnectedTotalMs = 0;
+unsigned long mqttDisconnectedSince = 0; // 0 = connected
+
+// Broker address cache + async DNS result (written from the lwIP task)
+IPAddress mqttServerAddr;
+String mqttResolvedHost;
+unsigned long mqttResolvedAt = 0;
+std::atomic<uint32_t> mqttDnsGen(0);
+std::atomic<uint8_t> mqttDnsResult(MQTT_DNS_NONE);
+std::atomic<uint32_t> mqttDnsAddr(0);
+
+// Output journal (state + toggle counters on flash)
+OutputBits journalDirty; // Channels changed since last flush
+bool journalRestoring = false;
+unsigned long journalLastFlush = 0;
+uint32_t journalSeq = 0;
+uint32_t journalFileRecords = 0;
+unsigned long journalRecordsWritten = 0;
+unsigned long journalFlushes = 0;
+unsigned long journalCompactions = 0;
+unsigned long journalRestoreUs = 0;
+
+// Config hot-apply (no reboot), downtime of the last apply per subsystem
+uint8_t hotApplyPending = 0;
+unsigned long hotApplyAt = 0;
+unsigned long hotApplyWifiSince = 0; // 0 = not waiting
+unsigned long hotApplyTransportSince[TRANSPORT_COUNT] = {0};
+unsigned long hotApplyWifiDowntimeMs = 0;
+unsigned long hotApplyTransportDowntimeMs[TRANSPORT_COUNT] = {0};
+unsigned long hotApplyUdpDowntimeUs = 0;
+unsigned long hotApplyCount = 0;
+
+// Offline telemetry ring (toggles buffered while MQTT is down)
+uint32_t telemetryHead = 0; // Free-running, index = head % TELEMETRY_BUFFER_SIZE
+uint32_t telemetryTail = 0;
+unsigned long telemetryLastChunk = 0;
+unsigned long telemetryDropped = 0;
+unsigned long telemetryFlushed = 0;
+unsigned long telemetryBatches = 0;
+
+// Deferred actions + RPC duplicate cache
+unsigned long deferredRun = 0;
+unsigned long deferredCoalesced = 0;
+unsigned long deferredDropped = 0;
+unsigned long rpcExecuted = 0;
+unsigned long rpcDuplicates = 0;
+
+// Admission control + per-loop output coalescing
+unsigned long cmdAdmitted[CMD_SOURCE_COUNT] = {0};
+unsigned long cmdDropped[CMD_SOURCE_COUNT] = {0};
+unsigned long outputsCoalesced = 0;
+OutputBits pendingOutputMask; // Channels with a queued command
+OutputBits pendingOutputValue;
+CmdSource pendingOutputSource[MAX_OUTPUTS];
+bool statePublishPending = false;
+
+// ThingsBoard shared attributes
+unsigned long attrUpdates = 0; // Attribute messages applied
+unsigned long attrChanges = 0; // Channel fields that actually changed
+
+unsigned long namedGroupCommits = 0; // Group commands applied
+
+DeferredSave configSave = {"config", 500, 5000};     // /config.json
+DeferredSave channelsSave = {"channels", 2000, 10000}; // /channels.bin: 2 s quiet, max 10 s
 
-#define LCD_PAGES 5
+int lcdOutputPage = 0;
+unsigned long lcdRefreshes = 0;
+unsigned long lcdBytesSent = 0;        // HD44780 bytes (commands + characters)
+unsigned long lcdLastRefreshBytes = 0;
+unsigned long lcdRefreshBytes = 0; // Sent since the display last matched the frame
+unsigned long lcdSliceMaxUs = 0;   // Longest single LCD byte, worst extra wait for a relay write
+
+#define LCD_COLS 16
+#define LCD_ROWS 2
+#define LCD_I2C_BYTES_PER_LCD_BYTE 6 // 4-bit mode: 2 nibbles x (data, EN high, EN low)
 #define LCD_PAGE_SWAP_MS 2000 
 #define REMOTE_RECONNECT_TIMEOUT 15000
 
@@ -121,547 +484,3367 @@ int lcdOutputPage = 0;
 // ==================== FORWARD DECLARATIONS ====================
 void updateLCD();
 bool saveConfig();
+void requestConfigSave();
 void switchMode(CommMode newMode, bool saveToConfig = true);
-void mqttPublish();
-void wsPublish();
+bool mqttPublish();
+bool wsPublish();
 String getStatusJSON();
-void processCommand(String command, String source);
+void processCommand(String command, CmdSource source);
 void rebuildSyncGroups();
+void syncGroupUpdate(int index);
 void processSyncGroups();
-
-// ==================== CHANNEL MAPPING ====================
-void initChannelMap()
+void namedGroupsFromJson(JsonVariantConst list);
+void namedGroupsToJson(JsonArray list);
+void mqttConnReset();
+unsigned long mqttDisconnectedMs();
+void startApMode();
+void transportsBegin();
+void transportsStop();
+void publishState();
+const char *transportsLabel();
+void configHotApply(uint8_t changes);
+void journalMark(int outputIndex);
+void markChannelConfigDirty();
+void flushPendingSaves();
+void telemetryRecord(int channel, bool state);
+const char *ioTypeName(IOType type);
+void i2cMetricsText(String &out);
+void requestPublish();
+void queueOutputMask(const OutputBits &mask, const OutputBits &values, CmdSource source);
+void timerCancel(int index);
+void timerMetricsText(String &out);
+
+// ==================== LOGGER ====================
+// Log lines are formatted into a RAM ring buffer and drained to Serial at the
+// end of loop(), only as much as the UART TX buffer accepts without blocking.
+// Single producer (loop task) / single consumer (logDrain), no locks.
+// Levels above LOG_LEVEL compile to nothing (set it in platformio.ini).
+#define LOG_LEVEL_NONE 0
+#define LOG_LEVEL_ERROR 1
+#define LOG_LEVEL_WARN 2
+#define LOG_LEVEL_INFO 3
+#define LOG_LEVEL_DEBUG 4
+
+#ifndef LOG_LEVEL
+#define LOG_LEVEL LOG_LEVEL_INFO
+#endif
+
+#define LOG_BUFFER_SIZE 4096 // Power of two
+#define LOG_LINE_MAX 192
+#define SERIAL_TX_BUFFER 1024
+
+char logBuffer[LOG_BUFFER_SIZE];
+std::atomic<uint32_t> logHead(0); // Write position, only advanced by logWrite()
+std::atomic<uint32_t> logTail(0); // Read position, only advanced by logDrain()
+uint32_t logLines = 0;
+uint32_t logDropped = 0;
+
+void logWrite(char level, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+void logWrite(char level, const char *fmt, ...)
 {
-  chMap[1] = {IO_ESP, PIN_IO_ESP1};
-  chMap[2] = {IO_ESP, PIN_IO_ESP2};
+  char line[LOG_LINE_MAX];
+  int len = snprintf(line, sizeof(line), "[%lu][%c] ", millis(), level);
 
-  for (uint8_t i = 0; i < 8; i++)
+  va_list args;
+  va_start(args, fmt);
+  int n = vsnprintf(line + len, sizeof(line) - len - 1, fmt, args);
+  va_end(args);
+
+  // vsnprintf returns the untruncated length
+  len += constrain(n, 0, (int)sizeof(line) - len - 2);
+  line[len++] = '\n';
+
+  uint32_t head = logHead.load(std::memory_order_relaxed);
+  uint32_t tail = logTail.load(std::memory_order_acquire);
+
+  // Whole lines only: a full buffer drops the line instead of blocking
+  if (LOG_BUFFER_SIZE - (head - tail) < (uint32_t)len)
   {
-    chMap[i + 3] = {IO_PCF1, i};
+    logDropped++;
+    return;
   }
 
-  chMap[11] = {IO_ESP, PIN_IO_ESP11};
-  chMap[12] = {IO_ESP, PIN_IO_ESP12};
+  uint32_t idx = head & (LOG_BUFFER_SIZE - 1);
+  uint32_t first = min((uint32_t)len, (uint32_t)(LOG_BUFFER_SIZE - idx));
+  memcpy(&logBuffer[idx], line, first);
+  memcpy(logBuffer, line + first, len - first);
+
+  logHead.store(head + len, std::memory_order_release);
+  logLines++;
+}
+
+void logDrain()
+{
+  uint32_t tail = logTail.load(std::memory_order_relaxed);
+  uint32_t head = logHead.load(std::memory_order_acquire);
 
-  for (uint8_t i = 0; i < 8; i++)
+  while (tail != head)
   {
-    chMap[i + 13] = {IO_PCF2, i};
+    int room = Serial.availableForWrite();
+    if (room <= 0)
+      break;
+
+    uint32_t idx = tail & (LOG_BUFFER_SIZE - 1);
+    uint32_t chunk = min(head - tail, (uint32_t)(LOG_BUFFER_SIZE - idx));
+    chunk = min(chunk, (uint32_t)room);
+
+    Serial.write((const uint8_t *)&logBuffer[idx], chunk);
+    tail += chunk;
   }
+
+  logTail.store(tail, std::memory_order_release);
 }
 
-// ==================== HARDWARE CONTROL ====================
-void initHardwarePins()
+#if LOG_LEVEL >= LOG_LEVEL_ERROR
+#define LOG_E(...) logWrite('E', __VA_ARGS__)
+#else
+#define LOG_E(...) do {} while (0)
+#endif
+
+#if LOG_LEVEL >= LOG_LEVEL_WARN
+#define LOG_W(...) logWrite('W', __VA_ARGS__)
+#else
+#define LOG_W(...) do {} while (0)
+#endif
+
+#if LOG_LEVEL >= LOG_LEVEL_INFO
+#define LOG_I(...) logWrite('I', __VA_ARGS__)
+#else
+#define LOG_I(...) do {} while (0)
+#endif
+
+#if LOG_LEVEL >= LOG_LEVEL_DEBUG
+#define LOG_D(...) logWrite('D', __VA_ARGS__)
+#else
+#define LOG_D(...) do {} while (0)
+#endif
+
+// ==================== EVENT TRACE ====================
+// Fixed-size binary ring of output events for post-mortem analysis.
+// Lives in .noinit RAM so it survives a panic/watchdog/software reset; a
+// BOOT event carrying esp_reset_reason() marks every restart. Optionally
+// spilled to TRACE_FILE in chunks. Download: /api/trace, decoder:
+// testTrace/decodeTrace.js
+#define TRACE_CAPACITY 1024 // Events, power of two
+#define TRACE_MAGIC 0x43525452 // "RTRC"
+#define TRACE_VERSION 2        // 2: stateMask is the bank of the channel
+#define TRACE_RING_MAGIC (TRACE_MAGIC ^ TRACE_VERSION) // A ring in another layout is discarded
+#define TRACE_FILE "/trace.bin"
+#define TRACE_FILE_OLD "/trace.old"
+#define TRACE_FILE_MAX 65536
+#define TRACE_SPILL_CHUNK 128
+
+enum TraceType : uint8_t
+{
+  TRACE_BOOT = 0,         // value = esp_reset_reason()
+  TRACE_COMMIT = 1,       // value = new state
+  TRACE_REJECT_LIMIT = 2, // value = requested state
+  TRACE_I2C_FAIL = 3,     // value = requested state
+  TRACE_WRITE_FAIL = 4    // value = requested state (GPIO)
+};
+
+struct __attribute__((packed)) TraceEvent
 {
-  pinMode(PIN_IO_ESP1, OUTPUT);
-  pinMode(PIN_IO_ESP2, OUTPUT);
-  pinMode(PIN_IO_ESP11, OUTPUT);
-  pinMode(PIN_IO_ESP12, OUTPUT);
+  uint32_t tsUs;      // micros()
+  uint32_t stateMask; // Output state after the event, bit n = CH(32 * bank + n + 1)
+  uint8_t type;
+  uint8_t source; // CmdSource
+  uint8_t channel;
+  uint8_t value;
+  uint8_t bank; // outputState word of the channel, 0 for BOOT
+};
 
-  digitalWrite(PIN_IO_ESP1, LOW); 
-  digitalWrite(PIN_IO_ESP2, LOW);
-  digitalWrite(PIN_IO_ESP11, HIGH);
-  digitalWrite(PIN_IO_ESP12, HIGH);
+struct __attribute__((packed)) TraceHeader
+{
+  uint32_t magic;
+  uint8_t version;
+  uint8_t eventSize;
+  uint16_t count;
+  uint32_t nowUs; // micros() when the download was taken
+  uint32_t totalEvents;
+};
 
-  // Init PCF8574 #1
-  Serial.println("Initializing PCF1 pins...");
-  for (int i = 0; i < 8; i++)
-  {
-    pcf1.pinMode(i, OUTPUT);
-    delay(5);                   // Small delay
-    pcf1.digitalWrite(i, HIGH); // HIGH = Relay OFF (inverted)
-    delay(5);
-    Serial.printf("  PCF1 P%d set to OUTPUT, HIGH\n", i);
-  }
+struct TraceRing
+{
+  uint32_t magic;
+  uint32_t head; // Total events written, index = head % TRACE_CAPACITY
+  TraceEvent events[TRACE_CAPACITY];
+};
 
-  // Init PCF8574 #2
-  Serial.println("Initializing PCF2 pins...");
-  for (int i = 0; i < 8; i++)
-  {
-    pcf2.pinMode(i, OUTPUT);
-    delay(5);
-    pcf2.digitalWrite(i, HIGH); // HIGH = Relay OFF (inverted)
-    delay(5);
-    Serial.printf("  PCF2 P%d set to OUTPUT, HIGH\n", i);
-  }
+__NOINIT_ATTR TraceRing traceRing;
+uint32_t traceSpilled = 0; // traceRing.head value already written to flash
+
+const char *cmdSourceName(uint8_t source)
+{
+  static const char *names[] = {"?", "boot", "http", "ws", "mqtt", "serial", "scheduler", "udp"};
+  return source < sizeof(names) / sizeof(names[0]) ? names[source] : "?";
+}
 
-  Serial.println("Hardware pins initialized");
+inline void traceRecord(uint8_t type, uint8_t source, uint8_t channel, uint8_t value)
+{
+  TraceEvent &e = traceRing.events[traceRing.head & (TRACE_CAPACITY - 1)];
+  uint8_t bank = channel > 0 ? (channel - 1) / 32 : 0;
+  e.tsUs = micros();
+  e.stateMask = outputState.words[bank];
+  e.type = type;
+  e.source = source;
+  e.channel = channel;
+  e.value = value;
+  e.bank = bank;
+  traceRing.head++;
 }
 
-void setOutput(int channel, bool state)
+void traceInit()
 {
-  if (channel < 1 || channel > TOTAL_OUTPUTS)
+  if (traceRing.magic != TRACE_RING_MAGIC)
   {
-    Serial.printf("Error: Invalid channel %d\n", channel);
-    return;
+    memset(&traceRing, 0, sizeof(traceRing));
+    traceRing.magic = TRACE_RING_MAGIC;
   }
+  traceSpilled = traceRing.head;
+  traceRecord(TRACE_BOOT, SRC_BOOT, 0, (uint8_t)esp_reset_reason());
+}
 
-  int outputIndex = channel - 1;
+uint32_t traceCount()
+{
+  return min(traceRing.head, (uint32_t)TRACE_CAPACITY);
+}
 
-  if (outputs[outputIndex].state == state)
-  {
-    Serial.printf("CH%02d: Sudah di state %s, tidak ada perpindahan.\n", channel, state ? "ON" : "OFF");
+void traceFileRotate()
+{
+  LittleFS.remove(TRACE_FILE_OLD);
+  LittleFS.rename(TRACE_FILE, TRACE_FILE_OLD);
+}
+
+// TRACE_FILE starts with a TraceHeader naming the event layout. A file
+// without one (older firmware) or in another layout is not appended to.
+bool traceFileCurrent()
+{
+  File f = LittleFS.open(TRACE_FILE, "r");
+  if (!f)
+    return true;
+  TraceHeader hdr;
+  bool ok = f.size() == 0 ||
+            (f.read((uint8_t *)&hdr, sizeof(hdr)) == sizeof(hdr) && hdr.magic == TRACE_MAGIC &&
+             hdr.version == TRACE_VERSION && hdr.eventSize == sizeof(TraceEvent));
+  f.close();
+  return ok;
+}
+
+// Appends events not yet on flash to TRACE_FILE (rotated at TRACE_FILE_MAX)
+void traceSpill()
+{
+  static bool fileChecked = false;
+  uint32_t head = traceRing.head;
+  if (head - traceSpilled > TRACE_CAPACITY)
+    traceSpilled = head - TRACE_CAPACITY; // Overwritten before we got to them
+
+  if (head == traceSpilled)
     return;
-  }
 
-  if (outputs[outputIndex].maxToggles > 0)
+  if (!fileChecked)
   {
-    if (outputs[outputIndex].currentToggles >= outputs[outputIndex].maxToggles)
-    {
-      Serial.printf("CH%02d: GAGAL! Batasan perpindahan (%d) telah tercapai.\n", channel, outputs[outputIndex].maxToggles);
-      return;
-    }
+    fileChecked = true;
+    if (!traceFileCurrent())
+      traceFileRotate();
   }
 
-  ChannelMap ch = chMap[channel];
-
-  bool writeSuccess = false;
+  File f = LittleFS.open(TRACE_FILE, "a");
+  if (!f)
+    return;
 
-  switch (ch.type)
-  {
-  case IO_ESP:
+  if (f.size() >= TRACE_FILE_MAX)
   {
-    if (ch.pin == PIN_IO_ESP1 || ch.pin == PIN_IO_ESP2)
-        {
-          digitalWrite(ch.pin, state ? HIGH : LOW);
-          Serial.printf("CH%02d: ESP GPIO%02d = %s (Normal)\n", channel, ch.pin, state ? "HIGH" : "LOW");
-          writeSuccess = true;
-        }
-        else if (ch.pin == PIN_IO_ESP11 || ch.pin == PIN_IO_ESP12)
-        {
-          digitalWrite(ch.pin, state ? LOW : HIGH);
-          Serial.printf("CH%02d: ESP GPIO%02d = %s (Inverted)\n", channel, ch.pin, state ? "LOW" : "HIGH");
-          writeSuccess = true;  
-        }
-        else
-        {
-          writeSuccess = false;
-        }
-        break;
+    f.close();
+    traceFileRotate();
+    f = LittleFS.open(TRACE_FILE, "a");
+    if (!f)
+      return;
   }
 
-  case IO_PCF1:
+  if (f.size() == 0)
   {
-    // PCF8574 #1 - INVERTED logic untuk relay (LOW = ON)
-    pcf1.digitalWrite(ch.pin, state ? LOW : HIGH);
-
-    // Verify write
-    uint8_t readback = pcf1.digitalRead(ch.pin);
-    writeSuccess = (readback == (state ? LOW : HIGH));
-
-    Serial.printf("CH%02d: PCF1(0x%02X) P%d = %s (inverted) [%s]\n",
-                  channel, ADDR_PCF1, ch.pin,
-                  state ? "LOW" : "HIGH",
-                  writeSuccess ? "OK" : "FAIL");
-    break;
+    TraceHeader hdr = {TRACE_MAGIC, TRACE_VERSION, sizeof(TraceEvent), 0, (uint32_t)micros(), head};
+    f.write((const uint8_t *)&hdr, sizeof(hdr));
   }
 
-  case IO_PCF2:
+  while (traceSpilled != head)
   {
-    // PCF8574 #2 - INVERTED logic untuk relay (LOW = ON)
-    pcf2.digitalWrite(ch.pin, state ? LOW : HIGH);
+    uint32_t idx = traceSpilled & (TRACE_CAPACITY - 1);
+    uint32_t n = min(head - traceSpilled, (uint32_t)(TRACE_CAPACITY - idx));
+    f.write((const uint8_t *)&traceRing.events[idx], n * sizeof(TraceEvent));
+    traceSpilled += n;
+  }
+  f.close();
+}
+
+void traceSpillLoop()
+{
+  if (config.traceSpill && traceRing.head - traceSpilled >= TRACE_SPILL_CHUNK)
+    traceSpill();
+}
 
-    // Verify write
-    uint8_t readback2 = pcf2.digitalRead(ch.pin);
-    writeSuccess = (readback2 == (state ? LOW : HIGH));
+void traceClear()
+{
+  traceRing.head = 0;
+  traceSpilled = 0;
+  LittleFS.remove(TRACE_FILE);
+  LittleFS.remove(TRACE_FILE_OLD);
+}
 
-    Serial.printf("CH%02d: PCF2(0x%02X) P%d = %s (inverted) [%s]\n",
-                  channel, ADDR_PCF2, ch.pin,
-                  state ? "LOW" : "HIGH",
-                  writeSuccess ? "OK" : "FAIL");
-    break;
-  }
-  }
+// ==================== BOOT TIMING ====================
+#define MAX_BOOT_PHASES 16
 
-  if (writeSuccess)
-  {
-    outputs[outputIndex].state = state;
-    outputs[outputIndex].lastToggle = millis();
-    outputs[outputIndex].currentToggles++;
+struct BootPhase
+{
+  const char *name;
+  unsigned long us; // micros() at the end of the phase
+};
 
-    lcdNeedsRedraw = true;
-    lcdOutputPage = 0;
-    lastLcdPageSwap = millis();
+BootPhase bootPhases[MAX_BOOT_PHASES];
+int bootPhaseCount = 0;
 
-    Serial.printf("CH%02d: Perpindahan ke %d. Meteran: %d / %d\n", 
-                  channel, state, outputs[outputIndex].currentToggles, outputs[outputIndex].maxToggles);
-  }
-  else
+void bootMark(const char *name)
+{
+  if (bootPhaseCount < MAX_BOOT_PHASES)
   {
-    Serial.printf("Failed to set CH%02d!\n", channel);
+    bootPhases[bootPhaseCount++] = {name, micros()};
   }
 }
 
-void initOutputs()
+void printBootReport()
 {
-  for (int i = 0; i < TOTAL_OUTPUTS; i++)
+  Serial.println("Boot timing (us):");
+
+  unsigned long prev = 0;
+  for (int i = 0; i < bootPhaseCount; i++)
   {
-    outputs[i].name = "Channel " + String(i + 1);
-    outputs[i].state = false;
-    outputs[i].intervalOn = 5000;
-    outputs[i].intervalOff = 5000;
-    outputs[i].lastToggle = 0;
-    outputs[i].autoMode = false;
+    Serial.printf("  %-16s +%8lu  @%8lu\n", bootPhases[i].name, bootPhases[i].us - prev, bootPhases[i].us);
+    prev = bootPhases[i].us;
   }
 }
 
-// ==================== CONFIG MANAGEMENT ====================
-bool loadConfig()
-{
-  // ======== FORCE WEBSOCKET MODE ========
-  if (LittleFS.exists(CONFIG_FILE))
-  {
-    Serial.println("Found existing config.json");
+// ==================== LOOP METRICS ====================
+// Fixed-bucket histograms of loop() section durations, exported as
+// Prometheus text at /api/metrics and by the METRICS serial command.
+#define METRIC_BUCKETS 10
 
-    File file = LittleFS.open(CONFIG_FILE, "r");
-    if (file)
-    {
-      StaticJsonDocument<1024> doc;
-      DeserializationError error = deserializeJson(doc, file);
-      file.close();
+const unsigned long METRIC_BUCKET_US[METRIC_BUCKETS] = {
+    10, 50, 100, 500, 1000, 5000, 10000, 50000, 100000, 500000};
 
-      // if (!error)
-      // {
-      //   int mode = doc["commMode"] | 1;
+enum LoopSection
+{
+  SEC_WIFI,
+  SEC_UDP,
+  SEC_SERIAL,
+  SEC_HTTP,
+  SEC_TRANSPORT,
+  SEC_SYNC,
+  SEC_LCD,
+  SEC_LOG,
+  SEC_PERSIST,
+  SEC_LOOP, // Whole iteration
+  LOOP_SECTION_COUNT
+};
 
-      //   if (mode == 0)
-      //   {
-      //     Serial.println("OLD CONFIG WITH MQTT MODE DETECTED!");
-      //     Serial.println("Deleting old config...");
-      //     LittleFS.remove(CONFIG_FILE);
-      //   }
-      // }
-    }
-  }
-  // =====================================
+const char *LOOP_SECTION_NAMES[LOOP_SECTION_COUNT] = {
+    "wifi", "udp", "serial", "http", "transport", "sync_groups", "lcd", "log", "persist", "loop"};
 
-  if (!LittleFS.exists(CONFIG_FILE))
-  {
-    Serial.println("Config file tidak ditemukan, menggunakan default");
+struct LoopHistogram
+{
+  uint32_t buckets[METRIC_BUCKETS + 1]; // Last bucket = +Inf
+  uint64_t sumUs;
+  uint32_t count;
+  uint32_t maxUs;
+};
 
-    // Set default config
-    config.wifiSSID = "";
-    config.wifiPassword = "";
-    config.serverIP = "";
-    config.serverPort;
-    config.serverPath = "";
-    config.serverToken = "";
-    config.webUsername = "admin";
-    config.webPassword = "admin123";
-    config.commMode = MODE_WEBSOCKET;
+LoopHistogram loopHist[LOOP_SECTION_COUNT];
 
-    Serial.println("   Default credentials set:");
-    Serial.println("   Username: admin");
-    Serial.println("   Password: admin123");
-    Serial.println("   Mode: WebSocket (1)");
+void histRecord(LoopHistogram &h, unsigned long us)
+{
+  int b = 0;
+  while (b < METRIC_BUCKETS && us > METRIC_BUCKET_US[b])
+    b++;
+
+  h.buckets[b]++;
+  h.sumUs += us;
+  h.count++;
+  if (us > h.maxUs)
+    h.maxUs = us;
+}
 
-    // SAVE default config
-    saveConfig();
+void metricRecord(LoopSection section, unsigned long us)
+{
+  histRecord(loopHist[section], us);
+}
 
-    return false;
-  }
+// Prometheus lines of one histogram series; labels without braces,
+// e.g. "section=\"wifi\""
+void histText(String &out, const char *name, const char *labels, const LoopHistogram &h)
+{
+  char line[160];
+  uint32_t cumulative = 0;
+  const char *sep = *labels ? "," : ""; // labels may be empty
 
-  // File exists, try to load
-  File file = LittleFS.open(CONFIG_FILE, "r");
-  if (!file)
+  for (int b = 0; b < METRIC_BUCKETS; b++)
   {
-    Serial.println("Failed to open config file");
-
-    // Set default
-    config.wifiSSID = "";
-    config.wifiPassword = "";
-    config.serverIP = "";
-    config.serverPort;
-    config.serverPath = "";
-    config.serverToken = "";
-    config.webUsername = "admin";
-    config.webPassword = "admin123";
-    config.commMode = MODE_WEBSOCKET;
-    saveConfig();
-
-    return false;
+    cumulative += h.buckets[b];
+    snprintf(line, sizeof(line), "%s_bucket{%s%sle=\"%lu\"} %u\n", name, labels, sep, METRIC_BUCKET_US[b], cumulative);
+    out += line;
   }
+  snprintf(line, sizeof(line), "%s_bucket{%s%sle=\"+Inf\"} %u\n", name, labels, sep, h.count);
+  out += line;
+  snprintf(line, sizeof(line), "%s_sum{%s} %llu\n", name, labels, (unsigned long long)h.sumUs);
+  out += line;
+  snprintf(line, sizeof(line), "%s_count{%s} %u\n", name, labels, h.count);
+  out += line;
+}
 
-  String fileContent = file.readString();
-  file.close();
+// Records the time since lapStartUs and returns the new lap start
+unsigned long metricLap(LoopSection section, unsigned long lapStartUs)
+{
+  unsigned long now = micros();
+  metricRecord(section, now - lapStartUs);
+  return now;
+}
 
-  Serial.println("Config file content:");
-  Serial.println(fileContent);
-  Serial.println("---");
+void resetLoopMetrics()
+{
+  memset(loopHist, 0, sizeof(loopHist));
+  lcdSliceMaxUs = 0;
+}
 
-  StaticJsonDocument<1024> doc;
-  DeserializationError error = deserializeJson(doc, fileContent);
+String getMetricsText()
+{
+  String out;
+  out.reserve(6144);
+  char line[128];
 
-  if (error)
+  out += "# HELP relay_boot_phase_end_us micros() at the end of each setup() phase\n";
+  out += "# TYPE relay_boot_phase_end_us gauge\n";
+  for (int i = 0; i < bootPhaseCount; i++)
   {
-    Serial.println("JSON Parse Error: " + String(error.c_str()));
-    Serial.println("Config file corrupt! Deleting and using default...");
-
-    // Delete corrupt file
-    LittleFS.remove(CONFIG_FILE);
-
-    // Set default
-    config.wifiSSID = "";
-    config.wifiPassword = "";
-    config.serverIP = "";
-    config.serverPort;
-    config.serverPath = "";
-    config.serverToken = "";
-    config.webUsername = "admin";
-    config.webPassword = "admin123";
-    config.commMode = MODE_WEBSOCKET;
-
-    // Save default
-    saveConfig();
+    snprintf(line, sizeof(line), "relay_boot_phase_end_us{phase=\"%s\"} %lu\n", bootPhases[i].name, bootPhases[i].us);
+    out += line;
+  }
 
-    Serial.println("   Default config created");
-    Serial.println("   Username: admin");
-    Serial.println("   Password: admin123");
-    Serial.println("   Mode: WebSocket");
+  out += "# HELP relay_boot_phase_duration_us Duration of each setup() phase\n";
+  out += "# TYPE relay_boot_phase_duration_us gauge\n";
+  unsigned long prev = 0;
+  for (int i = 0; i < bootPhaseCount; i++)
+  {
+    snprintf(line, sizeof(line), "relay_boot_phase_duration_us{phase=\"%s\"} %lu\n", bootPhases[i].name, bootPhases[i].us - prev);
+    out += line;
+    prev = bootPhases[i].us;
+  }
 
-    return false;
+  out += "# HELP relay_loop_section_us Duration of loop() sections\n";
+  out += "# TYPE relay_loop_section_us histogram\n";
+  for (int s = 0; s < LOOP_SECTION_COUNT; s++)
+  {
+    snprintf(line, sizeof(line), "section=\"%s\"", LOOP_SECTION_NAMES[s]);
+    histText(out, "relay_loop_section_us", line, loopHist[s]);
   }
 
-  // Parse berhasil
-  config.wifiSSID = doc["wifiSSID"] | "";
-  config.wifiPassword = doc["wifiPassword"] | "";
-  config.serverIP = doc["serverIP"] | "";
-  config.serverPort = doc["serverPort"];
-  config.serverPath = doc["serverPath"] | "/";
-  config.serverToken = doc["serverToken"] | "";
-  config.webUsername = doc["webUsername"] | "admin";
-  config.webPassword = doc["webPassword"] | "admin123";
+  out += "# HELP relay_loop_section_max_us Worst-case duration of loop() sections\n";
+  out += "# TYPE relay_loop_section_max_us gauge\n";
+  for (int s = 0; s < LOOP_SECTION_COUNT; s++)
+  {
+    snprintf(line, sizeof(line), "relay_loop_section_max_us{section=\"%s\"} %u\n", LOOP_SECTION_NAMES[s], loopHist[s].maxUs);
+    out += line;
+  }
 
-  if (doc.containsKey("commMode"))
+  out += "# TYPE relay_uptime_seconds counter\n";
+  out += "relay_uptime_seconds " + String(millis() / 1000) + "\n";
+  out += "# TYPE relay_free_heap_bytes gauge\n";
+  out += "relay_free_heap_bytes " + String(ESP.getFreeHeap()) + "\n";
+  out += "# TYPE relay_remote_connected gauge\n";
+  out += "relay_remote_connected{transport=\"mqtt\"} " + String(mqttConnected ? 1 : 0) + "\n";
+  out += "relay_remote_connected{transport=\"ws\"} " + String(wsConnected ? 1 : 0) + "\n";
+  out += "# TYPE relay_transport_publishes_total counter\n";
+  out += "relay_transport_publishes_total{transport=\"mqtt\"} " + String(transports[MODE_MQTT].publishes) + "\n";
+  out += "relay_transport_publishes_total{transport=\"ws\"} " + String(transports[MODE_WEBSOCKET].publishes) + "\n";
+  out += "# TYPE relay_snapshot_renders_total counter\n";
+  out += "relay_snapshot_renders_total " + String(snapshotRenders) + "\n";
+  out += "# TYPE relay_snapshot_hits_total counter\n";
+  out += "relay_snapshot_hits_total " + String(snapshotHits) + "\n";
+  out += "# TYPE relay_telemetry_buffered gauge\n";
+  out += "relay_telemetry_buffered " + String(telemetryHead - telemetryTail) + "\n";
+  out += "# TYPE relay_telemetry_dropped_total counter\n";
+  out += "relay_telemetry_dropped_total " + String(telemetryDropped) + "\n";
+  out += "# TYPE relay_telemetry_flushed_total counter\n";
+  out += "relay_telemetry_flushed_total " + String(telemetryFlushed) + "\n";
+  out += "# TYPE relay_telemetry_batches_total counter\n";
+  out += "relay_telemetry_batches_total " + String(telemetryBatches) + "\n";
+  out += "# TYPE relay_commands_total counter\n";
+  for (int s = SRC_HTTP; s <= SRC_MQTT; s++)
   {
-    config.commMode = (CommMode)(doc["commMode"].as<int>());
+    out += "relay_commands_total{source=\"" + String(cmdSourceName(s)) + "\",result=\"admitted\"} " + String(cmdAdmitted[s]) + "\n";
+    out += "relay_commands_total{source=\"" + String(cmdSourceName(s)) + "\",result=\"dropped\"} " + String(cmdDropped[s]) + "\n";
   }
-  else
+  out += "# TYPE relay_commands_coalesced_total counter\n";
+  out += "relay_commands_coalesced_total " + String(outputsCoalesced) + "\n";
+  out += "# TYPE relay_group_commands_total counter\n";
+  out += "relay_group_commands_total " + String(namedGroupCommits) + "\n";
+  out += "# TYPE relay_rpc_requests_total counter\n";
+  out += "relay_rpc_requests_total{result=\"executed\"} " + String(rpcExecuted) + "\n";
+  out += "relay_rpc_requests_total{result=\"duplicate\"} " + String(rpcDuplicates) + "\n";
+  out += "# TYPE relay_deferred_actions_total counter\n";
+  out += "relay_deferred_actions_total{result=\"run\"} " + String(deferredRun) + "\n";
+  out += "relay_deferred_actions_total{result=\"coalesced\"} " + String(deferredCoalesced) + "\n";
+  out += "relay_deferred_actions_total{result=\"dropped\"} " + String(deferredDropped) + "\n";
+  out += "# TYPE relay_attribute_updates_total counter\n";
+  out += "relay_attribute_updates_total " + String(attrUpdates) + "\n";
+  out += "# TYPE relay_attribute_changes_total counter\n";
+  out += "relay_attribute_changes_total " + String(attrChanges) + "\n";
+  out += "# TYPE relay_lcd_refreshes_total counter\n";
+  out += "relay_lcd_refreshes_total " + String(lcdRefreshes) + "\n";
+  out += "# TYPE relay_lcd_i2c_bytes_total counter\n";
+  out += "relay_lcd_i2c_bytes_total " + String(lcdBytesSent * LCD_I2C_BYTES_PER_LCD_BYTE) + "\n";
+  out += "# TYPE relay_lcd_last_refresh_i2c_bytes gauge\n";
+  out += "relay_lcd_last_refresh_i2c_bytes " + String(lcdLastRefreshBytes * LCD_I2C_BYTES_PER_LCD_BYTE) + "\n";
+  out += "# TYPE relay_lcd_slice_max_us gauge\n";
+  out += "relay_lcd_slice_max_us " + String(lcdSliceMaxUs) + "\n";
+  out += "# TYPE relay_io_writes_total counter\n";
+  for (int d = 0; d < ioDeviceCount; d++)
+  {
+    snprintf(line, sizeof(line), "relay_io_writes_total{device=\"%d\",type=\"%s\"} %lu\n", d, ioTypeName(ioDevices[d].type), ioDevices[d].writes);
+    out += line;
+  }
+  out += "# TYPE relay_io_errors_total counter\n";
+  for (int d = 0; d < ioDeviceCount; d++)
+  {
+    snprintf(line, sizeof(line), "relay_io_errors_total{device=\"%d\",type=\"%s\"} %lu\n", d, ioTypeName(ioDevices[d].type), ioDevices[d].errors);
+    out += line;
+  }
+  out += "# TYPE relay_io_repairs_total counter\n";
+  for (int d = 0; d < ioDeviceCount; d++)
   {
-    Serial.println("commMode not found in config, using WebSocket");
-    config.commMode = MODE_WEBSOCKET;
+    snprintf(line, sizeof(line), "relay_io_repairs_total{device=\"%d\",type=\"%s\"} %lu\n", d, ioTypeName(ioDevices[d].type), ioDevices[d].repairs);
+    out += line;
   }
+  i2cMetricsText(out);
+  timerMetricsText(out);
+  out += "# TYPE relay_mqtt_reconnect_attempts_total counter\n";
+  out += "relay_mqtt_reconnect_attempts_total " + String(mqttReconnectAttempts) + "\n";
+  out += "# TYPE relay_mqtt_disconnected_ms_total counter\n";
+  out += "relay_mqtt_disconnected_ms_total " + String(mqttDisconnectedMs()) + "\n";
+  out += "# TYPE relay_log_lines_total counter\n";
+  out += "relay_log_lines_total " + String(logLines) + "\n";
+  out += "# TYPE relay_log_dropped_total counter\n";
+  out += "relay_log_dropped_total " + String(logDropped) + "\n";
+  out += "# TYPE relay_trace_events_total counter\n";
+  out += "relay_trace_events_total " + String(traceRing.head) + "\n";
+  out += "# TYPE relay_journal_records_total counter\n";
+  out += "relay_journal_records_total " + String(journalRecordsWritten) + "\n";
+  out += "# TYPE relay_journal_flushes_total counter\n";
+  out += "relay_journal_flushes_total " + String(journalFlushes) + "\n";
+  out += "# TYPE relay_journal_compactions_total counter\n";
+  out += "relay_journal_compactions_total " + String(journalCompactions) + "\n";
+  out += "# TYPE relay_journal_restore_us gauge\n";
+  out += "relay_journal_restore_us " + String(journalRestoreUs) + "\n";
+  out += "# TYPE relay_config_hot_apply_total counter\n";
+  out += "relay_config_hot_apply_total " + String(hotApplyCount) + "\n";
+  out += "# TYPE relay_config_apply_downtime_ms gauge\n";
+  out += "relay_config_apply_downtime_ms{kind=\"wifi\"} " + String(hotApplyWifiDowntimeMs) + "\n";
+  out += "relay_config_apply_downtime_ms{kind=\"mqtt\"} " + String(hotApplyTransportDowntimeMs[MODE_MQTT]) + "\n";
+  out += "relay_config_apply_downtime_ms{kind=\"ws\"} " + String(hotApplyTransportDowntimeMs[MODE_WEBSOCKET]) + "\n";
+  out += "relay_config_apply_downtime_ms{kind=\"udp\"} " + String((hotApplyUdpDowntimeUs + 999) / 1000) + "\n";
+  out += "relay_config_apply_downtime_ms{kind=\"credentials\"} 0\n";
+  out += "# TYPE relay_settings_save_requests_total counter\n";
+  out += "relay_settings_save_requests_total{file=\"config\"} " + String(configSave.requests) + "\n";
+  out += "relay_settings_save_requests_total{file=\"channels\"} " + String(channelsSave.requests) + "\n";
+  out += "# TYPE relay_settings_writes_total counter\n";
+  out += "relay_settings_writes_total{file=\"config\"} " + String(configSave.writes) + "\n";
+  out += "relay_settings_writes_total{file=\"channels\"} " + String(channelsSave.writes) + "\n";
+  out += "# TYPE relay_udp_frames_total counter\n";
+  out += "relay_udp_frames_total{result=\"accepted\"} " + String(udpRxFrames - udpReplays) + "\n";
+  out += "relay_udp_frames_total{result=\"malformed\"} " + String(udpBadFrames) + "\n";
+  out += "relay_udp_frames_total{result=\"bad_tag\"} " + String(udpBadTags) + "\n";
+  out += "relay_udp_frames_total{result=\"replay\"} " + String(udpReplays) + "\n";
+
+  return out;
+}
 
-  // Trim whitespace
-  config.wifiSSID.trim();
-  config.wifiPassword.trim();
-  config.serverIP.trim();
-  config.serverPath.trim();
-  config.serverToken.trim();
-  config.webUsername.trim();
-  config.webPassword.trim();
+// ==================== I2C BUS ====================
+// Every expander and LCD transaction goes through here. Each device runs at
+// the fastest clock its part allows (the bus is re-clocked only when the
+// next device differs). A failed transaction is retried with a doubling
+// pause; a bus error or timeout (SDA held low by a slave that lost a clock)
+// first gets the 9-clock recovery. Wire times out after I2C_TIMEOUT_MS, so
+// a stuck line costs a few ms instead of hanging loop().
+//
+// Priority, highest first: relay port writes, their readback verifies,
+// LCD bytes. ioFlushDirty() writes every dirty port before it reads any of
+// them back (i2cVerifyPending), and the LCD only gets the bus when neither
+// is outstanding (i2cGrant).
+#define I2C_STD_HZ 100000
+#define I2C_FAST_HZ 400000
+#ifndef I2C_PCF8574_HZ
+#define I2C_PCF8574_HZ I2C_STD_HZ // Datasheet limit; most modules also run at 400 kHz
+#endif
+#define I2C_TIMEOUT_MS 10     // Wire default is 50 ms
+#define I2C_RETRIES 2         // Extra attempts after the first
+#define I2C_RETRY_BASE_US 100 // Pause before retry n: base << (n - 1)
+#define I2C_MAX_DEVICES (MAX_IO_DEVICES + 3) // Expanders + LCD + board expanders driven OFF at boot
+
+// Wire.endTransmission() results (ESP32 core)
+#define I2C_OK 0
+#define I2C_NACK_ADDR 2
+#define I2C_NACK_DATA 3
+#define I2C_BUS_ERROR 4
+#define I2C_TIMEOUT 5
+
+enum I2cPriority : uint8_t
+{
+  I2C_PRIO_RELAY,
+  I2C_PRIO_VERIFY,
+  I2C_PRIO_LCD
+};
 
-  Serial.println("   Config loaded successfully");
-  Serial.println("   Login credentials:");
-  Serial.println("   Username: '" + config.webUsername + "'");
-  Serial.println("   Password: '" + config.webPassword + "'");
-  Serial.printf("   Mode: %s (%d)\n", config.commMode == MODE_MQTT ? "MQTT" : "WebSocket", (int)config.commMode);
+struct I2cDevice
+{
+  uint8_t addr;
+  char name[8]; // Metrics label: "io0".."io7", "lcd"
+  uint32_t clockHz;
+  LoopHistogram latency; // Whole transaction, retries included
+  unsigned long transactions;
+  unsigned long retries;
+  unsigned long nacks;
+  unsigned long busErrors; // Bus error or timeout, triggers a recovery
+  unsigned long failures;  // Still failing after I2C_RETRIES
+};
 
-  return true;
+I2cDevice i2cDevices[I2C_MAX_DEVICES];
+int i2cDeviceCount = 0;
+uint32_t i2cClockHz = 0;
+uint8_t i2cVerifyPending = 0; // Bit d = ioDevices[d] written, not read back yet
+unsigned long i2cRecoveries = 0;
+unsigned long i2cRecoveryFailures = 0; // SDA still low afterwards
+unsigned long i2cFirstErrorUs = 0;     // micros() of the first failed transaction or port mismatch, 0 = none since cleared
+
+#ifdef I2C_FAULT_INJECT
+uint8_t i2cFaultRun(IoDevice &dev, uint8_t (*txn)(IoDevice &));
+bool i2cFaultStuck();
+#define I2C_RUN(dev, txn) i2cFaultRun(dev, txn)
+#else
+#define I2C_RUN(dev, txn) txn(dev)
+#endif
+
+void i2cNoteError()
+{
+  if (i2cFirstErrorUs == 0)
+    i2cFirstErrorUs = micros() | 1;
 }
 
-bool saveConfig()
+uint32_t ioTypeClockHz(IOType type)
 {
-  StaticJsonDocument<1024> doc;
-
-  doc["wifiSSID"] = config.wifiSSID;
-  doc["wifiPassword"] = config.wifiPassword;
-  doc["serverIP"] = config.serverIP;
-  doc["serverPort"] = config.serverPort;
-  doc["serverPath"] = config.serverPath;
-  doc["serverToken"] = config.serverToken;
-  doc["webUsername"] = config.webUsername;
-  doc["webPassword"] = config.webPassword;
-  doc["commMode"] = (int)config.commMode;
+  // PCF8575 400 kHz, MCP23017 1.7 MHz (fast mode is enough for 2 bytes)
+  return type == IO_PCF8574 ? I2C_PCF8574_HZ : I2C_FAST_HZ;
+}
 
-  File file = LittleFS.open(CONFIG_FILE, "w");
+// Returns the index into i2cDevices[], the same one for a known address
+int i2cRegister(uint8_t addr, const char *name, uint32_t clockHz)
+{
+  for (int i = 0; i < i2cDeviceCount; i++)
+  {
+    if (i2cDevices[i].addr == addr)
+      return i;
+  }
+  if (i2cDeviceCount == I2C_MAX_DEVICES)
+    return -1;
+
+  I2cDevice &d = i2cDevices[i2cDeviceCount];
+  memset(&d, 0, sizeof(d));
+  d.addr = addr;
+  strlcpy(d.name, name, sizeof(d.name));
+  d.clockHz = clockHz;
+  return i2cDeviceCount++;
+}
+
+void i2cUseClock(uint32_t hz)
+{
+  if (hz == i2cClockHz)
+    return;
+  Wire.setClock(hz);
+  i2cClockHz = hz;
+}
+
+void i2cBegin()
+{
+  Wire.begin();
+  Wire.setTimeOut(I2C_TIMEOUT_MS);
+  i2cClockHz = 0;
+  i2cUseClock(I2C_STD_HZ);
+}
+
+// A slave that was reset or lost a clock mid-byte can hold SDA low forever.
+// Clock SCL (at most 9 times) until it lets go, send a STOP and restart Wire.
+bool i2cBusRecover()
+{
+  i2cRecoveries++;
+  Wire.end();
+
+  pinMode(SDA, INPUT_PULLUP);
+  pinMode(SCL, OUTPUT_OPEN_DRAIN);
+  digitalWrite(SCL, HIGH);
+  delayMicroseconds(5);
+  for (int i = 0; i < 9 && digitalRead(SDA) == LOW; i++)
+  {
+    digitalWrite(SCL, LOW);
+    delayMicroseconds(5);
+    digitalWrite(SCL, HIGH);
+    delayMicroseconds(5);
+  }
+
+  // STOP: SDA rises while SCL is high
+  pinMode(SDA, OUTPUT_OPEN_DRAIN);
+  digitalWrite(SDA, LOW);
+  delayMicroseconds(5);
+  digitalWrite(SDA, HIGH);
+  delayMicroseconds(5);
+  pinMode(SDA, INPUT_PULLUP);
+  bool released = digitalRead(SDA) == HIGH && digitalRead(SCL) == HIGH;
+#ifdef I2C_FAULT_INJECT
+  released = released && !i2cFaultStuck();
+#endif
+
+  i2cBegin();
+  if (released)
+  {
+    LOG_W("I2C: Bus recovery OK");
+  }
+  else
+  {
+    i2cRecoveryFailures++;
+    LOG_E("I2C: Bus recovery gagal, SDA/SCL masih LOW");
+  }
+  return released;
+}
+
+// One expander transaction, returns the Wire status
+typedef uint8_t (*I2cTxn)(IoDevice &dev);
+
+// Runs txn with retries. A NACK is retried as is, a bus error or timeout
+// after a bus recovery.
+bool i2cTransact(IoDevice &dev, I2cTxn txn)
+{
+  I2cDevice &d = i2cDevices[dev.bus];
+  unsigned long t0 = micros();
+  uint8_t status = I2C_OK;
+
+  for (int attempt = 0; attempt <= I2C_RETRIES; attempt++)
+  {
+    if (attempt > 0)
+    {
+      d.retries++;
+      delayMicroseconds(I2C_RETRY_BASE_US << (attempt - 1));
+    }
+
+    i2cUseClock(d.clockHz);
+    status = I2C_RUN(dev, txn);
+    if (status == I2C_OK)
+      break;
+
+    i2cNoteError();
+    if (status == I2C_NACK_ADDR || status == I2C_NACK_DATA)
+    {
+      d.nacks++;
+    }
+    else
+    {
+      d.busErrors++;
+      i2cBusRecover();
+    }
+  }
+
+  d.transactions++;
+  histRecord(d.latency, micros() - t0);
+  if (status != I2C_OK)
+  {
+    d.failures++;
+    LOG_W("I2C 0x%02X: Gagal (status %u) setelah %d retry", d.addr, status, I2C_RETRIES);
+  }
+  return status == I2C_OK;
+}
+
+// requestFrom() only returns a byte count. A short read with SDA low is a
+// stuck bus, otherwise the device did not answer.
+uint8_t i2cReadStatus(uint8_t got, uint8_t want)
+{
+  if (got == want)
+    return I2C_OK;
+  return digitalRead(SDA) == LOW ? I2C_BUS_ERROR : I2C_NACK_ADDR;
+}
+
+// Whether a transaction of that priority may use the bus now
+bool i2cGrant(I2cPriority prio)
+{
+  switch (prio)
+  {
+  case I2C_PRIO_LCD:
+    return i2cVerifyPending == 0 && !pendingOutputMask.any();
+  default:
+    return true;
+  }
+}
+
+void i2cMetricsText(String &out)
+{
+  char line[128];
+  char labels[48];
+
+  out += "# HELP relay_i2c_transaction_us I2C transaction time per device, retries included\n";
+  out += "# TYPE relay_i2c_transaction_us histogram\n";
+  for (int i = 0; i < i2cDeviceCount; i++)
+  {
+    snprintf(labels, sizeof(labels), "device=\"%s\",addr=\"0x%02X\"", i2cDevices[i].name, i2cDevices[i].addr);
+    histText(out, "relay_i2c_transaction_us", labels, i2cDevices[i].latency);
+  }
+  out += "# TYPE relay_i2c_retries_total counter\n";
+  for (int i = 0; i < i2cDeviceCount; i++)
+  {
+    snprintf(line, sizeof(line), "relay_i2c_retries_total{device=\"%s\"} %lu\n", i2cDevices[i].name, i2cDevices[i].retries);
+    out += line;
+  }
+  out += "# TYPE relay_i2c_errors_total counter\n";
+  for (int i = 0; i < i2cDeviceCount; i++)
+  {
+    const I2cDevice &d = i2cDevices[i];
+    snprintf(line, sizeof(line), "relay_i2c_errors_total{device=\"%s\",kind=\"nack\"} %lu\n", d.name, d.nacks);
+    out += line;
+    snprintf(line, sizeof(line), "relay_i2c_errors_total{device=\"%s\",kind=\"bus\"} %lu\n", d.name, d.busErrors);
+    out += line;
+    snprintf(line, sizeof(line), "relay_i2c_errors_total{device=\"%s\",kind=\"failed\"} %lu\n", d.name, d.failures);
+    out += line;
+  }
+  out += "# TYPE relay_i2c_bus_recoveries_total counter\n";
+  out += "relay_i2c_bus_recoveries_total{result=\"ok\"} " + String(i2cRecoveries - i2cRecoveryFailures) + "\n";
+  out += "relay_i2c_bus_recoveries_total{result=\"failed\"} " + String(i2cRecoveryFailures) + "\n";
+  out += "# TYPE relay_i2c_clock_hz gauge\n";
+  out += "relay_i2c_clock_hz " + String(i2cClockHz) + "\n";
+}
+
+// ==================== CHANNEL MAPPING ====================
+// Output topology: up to MAX_IO_DEVICES I2C expanders (PCF8574, PCF8575,
+// MCP23017) plus ESP32 GPIOs, at most MAX_OUTPUTS channels. BOARD_DEVICES /
+// BOARD_LAYOUT describe the stock 20-channel board and are checked at
+// compile time. config.json "io" replaces them at boot and is checked by
+// the same rules at runtime (ioTopologyValid); an invalid one is logged and
+// the board layout is used instead.
+#define IO_DEVICE_GPIO -1
+
+constexpr IoDeviceConfig BOARD_DEVICES[] = {
+    {IO_PCF8574, ADDR_PCF1}, // Device 0
+    {IO_PCF8574, ADDR_PCF2}, // Device 1
+};
+
+constexpr ChannelMap BOARD_LAYOUT[] = {
+    {IO_DEVICE_GPIO, PIN_IO_ESP1, false}, // CH1
+    {IO_DEVICE_GPIO, PIN_IO_ESP2, false}, // CH2
+    {0, 0, true},                         // CH3..CH10: PCF8574 #1, relay ON = LOW
+    {0, 1, true},
+    {0, 2, true},
+    {0, 3, true},
+    {0, 4, true},
+    {0, 5, true},
+    {0, 6, true},
+    {0, 7, true},
+    {IO_DEVICE_GPIO, PIN_IO_ESP11, true}, // CH11
+    {IO_DEVICE_GPIO, PIN_IO_ESP12, true}, // CH12
+    {1, 0, true},                         // CH13..CH20: PCF8574 #2, relay ON = LOW
+    {1, 1, true},
+    {1, 2, true},
+    {1, 3, true},
+    {1, 4, true},
+    {1, 5, true},
+    {1, 6, true},
+    {1, 7, true},
+};
+
+#define BOARD_DEVICE_COUNT ((int)(sizeof(BOARD_DEVICES) / sizeof(BOARD_DEVICES[0])))
+#define BOARD_OUTPUTS ((int)(sizeof(BOARD_LAYOUT) / sizeof(BOARD_LAYOUT[0])))
+
+// GPIO 6-11 are the SPI flash, 34-39 are input only. SDA/SCL carry every
+// expander and the LCD, 1/3 are UART0 (Serial).
+constexpr bool espOutputPin(uint8_t pin)
+{
+  return pin < 34 && !(pin >= 6 && pin <= 11) && pin != SDA && pin != SCL && pin != 1 && pin != 3;
+}
+
+// Sampled at reset for the boot mode / flash voltage; a relay circuit that
+// pulls one of them can keep the board from booting
+constexpr bool espStrappingPin(uint8_t pin)
+{
+  return pin == 0 || pin == 2 || pin == 12 || pin == 15;
+}
+
+// Port bits of an expander
+constexpr uint8_t ioTypeWidth(IOType type)
+{
+  return type == IO_PCF8574 ? 8 : 16;
+}
+
+constexpr bool layoutPinsValid(int i = 0)
+{
+  return i >= BOARD_OUTPUTS ||
+         ((BOARD_LAYOUT[i].device == IO_DEVICE_GPIO
+               ? espOutputPin(BOARD_LAYOUT[i].pin)
+               : BOARD_LAYOUT[i].device >= 0 && BOARD_LAYOUT[i].device < BOARD_DEVICE_COUNT &&
+                     BOARD_LAYOUT[i].pin < ioTypeWidth(BOARD_DEVICES[BOARD_LAYOUT[i].device].type)) &&
+          layoutPinsValid(i + 1));
+}
+
+constexpr bool layoutUnique(int i = 0, int j = 1)
+{
+  return i >= BOARD_OUTPUTS - 1 ||
+         (j >= BOARD_OUTPUTS ? layoutUnique(i + 1, i + 2)
+                             : !(BOARD_LAYOUT[i].device == BOARD_LAYOUT[j].device && BOARD_LAYOUT[i].pin == BOARD_LAYOUT[j].pin) &&
+                                   layoutUnique(i, j + 1));
+}
+
+static_assert(BOARD_OUTPUTS <= MAX_OUTPUTS, "BOARD_LAYOUT has more than MAX_OUTPUTS channels");
+static_assert(BOARD_DEVICE_COUNT <= MAX_IO_DEVICES, "BOARD_DEVICES has more than MAX_IO_DEVICES expanders");
+static_assert(layoutPinsValid(), "BOARD_LAYOUT: unknown device, port bit out of range or GPIO not usable as output");
+static_assert(layoutUnique(), "BOARD_LAYOUT: two channels share a pin");
+static_assert(MAX_IO_DEVICES + BOARD_DEVICE_COUNT + 1 <= I2C_MAX_DEVICES, "I2C_MAX_DEVICES too small for the boot sequence");
+static_assert(MAX_OUTPUTS % 32 == 0, "OutputBits holds whole 32-bit words");
+
+const char *ioTypeName(IOType type)
+{
+  static const char *names[IO_TYPE_COUNT] = {"GPIO", "PCF8574", "PCF8575", "MCP23017", "virtual"};
+  return type < IO_TYPE_COUNT ? names[type] : "?";
+}
+
+// Expander type from its name (case-insensitive), IO_TYPE_COUNT if unknown
+IOType ioTypeFromName(const char *name)
+{
+  for (int t = IO_PCF8574; t < IO_TYPE_COUNT && name; t++)
+  {
+    if (strcasecmp(name, ioTypeName((IOType)t)) == 0)
+      return (IOType)t;
+  }
+  return IO_TYPE_COUNT;
+}
+
+// Runtime version of the BOARD_LAYOUT checks, plus the I2C addresses.
+// why = first problem found.
+bool ioTopologyValid(const IoDeviceConfig *devs, int devCount, const ChannelMap *map, int count, String &why)
+{
+  if (devCount > MAX_IO_DEVICES)
+  {
+    why = "more than " + String(MAX_IO_DEVICES) + " devices";
+    return false;
+  }
+  if (count < 1 || count > MAX_OUTPUTS)
+  {
+    why = String(count) + " channels (1-" + String(MAX_OUTPUTS) + ")";
+    return false;
+  }
+
+  for (int d = 0; d < devCount; d++)
+  {
+    if (devs[d].type == IO_ESP || devs[d].type >= IO_TYPE_COUNT)
+    {
+      why = "device " + String(d) + ": unknown type";
+      return false;
+    }
+    if (devs[d].type == IO_VIRTUAL)
+      continue;
+    if (devs[d].addr < 0x08 || devs[d].addr > 0x77 || devs[d].addr == ADDR_LCD)
+    {
+      why = "device " + String(d) + ": invalid address";
+      return false;
+    }
+    for (int e = 0; e < d; e++)
+    {
+      if (devs[e].type != IO_VIRTUAL && devs[e].addr == devs[d].addr)
+      {
+        why = "device " + String(d) + ": address used by device " + String(e);
+        return false;
+      }
+    }
+  }
+
+  uint64_t gpioUsed = 0;
+  uint16_t portUsed[MAX_IO_DEVICES] = {0};
+  for (int i = 0; i < count; i++)
+  {
+    const ChannelMap &c = map[i];
+    bool gpio = c.device == IO_DEVICE_GPIO;
+    bool pinOk = gpio ? espOutputPin(c.pin)
+                      : c.device >= 0 && c.device < devCount && c.pin < ioTypeWidth(devs[c.device].type);
+    if (!pinOk)
+    {
+      why = "CH" + String(i + 1) + ": unknown device or invalid pin";
+      return false;
+    }
+
+    bool used = gpio ? (gpioUsed >> c.pin) & 1 : (portUsed[c.device] >> c.pin) & 1;
+    if (used)
+    {
+      why = "CH" + String(i + 1) + ": pin already used";
+      return false;
+    }
+    if (gpio && espStrappingPin(c.pin))
+      LOG_W("IO topology: CH%d di strapping pin GPIO%d", i + 1, c.pin);
+    if (gpio)
+      gpioUsed |= 1ULL << c.pin;
+    else
+      portUsed[c.device] |= 1U << c.pin;
+  }
+  return true;
+}
+
+// Installs a validated topology with every channel OFF in the shadows.
+// Touches no hardware, see initHardwarePins().
+void ioTopologyApply(const IoDeviceConfig *devs, int devCount, const ChannelMap *map, int count)
+{
+  ioDeviceCount = devCount;
+  for (int d = 0; d < devCount; d++)
+  {
+    IoDevice &dev = ioDevices[d];
+    memset(&dev, 0, sizeof(dev));
+    dev.type = devs[d].type;
+    dev.addr = devs[d].addr;
+    dev.bus = -1; // ioDeviceBegin
+    // Unused PCF bits stay HIGH (input), unused MCP bits are inputs anyway
+    dev.shadow = 0xFFFF;
+  }
+
+  outputCount = count;
+  for (int i = 0; i < count; i++)
+  {
+    outputMap[i] = map[i];
+    if (map[i].device == IO_DEVICE_GPIO)
+      continue;
+    IoDevice &dev = ioDevices[map[i].device];
+    uint16_t bit = 1U << map[i].pin;
+    dev.usedMask |= bit;
+    if (!map[i].activeLow)
+      dev.shadow &= ~bit; // OFF level
+  }
+
+  for (int d = 0; d < devCount; d++)
+  {
+    ioDevices[d].latched = ioDevices[d].shadow;
+    ioDevices[d].dirty = true;
+  }
+}
+
+void ioTopologyDefault()
+{
+  ioTopologyApply(BOARD_DEVICES, BOARD_DEVICE_COUNT, BOARD_LAYOUT, BOARD_OUTPUTS);
+  ioTopologyCustom = false;
+}
+
+// config.json "io":
+//   {"devices":[{"type":"PCF8575","addr":32}, ...],
+//    "channels":[{"dev":-1,"pin":4}, {"dev":0,"pin":0,"count":16,"activeLow":true}, ...]}
+// "count" expands to consecutive port bits of one device, "addr" may also
+// be a string ("0x20"). false = invalid, the caller keeps the board layout.
+bool ioTopologyFromJson(JsonVariantConst io)
+{
+  IoDeviceConfig devs[MAX_IO_DEVICES + 1];
+  static ChannelMap map[MAX_OUTPUTS + 1];
+  int devCount = 0;
+  int count = 0;
+  String why;
+
+  for (JsonVariantConst d : io["devices"].as<JsonArrayConst>())
+  {
+    if (devCount > MAX_IO_DEVICES || why.length())
+      break;
+    JsonVariantConst addr = d["addr"];
+    long a = addr.is<const char *>() ? strtol(addr.as<const char *>(), nullptr, 0) : (addr | 0L);
+    if (a < 0 || a > 0x7F)
+      why = "device " + String(devCount) + ": invalid address";
+    devs[devCount].type = ioTypeFromName(d["type"] | "");
+    devs[devCount].addr = a;
+    devCount++;
+  }
+
+  for (JsonVariantConst c : io["channels"].as<JsonArrayConst>())
+  {
+    if (why.length())
+      break;
+    // Range-checked before they are narrowed into ChannelMap
+    int n = c["count"] | 1;
+    int pin = c["pin"] | 0;
+    int dev = c["dev"] | IO_DEVICE_GPIO;
+    if (dev < IO_DEVICE_GPIO || dev >= MAX_IO_DEVICES || pin < 0 || n < 1 || pin + n > 64)
+    {
+      why = "CH" + String(count + 1) + ": unknown device or invalid pin";
+      break;
+    }
+    for (int k = 0; k < n && count <= MAX_OUTPUTS; k++)
+    {
+      map[count].device = dev;
+      map[count].pin = pin + k;
+      map[count].activeLow = c["activeLow"] | false;
+      count++;
+    }
+  }
+
+  if (why.length() || !ioTopologyValid(devs, devCount, map, count, why))
+  {
+    LOG_E("IO topology: %s, using board layout", why.c_str());
+    Serial.printf("   IO topology invalid (%s), board layout used\n", why.c_str());
+    return false;
+  }
+
+  ioTopologyApply(devs, devCount, map, count);
+  ioTopologyCustom = true;
+  Serial.printf("   IO topology: %d channel(s), %d expander(s)\n", outputCount, ioDeviceCount);
+  return true;
+}
+
+// Inverse of ioTopologyFromJson(), runs of consecutive port bits become
+// one "count" entry
+void ioTopologyToJson(JsonObject io)
+{
+  JsonArray devArr = io.createNestedArray("devices");
+  for (int d = 0; d < ioDeviceCount; d++)
+  {
+    JsonObject o = devArr.createNestedObject();
+    o["type"] = ioTypeName(ioDevices[d].type);
+    o["addr"] = ioDevices[d].addr;
+  }
+
+  JsonArray chArr = io.createNestedArray("channels");
+  for (int i = 0; i < outputCount;)
+  {
+    const ChannelMap &c = outputMap[i];
+    int n = 1;
+    while (c.device != IO_DEVICE_GPIO && i + n < outputCount &&
+           outputMap[i + n].device == c.device && outputMap[i + n].pin == c.pin + n &&
+           outputMap[i + n].activeLow == c.activeLow)
+      n++;
+
+    JsonObject o = chArr.createNestedObject();
+    o["dev"] = c.device;
+    o["pin"] = c.pin;
+    if (n > 1)
+      o["count"] = n;
+    o["activeLow"] = c.activeLow;
+    i += n;
+  }
+}
+
+// ==================== HARDWARE CONTROL ====================
+// A command first stages its channels: GPIOs are written directly,
+// expander channels only change the device shadow. Then every dirty
+// device is flushed once: one I2C transaction for the whole port (two data
+// bytes on 16-bit parts) and one readback, however many of its channels
+// switched. All port writes of a command go out before the first readback
+// (I2C BUS priorities). A failed flush restores the shadow and the staged
+// channels keep their old state.
+#define MCP_IODIRA 0x00
+#define MCP_GPIOA 0x12
+#define MCP_OLATA 0x14
+#define IO_AUDIT_MS 1000 // Port readback of one expander per period
+
+// Port transactions return the Wire status (I2C_OK, ...)
+template <IOType T>
+uint8_t ioPortWrite(IoDevice &d);
+
+template <>
+uint8_t ioPortWrite<IO_PCF8574>(IoDevice &d)
+{
+  Wire.beginTransmission(d.addr);
+  Wire.write((uint8_t)d.shadow);
+  return Wire.endTransmission();
+}
+
+template <>
+uint8_t ioPortWrite<IO_PCF8575>(IoDevice &d)
+{
+  Wire.beginTransmission(d.addr);
+  Wire.write((uint8_t)d.shadow);
+  Wire.write((uint8_t)(d.shadow >> 8));
+  return Wire.endTransmission();
+}
+
+template <>
+uint8_t ioPortWrite<IO_MCP23017>(IoDevice &d)
+{
+  // IOCON.BANK = 0 (power-on default): OLATB follows OLATA
+  Wire.beginTransmission(d.addr);
+  Wire.write(MCP_OLATA);
+  Wire.write((uint8_t)d.shadow);
+  Wire.write((uint8_t)(d.shadow >> 8));
+  return Wire.endTransmission();
+}
+
+// Only the channel bits are outputs
+uint8_t ioMcpWriteIodir(IoDevice &d)
+{
+  uint16_t iodir = ~d.usedMask;
+  Wire.beginTransmission(d.addr);
+  Wire.write(MCP_IODIRA);
+  Wire.write((uint8_t)iodir);
+  Wire.write((uint8_t)(iodir >> 8));
+  return Wire.endTransmission();
+}
+
+// Pin levels of the port into d.readback. PCF parts have no output
+// register, a pin that reads back wrong is shorted or the device is missing.
+uint8_t ioPortRead(IoDevice &d)
+{
+  uint8_t bytes = ioTypeWidth(d.type) / 8;
+  if (d.type == IO_MCP23017)
+  {
+    Wire.beginTransmission(d.addr);
+    Wire.write(MCP_GPIOA);
+    uint8_t status = Wire.endTransmission(false);
+    if (status != I2C_OK)
+      return status;
+  }
+  uint8_t status = i2cReadStatus(Wire.requestFrom(d.addr, bytes), bytes);
+  if (status != I2C_OK)
+    return status;
+
+  d.readback = Wire.read();
+  if (bytes == 2)
+    d.readback |= (uint16_t)Wire.read() << 8;
+  return I2C_OK;
+}
+
+bool ioPortWriteAny(IoDevice &d)
+{
+  switch (d.type)
+  {
+  case IO_PCF8574:
+    return i2cTransact(d, ioPortWrite<IO_PCF8574>);
+  case IO_PCF8575:
+    return i2cTransact(d, ioPortWrite<IO_PCF8575>);
+  case IO_MCP23017:
+    return i2cTransact(d, ioPortWrite<IO_MCP23017>);
+  default: // IO_VIRTUAL
+    return true;
+  }
+}
+
+void ioFlushDone(IoDevice &d, bool ok)
+{
+  d.writeOk = ok;
+  if (ok)
+  {
+    d.latched = d.shadow;
+  }
+  else
+  {
+    d.errors++;
+    d.shadow = d.latched;
+    i2cNoteError();
+  }
+}
+
+// Relay priority: writes the port and queues its readback
+void ioFlushWrite(int index)
+{
+  IoDevice &d = ioDevices[index];
+  d.dirty = false;
+  d.writes++;
+
+  if (d.type == IO_VIRTUAL)
+    ioFlushDone(d, true);
+  else if (ioPortWriteAny(d))
+    i2cVerifyPending |= 1 << index;
+  else
+    ioFlushDone(d, false);
+}
+
+bool ioPortVerified(IoDevice &d)
+{
+  return i2cTransact(d, ioPortRead) && ((d.readback ^ d.shadow) & d.usedMask) == 0;
+}
+
+// Verify priority: readback of a written port. The write was ACKed, so
+// the expander may already drive the new value: a failed or mismatching
+// readback rewrites the port and checks again, up to I2C_RETRIES times
+// with backoff. If it still does not verify, the latched value is written
+// back so the relays and outputs[] agree on the old state.
+void ioFlushVerify(int index)
+{
+  IoDevice &d = ioDevices[index];
+  i2cVerifyPending &= ~(1 << index);
+
+  bool ok = ioPortVerified(d);
+  for (int attempt = 1; !ok && attempt <= I2C_RETRIES; attempt++)
+  {
+    delayMicroseconds(I2C_RETRY_BASE_US << (attempt - 1));
+    ok = ioPortWriteAny(d) && ioPortVerified(d);
+  }
+
+  if (!ok)
+  {
+    LOG_W("IO%d 0x%02X: Verifikasi gagal, port dikembalikan ke 0x%04X", index, d.addr, d.latched & d.usedMask);
+    d.shadow = d.latched;
+    ioPortWriteAny(d);
+  }
+  ioFlushDone(d, ok);
+}
+
+void ioFlushVerifyPending()
+{
+  for (int d = 0; i2cVerifyPending && d < ioDeviceCount; d++)
+  {
+    if (i2cVerifyPending & (1 << d))
+      ioFlushVerify(d);
+  }
+}
+
+bool ioFlush(int index)
+{
+  ioFlushWrite(index);
+  ioFlushVerifyPending();
+  return ioDevices[index].writeOk;
+}
+
+void ioFlushDirty()
+{
+  for (int d = 0; d < ioDeviceCount; d++)
+  {
+    if (ioDevices[d].dirty)
+      ioFlushWrite(d);
+  }
+  ioFlushVerifyPending();
+}
+
+// An expander can change its port behind our back: a brown-out resets a
+// PCF8574 to all HIGH (every active-high relay ON, every active-low OFF).
+// Reads the port back and rewrites it from the latched value if a channel
+// bit differs. true = port matches (or was repaired).
+bool ioAudit(int index)
+{
+  IoDevice &d = ioDevices[index];
+  if (d.type == IO_VIRTUAL || d.dirty)
+    return true;
+  if (!i2cTransact(d, ioPortRead))
+    return false;
+  if (((d.readback ^ d.latched) & d.usedMask) == 0)
+    return true;
+
+  i2cNoteError();
+  d.repairs++;
+  LOG_W("IO%d 0x%02X: Port berubah (0x%04X, harus 0x%04X), ditulis ulang", index, d.addr,
+        d.readback & d.usedMask, d.latched & d.usedMask);
+  d.shadow = d.latched;
+  return ioFlush(index);
+}
+
+unsigned long ioLastAudit = 0;
+int ioAuditNext = 0;
+
+// One present device per IO_AUDIT_MS, verify priority (before the LCD)
+void ioAuditLoop()
+{
+  if (ioDeviceCount == 0 || millis() - ioLastAudit < IO_AUDIT_MS)
+    return;
+  ioLastAudit = millis();
+
+  ioAuditNext = (ioAuditNext + 1) % ioDeviceCount;
+  if (ioDevices[ioAuditNext].present)
+    ioAudit(ioAuditNext);
+}
+
+// Brings an expander to the all-OFF shadow
+bool ioDeviceBegin(int index)
+{
+  IoDevice &d = ioDevices[index];
+  if (d.type == IO_VIRTUAL)
+    return d.present = ioFlush(index);
+
+  char name[8];
+  snprintf(name, sizeof(name), "io%d", index);
+  d.bus = i2cRegister(d.addr, name, ioTypeClockHz(d.type));
+
+  if (d.type == IO_MCP23017)
+  {
+    // Latch the OFF levels first, then make only the channel bits outputs
+    i2cTransact(d, ioPortWrite<IO_MCP23017>);
+    i2cTransact(d, ioMcpWriteIodir);
+  }
+  d.present = ioFlush(index);
+  return d.present;
+}
+
+// Electrical level into the GPIO or the device shadow
+void ioStageLevel(const ChannelMap &ch, bool level)
+{
+  if (ch.device == IO_DEVICE_GPIO)
+  {
+    digitalWrite(ch.pin, level ? HIGH : LOW);
+    return;
+  }
+
+  IoDevice &d = ioDevices[ch.device];
+  uint16_t bit = 1U << ch.pin;
+  if (level)
+    d.shadow |= bit;
+  else
+    d.shadow &= ~bit;
+  d.dirty = true;
+}
+
+void initHardwarePins()
+{
+  // Every channel OFF: LOW on active-high pins, HIGH on relay (active-low) pins.
+  // The device shadows already hold the OFF levels (ioTopologyApply).
+  for (int i = 0; i < outputCount; i++)
+  {
+    const ChannelMap &ch = outputMap[i];
+    if (ch.device != IO_DEVICE_GPIO)
+      continue;
+    pinMode(ch.pin, OUTPUT);
+    ioStageLevel(ch, ch.activeLow);
+  }
+
+  for (int d = 0; d < ioDeviceCount; d++)
+  {
+    IoDevice &dev = ioDevices[d];
+    if (ioDeviceBegin(d))
+      Serial.printf("IO%d %s initialized at 0x%02X\n", d, ioTypeName(dev.type), dev.addr);
+    else
+      Serial.printf("IO%d %s NOT FOUND at 0x%02X!\n", d, ioTypeName(dev.type), dev.addr);
+  }
+
+  Serial.printf("Hardware pins initialized: %d channel(s), %d expander(s), all OFF\n", outputCount, ioDeviceCount);
+}
+
+// Checks and stages one channel. false = nothing to write (already in that
+// state or toggle limit reached).
+bool outputStage(int index, bool state, CmdSource source)
+{
+  OutputChannel &out = outputs[index];
+  int channel = index + 1;
+
+  timerCancel(index); // A direct commit overrides a pending timed one
+
+  if (out.state == state)
+  {
+    LOG_D("CH%02d: Sudah di state %s, tidak ada perpindahan.", channel, state ? "ON" : "OFF");
+    return false;
+  }
+
+  if (out.maxToggles > 0 && out.currentToggles >= out.maxToggles)
+  {
+    LOG_W("CH%02d: GAGAL! Batasan perpindahan (%d) telah tercapai.", channel, out.maxToggles);
+    traceRecord(TRACE_REJECT_LIMIT, source, channel, state);
+    return false;
+  }
+
+  const ChannelMap &ch = outputMap[index];
+  ioStageLevel(ch, state != ch.activeLow);
+  return true;
+}
+
+// Bookkeeping for a staged channel once its device has been flushed
+void outputCommit(int index, bool state, CmdSource source)
+{
+  const ChannelMap &ch = outputMap[index];
+  int channel = index + 1;
+  bool gpio = ch.device == IO_DEVICE_GPIO;
+  bool writeSuccess = gpio || ioDevices[ch.device].writeOk;
+
+  LOG_D("CH%02d: %s P%d = %s%s [%s]", channel, gpio ? "GPIO" : ioTypeName(ioDevices[ch.device].type), ch.pin,
+        state != ch.activeLow ? "HIGH" : "LOW", ch.activeLow ? " (inverted)" : "",
+        writeSuccess ? "OK" : "FAIL");
+
+  if (!writeSuccess)
+  {
+    LOG_E("Failed to set CH%02d!", channel);
+    traceRecord(TRACE_I2C_FAIL, source, channel, state);
+    return;
+  }
+
+  OutputChannel &out = outputs[index];
+  out.state = state;
+  out.lastToggle = millis();
+  out.currentToggles++;
+
+  outputState.set(index, state);
+  traceRecord(TRACE_COMMIT, source, channel, state);
+  journalMark(index);
+  telemetryRecord(channel, state);
+
+  lcdNeedsRedraw = true;
+  lcdOutputPage = 0;
+  lastLcdPageSwap = millis();
+
+  LOG_D("CH%02d: Perpindahan ke %d. Meteran: %d / %d",
+        channel, state, out.currentToggles, out.maxToggles);
+}
+
+void setOutput(int channel, bool state, CmdSource source)
+{
+  if (channel < 1 || channel > outputCount)
+  {
+    LOG_E("Error: Invalid channel %d", channel);
+    return;
+  }
+
+  int outputIndex = channel - 1;
+  if (!outputStage(outputIndex, state, source))
+    return;
+
+  const ChannelMap &ch = outputMap[outputIndex];
+  if (ch.device != IO_DEVICE_GPIO)
+    ioFlush(ch.device);
+  outputCommit(outputIndex, state, source);
+}
+
+// Switches every channel in mask to its bit in values with one flush per
+// touched device. sources (optional) = per-channel origin for the trace.
+void applyOutputMask(const OutputBits &mask, const OutputBits &values, CmdSource source,
+                     const CmdSource *sources = nullptr)
+{
+  OutputBits staged = {};
+  for (int i = mask.next(0); i >= 0 && i < outputCount; i = mask.next(i + 1))
+  {
+    if (outputStage(i, values.get(i), sources ? sources[i] : source))
+      staged.set(i, true);
+  }
+
+  ioFlushDirty();
+
+  for (int i = staged.next(0); i >= 0; i = staged.next(i + 1))
+    outputCommit(i, values.get(i), sources ? sources[i] : source);
+}
+
+void initOutputs()
+{
+  outputState.clear();
+  for (int i = 0; i < outputCount; i++)
+  {
+    outputs[i].name = "Channel " + String(i + 1);
+    outputs[i].state = false;
+    outputs[i].intervalOn = 5000;
+    outputs[i].intervalOff = 5000;
+    outputs[i].lastToggle = 0;
+    outputs[i].autoMode = false;
+    outputs[i].phaseMs = 0;
+  }
+}
+
+// ==================== TIMER HEAP ====================
+// Timed output changes: at most one pending entry per channel, in a binary
+// min-heap keyed by due time (micros(), wrap-safe compare). A group tick
+// with phase offsets or a stagger puts its members here instead of
+// committing them all at once, so contactors do not pull in together.
+// timersService() commits every entry that is due in one applyOutputMask(),
+// so members due together still share one write per expander. Scheduling
+// a channel again moves its entry; any commit for the channel cancels it
+// (outputStage), the last command wins. An entry with remaining > 1 is a
+// pulse or burst: after its commit it is put back with the opposite state,
+// due holdMs (after ON) or restMs (after OFF) after its own due time, so a
+// burst does not drift with loop() latency.
+#define TIMER_SPACING_WINDOW_US 1000000 // Sub-commits further apart are not compared
+#define TIMER_MAX_MS 1800000            // Longest delay / pulse, keeps dueUs compares wrap-safe
+
+struct OutputTimer
+{
+  uint32_t dueUs;
+  uint8_t index;
+  bool state;
+  CmdSource source;
+  uint16_t remaining; // Commits left including this one, 1 = one-shot
+  uint32_t holdMs;    // Until the next commit after an ON commit
+  uint32_t restMs;    // Same after an OFF commit
+};
+
+OutputTimer timerHeap[MAX_OUTPUTS];
+int timerCount = 0;
+uint8_t timerSlot[MAX_OUTPUTS]; // Heap position + 1 per channel, 0 = none
+CmdSource timerSources[MAX_OUTPUTS];
+LoopHistogram timerLateness;     // Commit time - due time
+LoopHistogram timerSpacingError; // |achieved - target| gap between consecutive sub-commits
+unsigned long timerCommits = 0;
+unsigned long timerStarts = 0; // Pulse / delay / burst commands
+bool timerHaveLast = false;
+uint32_t timerLastDueUs = 0;
+uint32_t timerLastFiredUs = 0;
+
+bool timerBefore(int a, int b)
+{
+  return (int32_t)(timerHeap[a].dueUs - timerHeap[b].dueUs) < 0;
+}
+
+void timerSwap(int a, int b)
+{
+  OutputTimer t = timerHeap[a];
+  timerHeap[a] = timerHeap[b];
+  timerHeap[b] = t;
+  timerSlot[timerHeap[a].index] = a + 1;
+  timerSlot[timerHeap[b].index] = b + 1;
+}
+
+void timerSiftUp(int i)
+{
+  while (i > 0 && timerBefore(i, (i - 1) / 2))
+  {
+    timerSwap(i, (i - 1) / 2);
+    i = (i - 1) / 2;
+  }
+}
+
+void timerSiftDown(int i)
+{
+  for (;;)
+  {
+    int least = i;
+    int l = 2 * i + 1;
+    int r = l + 1;
+    if (l < timerCount && timerBefore(l, least))
+      least = l;
+    if (r < timerCount && timerBefore(r, least))
+      least = r;
+    if (least == i)
+      return;
+    timerSwap(i, least);
+    i = least;
+  }
+}
+
+void timerRemoveAt(int pos)
+{
+  int last = --timerCount;
+  timerSlot[timerHeap[pos].index] = 0;
+  if (pos == last)
+    return;
+
+  timerHeap[pos] = timerHeap[last];
+  timerSlot[timerHeap[pos].index] = pos + 1;
+  timerSiftDown(pos);
+  timerSiftUp(pos);
+}
+
+void timerSchedule(int index, bool state, uint32_t dueUs, CmdSource source,
+                   uint16_t remaining = 1, uint32_t holdMs = 0, uint32_t restMs = 0)
+{
+  int pos = timerSlot[index] - 1;
+  if (pos < 0)
+    pos = timerCount++;
+
+  timerHeap[pos] = {dueUs, (uint8_t)index, state, source, remaining, holdMs, restMs};
+  timerSlot[index] = pos + 1;
+  timerSiftUp(pos);
+  timerSiftDown(timerSlot[index] - 1);
+}
+
+void timerCancel(int index)
+{
+  if (timerSlot[index])
+    timerRemoveAt(timerSlot[index] - 1);
+}
+
+bool timerPending(int index)
+{
+  return timerSlot[index] != 0;
+}
+
+// Group tick. Member n (in channel order) is due after phaseMs + its own
+// channel phase + n * staggerMs; members with no offset at all are
+// committed right away, together. Offsets must end before the group's
+// next tick (limitMs), which would replace the pending entries so the
+// last members never switch. The setters reject such offsets
+// (groupOffsetsFit); a sync group that grew since is clamped here.
+// queued (remote commands): the immediate members go through the pending
+// queue like any other command, and a queued command for a delayed member
+// is dropped, so the group command stays the last writer.
+void outputScheduleMask(const OutputBits &members, bool state, uint32_t phaseMs, uint32_t staggerMs,
+                        unsigned long limitMs, CmdSource source, bool queued = false)
+{
+  uint32_t now = micros();
+  OutputBits immediate = {};
+  OutputBits none = {};
+  uint32_t rank = 0;
+  // limitMs 0 leaves no room for an offset, every member goes at once
+  unsigned long maxMs = min(limitMs > 0 ? limitMs - 1 : 0UL, (unsigned long)TIMER_MAX_MS);
+  int clamped = 0;
+
+  for (int i = members.next(0); i >= 0 && i < outputCount; i = members.next(i + 1), rank++)
+  {
+    unsigned long offsetMs = phaseMs + outputs[i].phaseMs + rank * staggerMs;
+    if (offsetMs > maxMs)
+    {
+      offsetMs = maxMs;
+      clamped++;
+    }
+    if (offsetMs == 0)
+    {
+      immediate.set(i, true);
+    }
+    else
+    {
+      timerSchedule(i, state, now + offsetMs * 1000, source);
+      if (queued)
+        pendingOutputMask.set(i, false);
+    }
+  }
+
+  if (clamped)
+    LOG_W("Stagger: %d member(s) dipotong ke %lu ms (interval grup)", clamped, maxMs);
+  if (!immediate.any())
+    return;
+  if (queued)
+    queueOutputMask(immediate, state ? immediate : none, source);
+  else
+    applyOutputMask(immediate, state ? immediate : none, source);
+}
+
+// Longest offset outputScheduleMask() gives a member of the group
+unsigned long groupSpreadMs(const OutputBits &members, uint32_t phaseMs, uint32_t staggerMs)
+{
+  unsigned long spread = 0;
+  uint32_t rank = 0;
+  for (int i = members.next(0); i >= 0 && i < outputCount; i = members.next(i + 1), rank++)
+    spread = max(spread, (unsigned long)(phaseMs + outputs[i].phaseMs + rank * staggerMs));
+  return spread;
+}
+
+bool groupOffsetsFit(const OutputBits &members, uint32_t phaseMs, uint32_t staggerMs,
+                     unsigned long intervalOn, unsigned long intervalOff)
+{
+  unsigned long spread = groupSpreadMs(members, phaseMs, staggerMs);
+  return spread < min(intervalOn, intervalOff) && spread <= TIMER_MAX_MS;
+}
+
+bool syncStaggerFits(unsigned long staggerMs)
+{
+  if (staggerMs > UINT16_MAX)
+    return false;
+  for (int g = 0; g < SYNC_GROUP_SLOTS; g++)
+  {
+    const SyncGroup &grp = syncGroups[g];
+    if (grp.memberCount > 0 &&
+        !groupOffsetsFit(grp.members, 0, staggerMs, grp.intervalOn, grp.intervalOff))
+      return false;
+  }
+  return true;
+}
+
+// The new phase of one channel against the group it is in
+bool channelPhaseFits(int index, unsigned long phaseMs)
+{
+  if (phaseMs > UINT16_MAX)
+    return false;
+
+  uint16_t old = outputs[index].phaseMs;
+  outputs[index].phaseMs = phaseMs;
+  bool fits = phaseMs <= TIMER_MAX_MS;
+  for (int i = 0; i < namedGroupCount; i++)
+  {
+    const NamedGroup &g = namedGroups[i];
+    if (g.members.get(index))
+      fits = groupOffsetsFit(g.members, g.phaseMs, g.staggerMs, g.intervalOn, g.intervalOff);
+  }
+  int sg = outputGroupMap[index];
+  if (!namedGroupMembers.get(index) && sg >= 0)
+    fits = groupOffsetsFit(syncGroups[sg].members, 0, config.syncStaggerMs,
+                           syncGroups[sg].intervalOn, syncGroups[sg].intervalOff);
+  outputs[index].phaseMs = old;
+  return fits;
+}
+
+// Boot, after config, channels.bin and the sync groups are loaded
+void groupOffsetsCheck()
+{
+  for (int i = 0; i < namedGroupCount; i++)
+  {
+    NamedGroup &g = namedGroups[i];
+    if (!groupOffsetsFit(g.members, g.phaseMs, g.staggerMs, g.intervalOn, g.intervalOff))
+    {
+      LOG_W("Groups: '%s' phase/stagger melebihi interval, direset ke 0", g.name);
+      g.phaseMs = 0;
+      g.staggerMs = 0;
+    }
+  }
+  if (!syncStaggerFits(config.syncStaggerMs))
+  {
+    LOG_W("syncStagger %u ms melebihi interval sync group, direset ke 0", config.syncStaggerMs);
+    config.syncStaggerMs = 0;
+  }
+  for (int i = 0; i < outputCount; i++)
+  {
+    if (outputs[i].phaseMs > 0 && !channelPhaseFits(i, outputs[i].phaseMs))
+    {
+      LOG_W("CH%02d: phase %u ms melebihi interval grup, direset ke 0", i + 1, outputs[i].phaseMs);
+      outputs[i].phaseMs = 0;
+    }
+  }
+}
+
+// Boot, after journalRestore(): the groups were built while every output
+// was still OFF, so their first tick would repeat the restored state and
+// the schedule would slip by a whole interval
+void groupStatesSeed()
+{
+  for (int i = 0; i < namedGroupCount; i++)
+    namedGroups[i].currentState = outputState.get(namedGroups[i].members.next(0));
+  for (int g = 0; g < SYNC_GROUP_SLOTS; g++)
+  {
+    if (syncGroups[g].memberCount > 0)
+      syncGroups[g].currentState = outputState.get(syncGroups[g].members.next(0));
+  }
+}
+
+// One sub-commit of everything that is due
+void timersService()
+{
+  if (timerCount == 0)
+    return;
+  uint32_t now = micros();
+  if ((int32_t)(now - timerHeap[0].dueUs) < 0)
+    return;
+
+  OutputBits mask = {};
+  OutputBits values = {};
+  static OutputTimer next[MAX_OUTPUTS]; // Next phase of pulses / bursts
+  int nextCount = 0;
+  uint32_t firstDue = timerHeap[0].dueUs;
+  while (timerCount > 0 && (int32_t)(now - timerHeap[0].dueUs) >= 0)
+  {
+    const OutputTimer &t = timerHeap[0];
+    mask.set(t.index, true);
+    values.set(t.index, t.state);
+    timerSources[t.index] = t.source;
+    histRecord(timerLateness, now - t.dueUs);
+    if (t.remaining > 1)
+    {
+      OutputTimer &n = next[nextCount++];
+      n = t;
+      n.dueUs = t.dueUs + (t.state ? t.holdMs : t.restMs) * 1000;
+      n.state = !t.state;
+      n.remaining--;
+    }
+    timerRemoveAt(0);
+  }
+
+  applyOutputMask(mask, values, SRC_SCHEDULER, timerSources);
+  uint32_t fired = micros();
+
+  // After the commit, which cancels pending entries of those channels
+  for (int i = 0; i < nextCount; i++)
+  {
+    const OutputTimer &n = next[i];
+    timerSchedule(n.index, n.state, n.dueUs, n.source, n.remaining, n.holdMs, n.restMs);
+  }
+
+  if (timerHaveLast && firstDue - timerLastDueUs < TIMER_SPACING_WINDOW_US)
+  {
+    int32_t error = (int32_t)((fired - timerLastFiredUs) - (firstDue - timerLastDueUs));
+    histRecord(timerSpacingError, error < 0 ? -error : error);
+  }
+  timerHaveLast = true;
+  timerLastDueUs = firstDue;
+  timerLastFiredUs = fired;
+  timerCommits++;
+  requestPublish();
+}
+
+void timerMetricsText(String &out)
+{
+  out += "# TYPE relay_timer_pending gauge\n";
+  out += "relay_timer_pending " + String(timerCount) + "\n";
+  out += "# TYPE relay_timer_commits_total counter\n";
+  out += "relay_timer_commits_total " + String(timerCommits) + "\n";
+  out += "# TYPE relay_timer_starts_total counter\n";
+  out += "relay_timer_starts_total " + String(timerStarts) + "\n";
+  out += "# HELP relay_timer_lateness_us Timed commit time minus its due time\n";
+  out += "# TYPE relay_timer_lateness_us histogram\n";
+  histText(out, "relay_timer_lateness_us", "", timerLateness);
+  out += "# HELP relay_timer_spacing_error_us Achieved minus target gap between consecutive timed commits\n";
+  out += "# TYPE relay_timer_spacing_error_us histogram\n";
+  histText(out, "relay_timer_spacing_error_us", "", timerSpacingError);
+}
+
+// ==================== OUTPUT JOURNAL ====================
+// Append-only log of per-channel {state, currentToggles} snapshots so a power
+// blip does not lose relay positions or toggle-limit accounting. Changes are
+// coalesced per channel in RAM (journalDirty) and appended at most once
+// per JOURNAL_FLUSH_MS, so the flash write rate is bounded by the flush
+// interval, not by the toggle rate. The file is rewritten (temp + rename)
+// once it grows past JOURNAL_COMPACT_RECORDS. A record torn by a power cut
+// fails its CRC and everything from there on is ignored. Flash wear is per
+// flush, not per byte: every append makes LittleFS copy the tail block and
+// commit metadata.
+#define JOURNAL_FILE "/journal.bin"
+#define JOURNAL_TMP_FILE "/journal.tmp"
+#define JOURNAL_MAGIC 0x4A52 // "RJ"
+#ifndef JOURNAL_FLUSH_MS
+#define JOURNAL_FLUSH_MS 2000 // Wear scales with 1 / this, see README
+#endif
+#define JOURNAL_COMPACT_RECORDS 512 // 8 KB
+#define JOURNAL_READ_CHUNK 32       // Records per read() during restore
+
+struct __attribute__((packed)) JournalRecord
+{
+  uint16_t magic;
+  uint8_t channel; // 1..MAX_OUTPUTS, beyond outputCount ignored on restore
+  uint8_t state;
+  uint32_t toggles; // currentToggles
+  uint32_t seq;
+  uint32_t crc; // CRC32 of the preceding 12 bytes
+};
+
+uint32_t crc32Calc(const uint8_t *data, size_t len)
+{
+  uint32_t crc = 0xFFFFFFFF;
+  while (len--)
+  {
+    crc ^= *data++;
+    for (int k = 0; k < 8; k++)
+      crc = (crc >> 1) ^ (0xEDB88320 & (0 - (crc & 1)));
+  }
+  return ~crc;
+}
+
+void journalMark(int outputIndex)
+{
+  if (!journalRestoring)
+    journalDirty.set(outputIndex, true);
+}
+
+void journalFillRecord(JournalRecord &r, int outputIndex)
+{
+  r.magic = JOURNAL_MAGIC;
+  r.channel = outputIndex + 1;
+  r.state = outputs[outputIndex].state ? 1 : 0;
+  r.toggles = outputs[outputIndex].currentToggles;
+  r.seq = ++journalSeq;
+  r.crc = crc32Calc((const uint8_t *)&r, offsetof(JournalRecord, crc));
+}
+
+bool journalRecordValid(const JournalRecord &r)
+{
+  return r.magic == JOURNAL_MAGIC &&
+         r.channel >= 1 && r.channel <= MAX_OUTPUTS &&
+         r.crc == crc32Calc((const uint8_t *)&r, offsetof(JournalRecord, crc));
+}
+
+// Rewrites the journal as one record per channel
+bool journalCompact()
+{
+  static JournalRecord records[MAX_OUTPUTS];
+  for (int i = 0; i < outputCount; i++)
+    journalFillRecord(records[i], i);
+  size_t bytes = outputCount * sizeof(JournalRecord);
+
+  File f = LittleFS.open(JOURNAL_TMP_FILE, "w");
+  if (!f)
+    return false;
+  size_t written = f.write((const uint8_t *)records, bytes);
+  f.close();
+
+  // rename() replaces the old journal atomically
+  if (written != bytes || !LittleFS.rename(JOURNAL_TMP_FILE, JOURNAL_FILE))
+  {
+    LOG_E("Journal: compaction failed");
+    LittleFS.remove(JOURNAL_TMP_FILE);
+    return false;
+  }
+
+  journalFileRecords = outputCount;
+  journalRecordsWritten += outputCount;
+  journalCompactions++;
+  journalDirty.clear();
+  return true;
+}
+
+void journalFlush()
+{
+  journalLastFlush = millis();
+  if (!journalDirty.any())
+    return;
+
+  static JournalRecord records[MAX_OUTPUTS];
+  int n = 0;
+  for (int i = journalDirty.next(0); i >= 0 && i < outputCount; i = journalDirty.next(i + 1))
+    journalFillRecord(records[n++], i);
+
+  if (journalFileRecords + n > JOURNAL_COMPACT_RECORDS)
+  {
+    journalCompact();
+    return;
+  }
+
+  File f = LittleFS.open(JOURNAL_FILE, "a");
+  if (!f)
+    return; // Tetap dirty, dicoba lagi flush berikutnya
+  size_t written = f.write((const uint8_t *)records, n * sizeof(JournalRecord));
+  f.close();
+
+  if (written != n * sizeof(JournalRecord))
+  {
+    // Partial append leaves a torn tail; compaction rewrites a clean file
+    journalCompact();
+    return;
+  }
+
+  journalFileRecords += n;
+  journalRecordsWritten += n;
+  journalFlushes++;
+  journalDirty.clear();
+}
+
+void journalLoop()
+{
+  if (journalDirty.any() && millis() - journalLastFlush >= JOURNAL_FLUSH_MS)
+    journalFlush();
+}
+
+// Replays the journal at boot: last valid record per channel wins. Outputs
+// are switched through applyOutputMask() so the hardware, LCD and trace
+// agree, with one write per expander.
+// lastToggle restarts from now, the auto-mode phase is not preserved.
+void journalRestore()
+{
+  unsigned long t0 = micros();
+
+  File f = LittleFS.open(JOURNAL_FILE, "r");
+  if (!f)
+  {
+    LOG_I("Journal: kosong, mulai baru");
+    journalCompact();
+    journalRestoreUs = micros() - t0;
+    return;
+  }
+
+  static JournalRecord latest[MAX_OUTPUTS];
+  OutputBits found = {};
+  JournalRecord chunk[JOURNAL_READ_CHUNK];
+  uint32_t validRecords = 0;
+  bool torn = false;
+
+  while (!torn)
+  {
+    size_t got = f.read((uint8_t *)chunk, sizeof(chunk));
+    size_t n = got / sizeof(JournalRecord);
+    for (size_t k = 0; k < n; k++)
+    {
+      if (!journalRecordValid(chunk[k]))
+      {
+        torn = true;
+        break;
+      }
+      latest[chunk[k].channel - 1] = chunk[k];
+      found.set(chunk[k].channel - 1, true);
+      journalSeq = chunk[k].seq;
+      validRecords++;
+    }
+    if (got % sizeof(JournalRecord))
+      torn = true;
+    if (got < sizeof(chunk))
+      break;
+  }
+  f.close();
+
+  int restoredOn = 0;
+  OutputBits on = {};
+  for (int i = found.next(0); i >= 0 && i < outputCount; i = found.next(i + 1))
+  {
+    if (latest[i].state)
+    {
+      on.set(i, true);
+      restoredOn++;
+    }
+  }
+
+  // Counters are restored after the switch-on, a channel at its toggle
+  // limit still comes back ON
+  journalRestoring = true;
+  applyOutputMask(on, on, SRC_BOOT);
+  for (int i = found.next(0); i >= 0 && i < outputCount; i = found.next(i + 1))
+  {
+    outputs[i].currentToggles = latest[i].toggles;
+    outputs[i].lastToggle = millis();
+  }
+  journalRestoring = false;
+
+  journalFileRecords = validRecords;
+  if (torn || validRecords > JOURNAL_COMPACT_RECORDS / 2)
+    journalCompact();
+
+  journalRestoreUs = micros() - t0;
+  LOG_I("Journal: %u record, %d channel ON dipulihkan%s (%lu us)",
+        validRecords, restoredOn, torn ? ", ekor rusak dibuang" : "", journalRestoreUs);
+}
+
+// ==================== DEFERRED SAVES ====================
+// Write-behind helper for settings files: a request only marks the data
+// dirty, the write happens once no new request arrived for delayMs (but no
+// later than maxDelayMs after the first one). A burst of UI edits becomes a
+// single flash write.
+void deferredSaveRequest(DeferredSave &d)
+{
+  unsigned long now = millis();
+  if (!d.pending)
+    d.firstRequest = now;
+  d.pending = true;
+  d.lastRequest = now;
+  d.requests++;
+}
+
+void deferredSaveFlush(DeferredSave &d, bool (*write)())
+{
+  if (!d.pending)
+    return;
+  d.pending = false;
+  if (write())
+    d.writes++;
+  else
+    LOG_E("Save %s gagal", d.name);
+}
+
+void deferredSaveLoop(DeferredSave &d, bool (*write)())
+{
+  if (!d.pending)
+    return;
+  unsigned long now = millis();
+  if (now - d.lastRequest >= d.delayMs || now - d.firstRequest >= d.maxDelayMs)
+    deferredSaveFlush(d, write);
+}
+
+// ==================== CHANNEL CONFIG ====================
+// Per-channel settings (name, intervals, autoMode, maxToggles) in a fixed
+// layout binary file: header + outputCount records, CRC32 over the
+// records, loaded with a single read. A file written for another channel
+// count is ignored. Runtime state lives in the journal.
+#define CHANNELS_FILE "/channels.bin"
+#define CHANNELS_TMP_FILE "/channels.tmp"
+#define CHANNELS_MAGIC 0x4C484352 // "RCHL"
+#define CHANNELS_VERSION 1
+#define CHANNEL_NAME_LEN 24
+
+struct __attribute__((packed)) ChannelRecord
+{
+  char name[CHANNEL_NAME_LEN]; // NUL-terminated
+  uint32_t intervalOn;         // ms
+  uint32_t intervalOff;        // ms
+  int32_t maxToggles;          // 0 = unlimited
+  uint8_t autoMode;
+  uint16_t phaseMs;            // ms
+  uint8_t reserved;
+};
+
+struct __attribute__((packed)) ChannelsFileHeader
+{
+  uint32_t magic;
+  uint16_t version;
+  uint16_t count;  // Records in file
+  uint16_t recordSize;
+  uint16_t reserved;
+  uint32_t crc;    // CRC32 of the records
+};
+
+struct __attribute__((packed)) ChannelsFile
+{
+  ChannelsFileHeader header;
+  ChannelRecord records[MAX_OUTPUTS];
+};
+
+bool saveChannelConfig()
+{
+  static ChannelsFile data;
+  memset(&data, 0, sizeof(data));
+  for (int i = 0; i < outputCount; i++)
+  {
+    ChannelRecord &r = data.records[i];
+    strlcpy(r.name, outputs[i].name.c_str(), sizeof(r.name));
+    r.intervalOn = outputs[i].intervalOn;
+    r.intervalOff = outputs[i].intervalOff;
+    r.maxToggles = outputs[i].maxToggles;
+    r.autoMode = outputs[i].autoMode ? 1 : 0;
+    r.phaseMs = outputs[i].phaseMs;
+  }
+  data.header.magic = CHANNELS_MAGIC;
+  data.header.version = CHANNELS_VERSION;
+  size_t recordBytes = outputCount * sizeof(ChannelRecord);
+  data.header.count = outputCount;
+  data.header.recordSize = sizeof(ChannelRecord);
+  data.header.crc = crc32Calc((const uint8_t *)data.records, recordBytes);
+
+  File f = LittleFS.open(CHANNELS_TMP_FILE, "w");
+  if (!f)
+    return false;
+  size_t size = sizeof(data.header) + recordBytes;
+  size_t written = f.write((const uint8_t *)&data, size);
+  f.close();
+
+  if (written != size || !LittleFS.rename(CHANNELS_TMP_FILE, CHANNELS_FILE))
+  {
+    LittleFS.remove(CHANNELS_TMP_FILE);
+    return false;
+  }
+  LOG_I("Channel config disimpan (%u bytes)", (unsigned)size);
+  return true;
+}
+
+void markChannelConfigDirty()
+{
+  deferredSaveRequest(channelsSave);
+}
+
+// Keeps initOutputs() defaults when the file is missing, corrupt or from
+// another layout
+bool loadChannelConfig()
+{
+  File f = LittleFS.open(CHANNELS_FILE, "r");
+  if (!f)
+  {
+    LOG_I("Channel config: belum ada, pakai default");
+    return false;
+  }
+
+  static ChannelsFile data;
+  size_t recordBytes = outputCount * sizeof(ChannelRecord);
+  size_t got = f.read((uint8_t *)&data, sizeof(data.header) + recordBytes);
+  f.close();
+
+  if (got != sizeof(data.header) + recordBytes ||
+      data.header.magic != CHANNELS_MAGIC ||
+      data.header.version != CHANNELS_VERSION ||
+      data.header.count != outputCount ||
+      data.header.recordSize != sizeof(ChannelRecord) ||
+      data.header.crc != crc32Calc((const uint8_t *)data.records, recordBytes))
+  {
+    LOG_W("Channel config: file tidak valid, pakai default");
+    return false;
+  }
+
+  for (int i = 0; i < outputCount; i++)
+  {
+    const ChannelRecord &r = data.records[i];
+    char name[CHANNEL_NAME_LEN + 1];
+    memcpy(name, r.name, CHANNEL_NAME_LEN);
+    name[CHANNEL_NAME_LEN] = '\0';
+
+    outputs[i].name = name;
+    outputs[i].intervalOn = r.intervalOn;
+    outputs[i].intervalOff = r.intervalOff;
+    outputs[i].maxToggles = r.maxToggles;
+    outputs[i].autoMode = r.autoMode != 0;
+    outputs[i].phaseMs = r.phaseMs;
+  }
+  LOG_I("Channel config dimuat (%d channel)", outputCount);
+  return true;
+}
+
+void persistLoop()
+{
+  deferredSaveLoop(configSave, saveConfig);
+  deferredSaveLoop(channelsSave, saveChannelConfig);
+}
+
+// Call before ESP.restart() so debounced writes are not lost
+void flushPendingSaves()
+{
+  deferredSaveFlush(configSave, saveConfig);
+  deferredSaveFlush(channelsSave, saveChannelConfig);
+  journalFlush();
+}
+
+// ==================== CONFIG MANAGEMENT ====================
+// config.json is parsed once, straight from the file, into `config`. The
+// "schema" key tracks the layout: files without it are schema 1 and get
+// rewritten as the current schema. Saves go through a temp file + rename
+// so a power cut leaves either the old or the new file, never a truncated
+// one, and are coalesced through configSave.
+#define CONFIG_TMP_FILE "/config.tmp"
+#define CONFIG_SCHEMA_VERSION 3
+#define TRANSPORT_PUBLISH_INTERVAL_MS 5000
+#define CONFIG_JSON_SIZE 4096 // Room for an "io" topology with 8 expanders and 8 groups, heap allocated
+
+void setDefaultConfig()
+{
+  config.wifiSSID = "";
+  config.wifiPassword = "";
+  config.mqtt = {false, "", 1883, "", "", TRANSPORT_PUBLISH_INTERVAL_MS, true};
+  config.ws = {true, "", 80, "/", "", TRANSPORT_PUBLISH_INTERVAL_MS, true};
+  config.webUsername = "admin";
+  config.webPassword = "admin123";
+  config.udpEnabled = false;
+  config.udpPort = UDP_CTRL_DEFAULT_PORT;
+  config.udpKey = "";
+  config.traceSpill = false;
+  config.syncStaggerMs = 0;
+}
+
+// Missing keys keep the current value
+void transportConfigFromJson(TransportConfig &t, JsonVariantConst obj)
+{
+  if (obj.isNull())
+    return;
+  t.enabled = obj["enabled"] | t.enabled;
+  t.host = obj["host"] | t.host;
+  t.port = obj["port"] | t.port;
+  t.path = obj["path"] | t.path;
+  t.token = obj["token"] | t.token;
+  t.publishIntervalMs = obj["publishIntervalMs"] | t.publishIntervalMs;
+  t.publishOnChange = obj["publishOnChange"] | t.publishOnChange;
+}
+
+void transportConfigToJson(const TransportConfig &t, JsonObject obj, bool withToken)
+{
+  obj["enabled"] = t.enabled;
+  obj["host"] = t.host;
+  obj["port"] = t.port;
+  obj["path"] = t.path;
+  if (withToken)
+    obj["token"] = t.token;
+  obj["publishIntervalMs"] = t.publishIntervalMs;
+  obj["publishOnChange"] = t.publishOnChange;
+}
+
+// Endpoint or enable changed: the transport has to reconnect
+bool transportConfigChanged(const TransportConfig &a, const TransportConfig &b)
+{
+  return a.enabled != b.enabled || a.host != b.host || a.port != b.port ||
+         a.path != b.path || a.token != b.token;
+}
+
+// Boot only: a valid "io" replaces the board topology setup() started
+// with, the caller then runs initHardwarePins() again
+bool loadConfig()
+{
+  setDefaultConfig();
+
+  // Sisa save yang terputus sebelum rename, config.json masih utuh
+  if (LittleFS.exists(CONFIG_TMP_FILE))
+    LittleFS.remove(CONFIG_TMP_FILE);
+
+  File file = LittleFS.open(CONFIG_FILE, "r");
+  if (!file)
+  {
+    Serial.println("Config file tidak ditemukan, menggunakan default");
+    Serial.println("   Default credentials set:");
+    Serial.println("   Username: admin");
+    Serial.println("   Password: admin123");
+    Serial.println("   Mode: WebSocket (1)");
+
+    requestConfigSave();
+    return false;
+  }
+
+  DynamicJsonDocument doc(CONFIG_JSON_SIZE);
+  DeserializationError error = deserializeJson(doc, file);
+  file.close();
+
+  if (error)
+  {
+    Serial.println("JSON Parse Error: " + String(error.c_str()));
+    Serial.println("Config file corrupt! Using default...");
+
+    // Written from loop(), not nested in this frame next to the parse buffer
+    requestConfigSave();
+
+    Serial.println("   Default config created");
+    Serial.println("   Username: admin");
+    Serial.println("   Password: admin123");
+    Serial.println("   Mode: WebSocket");
+    return false;
+  }
+
+  int schema = doc["schema"] | 1;
+
+  config.wifiSSID = doc["wifiSSID"] | "";
+  config.wifiPassword = doc["wifiPassword"] | "";
+  config.webUsername = doc["webUsername"] | "admin";
+  config.webPassword = doc["webPassword"] | "admin123";
+
+  if (schema < 3)
+  {
+    // Schema 1/2: one shared server block, commMode picks the transport
+    CommMode mode = (CommMode)(doc["commMode"] | (int)MODE_WEBSOCKET);
+    TransportConfig &t = mode == MODE_MQTT ? config.mqtt : config.ws;
+    config.mqtt.enabled = mode == MODE_MQTT;
+    config.ws.enabled = mode != MODE_MQTT;
+    t.host = doc["serverIP"] | "";
+    t.port = doc["serverPort"] | t.port;
+    t.path = doc["serverPath"] | "/";
+    t.token = doc["serverToken"] | "";
+  }
+  else
+  {
+    transportConfigFromJson(config.mqtt, doc["mqtt"]);
+    transportConfigFromJson(config.ws, doc["ws"]);
+  }
+
+  config.udpEnabled = doc["udpEnabled"] | false;
+  config.udpPort = doc["udpPort"] | UDP_CTRL_DEFAULT_PORT;
+  config.udpKey = doc["udpKey"] | "";
+  config.traceSpill = doc["traceSpill"] | false;
+  unsigned long syncStagger = doc["syncStagger"] | 0UL;
+  config.syncStaggerMs = syncStagger <= UINT16_MAX ? syncStagger : 0;
+
+  if (!doc["io"].isNull())
+    ioTopologyFromJson(doc["io"]);
+  if (!doc["groups"].isNull())
+    namedGroupsFromJson(doc["groups"]);
+
+  // Trim whitespace
+  config.wifiSSID.trim();
+  config.wifiPassword.trim();
+  config.mqtt.host.trim();
+  config.mqtt.path.trim();
+  config.mqtt.token.trim();
+  config.ws.host.trim();
+  config.ws.path.trim();
+  config.webUsername.trim();
+  config.webPassword.trim();
+  config.udpKey.trim();
+
+  if (schema < CONFIG_SCHEMA_VERSION)
+  {
+    Serial.printf("   Config schema %d -> %d, akan ditulis ulang\n", schema, CONFIG_SCHEMA_VERSION);
+    requestConfigSave();
+  }
+  else if (schema > CONFIG_SCHEMA_VERSION)
+  {
+    // Written by newer firmware: keep the file, unknown keys would be lost
+    Serial.printf("   Config schema %d lebih baru dari firmware (%d)\n", schema, CONFIG_SCHEMA_VERSION);
+  }
+
+  Serial.println("   Config loaded successfully");
+  Serial.println("   Login credentials:");
+  Serial.println("   Username: '" + config.webUsername + "'");
+  Serial.println("   Password: '" + config.webPassword + "'");
+  Serial.printf("   Transports: %s\n", transportsLabel());
+
+  return true;
+}
+
+bool saveConfig()
+{
+  DynamicJsonDocument doc(CONFIG_JSON_SIZE);
+
+  doc["schema"] = CONFIG_SCHEMA_VERSION;
+  doc["wifiSSID"] = config.wifiSSID;
+  doc["wifiPassword"] = config.wifiPassword;
+  transportConfigToJson(config.mqtt, doc.createNestedObject("mqtt"), true);
+  transportConfigToJson(config.ws, doc.createNestedObject("ws"), true);
+  doc["webUsername"] = config.webUsername;
+  doc["webPassword"] = config.webPassword;
+  doc["udpEnabled"] = config.udpEnabled;
+  doc["udpPort"] = config.udpPort;
+  doc["udpKey"] = config.udpKey;
+  doc["traceSpill"] = config.traceSpill;
+  doc["syncStagger"] = config.syncStaggerMs;
+  if (ioTopologyCustom)
+    ioTopologyToJson(doc.createNestedObject("io"));
+  if (namedGroupCount > 0)
+    namedGroupsToJson(doc.createNestedArray("groups"));
+
+  File file = LittleFS.open(CONFIG_TMP_FILE, "w");
   if (!file)
     return false;
 
-  serializeJson(doc, file);
-  file.close();
+  size_t expected = measureJson(doc);
+  size_t written = serializeJson(doc, file);
+  file.close();
+
+  if (written != expected || !LittleFS.rename(CONFIG_TMP_FILE, CONFIG_FILE))
+  {
+    LOG_E("Config save failed");
+    LittleFS.remove(CONFIG_TMP_FILE);
+    return false;
+  }
+
+  LOG_I("Config saved");
+  return true;
+}
+
+// Coalesced save for runtime changes (mode switch, web/serial edits)
+void requestConfigSave()
+{
+  deferredSaveRequest(configSave);
+}
+
+// ==================== LCD ====================
+// 16x2 framebuffer. updateLCD() only renders a page into lcdFrame.
+// lcdFlushStep() sends one HD44780 byte per loop() pass, after relay
+// commits, so a relay write never waits behind more than one LCD byte on
+// the shared I2C bus. Only cells that differ from lcdShown are sent and
+// the HD44780 advances its cursor by itself, so setCursor is only needed
+// where unchanged cells are skipped.
+char lcdFrame[LCD_ROWS][LCD_COLS];
+char lcdShown[LCD_ROWS][LCD_COLS]; // 0 = unknown, always rewritten
+
+void lcdFrameClear()
+{
+  memset(lcdFrame, ' ', sizeof(lcdFrame));
+}
+
+// Text is clipped at the end of the row
+void lcdFrameText(int row, int col, const char *text)
+{
+  for (; *text && col < LCD_COLS; text++, col++)
+    lcdFrame[row][col] = *text;
+}
+
+#define LCD_CELLS (LCD_ROWS * LCD_COLS)
+
+int lcdCursor = -1; // Cell the display cursor is on, -1 = unknown
+int lcdBus = -1;    // i2cDevices[] index of the display
+
+// false when the display already shows lcdFrame
+bool lcdFlushStep()
+{
+  int start = lcdCursor < 0 ? 0 : lcdCursor;
+
+  for (int n = 0; n < LCD_CELLS; n++)
+  {
+    int cell = (start + n) % LCD_CELLS;
+    int r = cell / LCD_COLS;
+    int c = cell % LCD_COLS;
+    if (lcdFrame[r][c] == lcdShown[r][c])
+      continue;
+
+    if (cell != lcdCursor)
+    {
+      lcd.setCursor(c, r);
+      lcdCursor = cell;
+    }
+    else
+    {
+      lcd.write((uint8_t)lcdFrame[r][c]);
+      lcdShown[r][c] = lcdFrame[r][c];
+      // Past column 15 the cursor is off-screen (DDRAM 0x10), not on row 1
+      lcdCursor = c + 1 < LCD_COLS ? cell + 1 : -1;
+    }
+    lcdBytesSent++;
+    lcdRefreshBytes++;
+    return true;
+  }
+
+  if (lcdRefreshBytes)
+  {
+    lcdRefreshes++;
+    lcdLastRefreshBytes = lcdRefreshBytes;
+    lcdRefreshBytes = 0;
+  }
+  return false;
+}
+
+// Called once per loop() pass, after the relay commits of that pass
+void lcdLoop()
+{
+  if (lcdNeedsRedraw)
+  {
+    lcdNeedsRedraw = false;
+    updateLCD();
+  }
+
+  if (lcdBus < 0 || !i2cGrant(I2C_PRIO_LCD))
+    return;
+
+  // LiquidCrystal_I2C ignores Wire errors, so only the time is recorded
+  I2cDevice &bus = i2cDevices[lcdBus];
+  i2cUseClock(bus.clockHz);
+  unsigned long t0 = micros();
+  if (lcdFlushStep())
+  {
+    unsigned long us = micros() - t0;
+    if (us > lcdSliceMaxUs)
+      lcdSliceMaxUs = us;
+    bus.transactions++;
+    histRecord(bus.latency, us);
+  }
+}
+
+void updateLCD()
+{
+  lcdFrameClear();
+  char buf[LCD_COLS + 1];
+
+  if (remoteConnected)
+  {
+    int startOutput = (lcdOutputPage * 4) + 1;
+
+    // Two channels per row: "Q1:0, Q2:1, "
+    for (int row = 0; row < LCD_ROWS; row++)
+    {
+      int col = 0;
+      for (int i = 0; i < 2; i++)
+      {
+        int ch = startOutput + row * 2 + i;
+        if (ch <= outputCount)
+        {
+          snprintf(buf, sizeof(buf), "Q%d:%d, ", ch, outputs[ch - 1].state ? 1 : 0);
+          lcdFrameText(row, col, buf);
+          col += strlen(buf);
+        }
+      }
+    }
+  }
+  else
+  {
+    if (wifiState == WIFI_STATE_CONNECTING)
+    {
+      lcdFrameText(0, 0, "WiFi connecting");
+    }
+    else
+    {
+      snprintf(buf, sizeof(buf), "%s:%s", wifiConnected ? "IP" : "AP",
+               (wifiConnected ? WiFi.localIP() : WiFi.softAPIP()).toString().c_str());
+      lcdFrameText(0, 0, buf);
+    }
+    snprintf(buf, sizeof(buf), "%s: NOT CONNECTED", transportsLabel());
+    lcdFrameText(1, 0, buf);
+  }
+}
+
+// ==================== MODE SWITCHING ====================
+// Legacy single-mode switch: newMode becomes the only enabled transport.
+// Concurrent transports are configured on the config page / TRANSPORT.
+void switchMode(CommMode newMode, bool saveToConfig)
+{
+  TransportConfig &target = newMode == MODE_MQTT ? config.mqtt : config.ws;
+  TransportConfig &other = newMode == MODE_MQTT ? config.ws : config.mqtt;
+
+  if (target.enabled && !other.enabled && !modeSwitching)
+  {
+    LOG_I("Already in this mode");
+    return;
+  }
+
+  modeSwitching = true;
+
+  LOG_I("Switching mode: %s -> %s",
+        transportsLabel(), newMode == MODE_MQTT ? "MQTT" : "WebSocket");
+
+  // Disconnect current mode
+  transportsStop();
+
+  // Before concurrent transports both modes shared one server block
+  if (target.host.length() == 0)
+  {
+    target.host = other.host;
+    target.port = other.port;
+    target.path = other.path;
+    target.token = other.token;
+  }
+  target.enabled = true;
+  other.enabled = false;
+
+  if (saveToConfig)
+  {
+    requestConfigSave();
+  }
+
+  // Setup new mode
+  transportsBegin();
+
+  updateLCD();
+  modeSwitching = false;
+
+  LOG_I("Mode switched successfully");
+}
+
+// ==================== JSON HELPERS ====================
+// Scales with the topology: about 150 bytes of document per channel
+#define STATUS_JSON_SIZE(n) (1024 + (n) * (JSON_OBJECT_SIZE(9) + CHANNEL_NAME_LEN))
+
+String getStatusJSON()
+{
+  DynamicJsonDocument doc(STATUS_JSON_SIZE(outputCount));
+  JsonArray arr = doc.createNestedArray("outputs");
+
+  for (int i = 0; i < outputCount; i++)
+  {
+    JsonObject obj = arr.createNestedObject();
+    obj["id"] = i;
+    obj["channel"] = i + 1;
+    obj["name"] = outputs[i].name;
+    obj["state"] = outputs[i].state;
+    obj["intervalOn"] = outputs[i].intervalOn / 1000;
+    obj["intervalOff"] = outputs[i].intervalOff / 1000;
+    obj["autoMode"] = outputs[i].autoMode;
+    obj["maxToggles"] = outputs[i].maxToggles;
+    obj["currentToggles"] = outputs[i].currentToggles;
+
+  }
+
+  doc["wifiConnected"] = wifiConnected;
+  doc["remoteConnected"] = remoteConnected;
+  // Legacy single-mode fields: MQTT only when it is the only transport
+  doc["commMode"] = (config.mqtt.enabled && !config.ws.enabled) ? (int)MODE_MQTT : (int)MODE_WEBSOCKET;
+  doc["modeName"] = transportsLabel();
+  doc["totalOutputs"] = outputCount;
+
+  JsonArray tr = doc.createNestedArray("transports");
+  for (int i = 0; i < TRANSPORT_COUNT; i++)
+  {
+    JsonObject t = tr.createNestedObject();
+    t["name"] = transports[i].name;
+    t["enabled"] = transports[i].cfg->enabled;
+    t["connected"] = *transports[i].connected;
+  }
+
+  if (config.mqtt.enabled)
+  {
+    JsonObject mqtt = doc.createNestedObject("mqtt");
+    mqtt["reconnectAttempts"] = mqttReconnectAttempts;
+    mqtt["disconnectedMs"] = mqttDisconnectedMs();
+    mqtt["backoffMs"] = mqttBackoffMs;
+  }
+  doc["loopStallMaxUs"] = loopHist[SEC_LOOP].maxUs;
+
+  String json;
+  serializeJson(doc, json);
+  return json;
+}
+
+// ==================== JSON HELPERS (REMOTE) ====================
+// Keys are copied, "O128" fits in 8 bytes
+#define STATE_JSON_SIZE(n) (JSON_OBJECT_SIZE(n) + (n) * 8)
+
+String getRemoteStatusJSON()
+{
+  DynamicJsonDocument doc(STATE_JSON_SIZE(outputCount));
+
+  for (int i = 0; i < outputCount; i++)
+  {
+    String key = "O" + String(i + 1);
+    doc[key] = outputs[i].state ? "1" : "0";
+  }
+
+  String json;
+  serializeJson(doc, json);
+  return json;
+}
+
+String getThingsBoardTelemetryJSON()
+{
+  DynamicJsonDocument doc(STATE_JSON_SIZE(outputCount));
+
+  for (int i = 0; i < outputCount; i++)
+  {
+    String key = "Q" + String(i + 1);
+    doc[key] = outputs[i].state ? 1 : 0;
+  }
+
+  String json;
+  serializeJson(doc, json);
+  return json;
+}
+
+// Remote payloads only depend on the output states, so each format is
+// rendered once per outputState value and shared by every transport.
+enum SnapshotFormat : uint8_t
+{
+  SNAPSHOT_REMOTE = 0,  // {"O1":"1",...} WS + plain MQTT
+  SNAPSHOT_THINGSBOARD, // {"Q1":1,...}
+  SNAPSHOT_FORMAT_COUNT
+};
+
+struct StateSnapshot
+{
+  bool valid;
+  OutputBits stateBits;
+  String json;
+};
+
+StateSnapshot snapshots[SNAPSHOT_FORMAT_COUNT];
+
+const String &stateSnapshot(SnapshotFormat format)
+{
+  StateSnapshot &snap = snapshots[format];
+  if (snap.valid && snap.stateBits == outputState)
+  {
+    snapshotHits++;
+    return snap.json;
+  }
+
+  snap.json = format == SNAPSHOT_THINGSBOARD ? getThingsBoardTelemetryJSON() : getRemoteStatusJSON();
+  snap.stateBits = outputState;
+  snap.valid = true;
+  snapshotRenders++;
+  return snap.json;
+}
+
+// ==================== DEFERRED ACTIONS ====================
+// Command handlers never block: work that has to wait (telemetry after an
+// RPC, restart after its reply went out, TEST steps) is queued here and run
+// from loop(). Queuing the same fn+arg again keeps the earlier slot, so an
+// RPC burst ends in one publish.
+#define DEFERRED_ACTION_SLOTS 16
+
+DeferredAction deferredActions[DEFERRED_ACTION_SLOTS];
+
+bool deferAction(unsigned long delayMs, void (*fn)(int), int arg)
+{
+  int freeSlot = -1;
+  for (int i = 0; i < DEFERRED_ACTION_SLOTS; i++)
+  {
+    DeferredAction &a = deferredActions[i];
+    if (a.fn == fn && a.arg == arg)
+    {
+      deferredCoalesced++;
+      return true;
+    }
+    if (!a.fn && freeSlot < 0)
+      freeSlot = i;
+  }
+
+  if (freeSlot < 0)
+  {
+    deferredDropped++;
+    LOG_W("Deferred action queue full");
+    return false;
+  }
+
+  deferredActions[freeSlot] = {fn, arg, millis() + delayMs};
+  return true;
+}
+
+void deferredActionsLoop()
+{
+  unsigned long now = millis();
+  for (int i = 0; i < DEFERRED_ACTION_SLOTS; i++)
+  {
+    DeferredAction &a = deferredActions[i];
+    if (!a.fn || (long)(now - a.due) < 0)
+      continue;
+
+    // Free the slot first, the action may queue a follow-up
+    void (*fn)(int) = a.fn;
+    int arg = a.arg;
+    a.fn = nullptr;
+    deferredRun++;
+    fn(arg);
+  }
+}
+
+void actionPublishState(int)
+{
+  publishState();
+}
+
+void actionRestart(int)
+{
+  LOG_W("Restarting...");
+  flushPendingSaves();
+  logDrain();
+  ESP.restart();
+}
+
+// Reply first, restart once it has left (1 s, as before)
+void scheduleRestart()
+{
+  if (!deferAction(1000, actionRestart, 0))
+    actionRestart(0);
+}
+
+// Serial TEST: arg = channel * 2 + phase (0 = switch on, 1 = switch off)
+void actionTestStep(int arg)
+{
+  int channel = arg / 2;
+  if (channel > outputCount)
+  {
+    Serial.println("Complete\n");
+    return;
+  }
+
+  if (arg % 2 == 0)
+  {
+    Serial.printf("CH%02d... ", channel);
+    setOutput(channel, true, SRC_SERIAL);
+    deferAction(300, actionTestStep, arg + 1);
+  }
+  else
+  {
+    setOutput(channel, false, SRC_SERIAL);
+    Serial.println("OK");
+    deferAction(100, actionTestStep, arg + 1);
+  }
+}
+
+// ==================== ADMISSION CONTROL ====================
+// Every remote command passes a token bucket for its source (HTTP, WS,
+// MQTT) and, for HTTP, one for the client IP, so a runaway integration
+// cannot starve the scheduler. Output changes are not written right away:
+// they are collected in a pending mask and committed once per loop(),
+// the last writer per channel wins, with one write per expander and a
+// single publish.
+#define CLIENT_BUCKETS 8
+#define CLIENT_RATE_PER_SEC 10
+#define CLIENT_BURST 20
+
+// Indexed by CmdSource, rate 0 = unlimited (boot, serial, scheduler, UDP)
+TokenBucket sourceBuckets[CMD_SOURCE_COUNT] = {
+    {0, 0, 0, 0},         // unknown
+    {0, 0, 0, 0},         // boot
+    {20, 40, 40000, 0},   // http
+    {20, 40, 40000, 0},   // ws
+    {20, 40, 40000, 0},   // mqtt
+    {0, 0, 0, 0},         // serial
+    {0, 0, 0, 0},         // scheduler
+    {0, 0, 0, 0},         // udp: HMAC + UDP_MAX_FRAMES_PER_LOOP
+};
+
+ClientBucket clientBuckets[CLIENT_BUCKETS];
+
+bool bucketTake(TokenBucket &b)
+{
+  if (b.ratePerSec == 0)
+    return true;
+
+  unsigned long now = millis();
+  uint32_t cap = (uint32_t)b.burst * 1000;
+  unsigned long elapsed = now - b.lastRefill;
+  b.lastRefill = now;
+  // tokens/s == milli-tokens/ms
+  b.milliTokens = elapsed >= cap / b.ratePerSec ? cap : min(cap, b.milliTokens + (uint32_t)elapsed * b.ratePerSec);
+
+  if (b.milliTokens < 1000)
+    return false;
+  b.milliTokens -= 1000;
+  return true;
+}
+
+// Bucket of one client IP, the least recently seen one is recycled
+TokenBucket &clientBucket(uint32_t ip)
+{
+  int victim = 0;
+  for (int i = 0; i < CLIENT_BUCKETS; i++)
+  {
+    if (clientBuckets[i].ip == ip)
+      return clientBuckets[i].bucket;
+    if (clientBuckets[i].bucket.lastRefill < clientBuckets[victim].bucket.lastRefill)
+      victim = i;
+  }
 
-  Serial.println("Config saved");
+  ClientBucket &c = clientBuckets[victim];
+  c.ip = ip;
+  c.bucket = {CLIENT_RATE_PER_SEC, CLIENT_BURST, CLIENT_BURST * 1000, millis()};
+  return c.bucket;
+}
+
+// false = drop the command. clientIp 0 = no per-client limit.
+bool admitCommand(CmdSource source, uint32_t clientIp = 0)
+{
+  bool ok = bucketTake(sourceBuckets[source]) && (clientIp == 0 || bucketTake(clientBucket(clientIp)));
+  if (!ok)
+  {
+    cmdDropped[source]++;
+    LOG_D("Command from %s dropped (rate limit)", cmdSourceName(source));
+    return false;
+  }
+  cmdAdmitted[source]++;
   return true;
 }
 
-// ==================== LCD ====================
-void updateLCD()
+// Output change from a remote command, committed by applyPendingOutputs()
+void queueOutput(int channel, bool state, CmdSource source)
 {
-  lcd.clear();
-  if (remoteConnected)
+  if (channel < 1 || channel > outputCount)
+    return;
+
+  int index = channel - 1;
+  if (pendingOutputMask.get(index))
+    outputsCoalesced++;
+
+  pendingOutputMask.set(index, true);
+  pendingOutputValue.set(index, state);
+  pendingOutputSource[index] = source;
+}
+
+// Several channels at once (group commands): same rules as queueOutput()
+void queueOutputMask(const OutputBits &mask, const OutputBits &values, CmdSource source)
+{
+  for (int w = 0; w < OUTPUT_WORDS; w++)
   {
-    int startOutput = (lcdOutputPage * 4) + 1; 
-    
-    lcd.setCursor(0, 0);
-    for (int i = 0; i < 2; i++) {
-      int ch = startOutput + i;
-      if (ch <= TOTAL_OUTPUTS) {
-        char buf[8];
-        sprintf(buf, "Q%d:%d, ", ch, outputs[ch-1].state ? 1 : 0);
-        lcd.print(buf);
-      }
-    }
-    
-    lcd.setCursor(0, 1);
-    for (int i = 2; i < 4; i++) {
-      int ch = startOutput + i;
-      if (ch <= TOTAL_OUTPUTS) {
-        char buf[8]; 
-        sprintf(buf, "Q%d:%d, ", ch, outputs[ch-1].state ? 1 : 0);
-        lcd.print(buf);
-      }
-    }
+    outputsCoalesced += __builtin_popcount(pendingOutputMask.words[w] & mask.words[w]);
+    pendingOutputMask.words[w] |= mask.words[w];
+    pendingOutputValue.words[w] = (pendingOutputValue.words[w] & ~mask.words[w]) | (values.words[w] & mask.words[w]);
   }
-  else
+  for (int i = mask.next(0); i >= 0; i = mask.next(i + 1))
+    pendingOutputSource[i] = source;
+}
+
+// Publish once at the end of this loop() instead of per command
+void requestPublish()
+{
+  statePublishPending = true;
+}
+
+void applyPendingOutputs()
+{
+  if (pendingOutputMask.any())
   {
-    lcd.setCursor(0, 0);
-    if (wifiConnected)
-    {
-      lcd.print("IP:");
-      lcd.print(WiFi.localIP().toString());
-    }
-    else
+    applyOutputMask(pendingOutputMask, pendingOutputValue, SRC_UNKNOWN, pendingOutputSource);
+    pendingOutputMask.clear();
+  }
+}
+
+// After the commands and the scheduler: one snapshot for everything this
+// loop() changed
+void publishPendingState()
+{
+  if (statePublishPending)
+  {
+    statePublishPending = false;
+    publishState();
+  }
+}
+
+// ==================== NAMED GROUPS ====================
+// Groups from config.json "groups": a name, an explicit channel list and
+// an own auto schedule. Members never join the interval-keyed sync groups,
+// so two machines with the same timing stay independent. Group commands
+// are mask operations on OutputBits (OUTPUT_WORDS words) and end in one
+// batched commit: queueOutputMask() for remote commands, applyOutputMask()
+// for the schedule. Their cost depends on the group, not on outputCount.
+// Membership is read at boot only; the schedule can change at runtime and
+// is saved back to config.json.
+
+// "1-4,7,10-12" -> channel bits. false on a bad token or a channel
+// outside 1..outputCount.
+bool channelRangesParse(const char *text, OutputBits &bits)
+{
+  bits.clear();
+  while (*text)
+  {
+    char *end;
+    long first = strtol(text, &end, 10);
+    long last = first;
+    if (end == text)
+      return false;
+    if (*end == '-')
     {
-      lcd.print("AP:");
-      lcd.print(WiFi.softAPIP().toString());
+      text = end + 1;
+      last = strtol(text, &end, 10);
+      if (end == text)
+        return false;
     }
-    lcd.setCursor(0, 1);
-    String mode = (config.commMode == MODE_MQTT) ? "MQTT" : "WS";
-    lcd.print(mode + ": ");
-    lcd.print("NOT CONNECTED");
+    if (first < 1 || last > outputCount || first > last)
+      return false;
+    for (long ch = first; ch <= last; ch++)
+      bits.set(ch - 1, true);
+
+    while (*end == ' ')
+      end++;
+    if (*end == ',')
+      end++;
+    else if (*end)
+      return false;
+    text = end;
+    while (*text == ' ')
+      text++;
   }
+  return true;
 }
 
-// ==================== MODE SWITCHING ====================
-void switchMode(CommMode newMode, bool saveToConfig)
+String channelRangesFormat(const OutputBits &bits)
 {
-  if (config.commMode == newMode && !modeSwitching)
+  String out;
+  for (int i = bits.next(0); i >= 0;)
   {
-    Serial.println("Already in this mode");
-    return;
+    int last = i;
+    while (last + 1 < MAX_OUTPUTS && bits.get(last + 1))
+      last++;
+
+    if (out.length())
+      out += ",";
+    out += String(i + 1);
+    if (last > i)
+      out += "-" + String(last + 1);
+    i = bits.next(last + 1);
   }
+  return out;
+}
 
-  modeSwitching = true;
+int namedGroupFind(const char *name)
+{
+  for (int g = 0; g < namedGroupCount; g++)
+  {
+    if (strcasecmp(namedGroups[g].name, name) == 0)
+      return g;
+  }
+  return -1;
+}
 
-  Serial.printf("\n Switching mode: %s → %s\n",
-                config.commMode == MODE_MQTT ? "MQTT" : "WebSocket",
-                newMode == MODE_MQTT ? "MQTT" : "WebSocket");
+// Invalid groups are logged and skipped, the others still load
+void namedGroupsFromJson(JsonVariantConst list)
+{
+  namedGroupCount = 0;
+  namedGroupMembers.clear();
 
-  // Disconnect current mode
-  if (config.commMode == MODE_MQTT)
+  for (JsonObjectConst item : list.as<JsonArrayConst>())
   {
-    if (mqttClient.connected())
+    const char *name = item["name"] | "";
+    if (namedGroupCount == MAX_NAMED_GROUPS)
     {
-      Serial.println("Disconnecting MQTT...");
-      mqttClient.disconnect();
+      LOG_W("Groups: Maksimal %d grup, '%s' diabaikan", MAX_NAMED_GROUPS, name);
+      break;
     }
-  }
-  else
-  {
-    if (wsClient.isConnected())
+
+    NamedGroup &g = namedGroups[namedGroupCount];
+    memset(&g, 0, sizeof(g));
+    if (!*name || strlen(name) >= GROUP_NAME_LEN || namedGroupFind(name) >= 0)
     {
-      Serial.println("Disconnecting WebSocket...");
-      wsClient.disconnect();
+      LOG_W("Groups: Nama '%s' tidak valid atau dobel", name);
+      continue;
     }
-  }
+    if (!channelRangesParse(item["channels"] | "", g.members) || !g.members.any())
+    {
+      LOG_W("Groups: '%s' channels tidak valid", name);
+      continue;
+    }
+
+    bool overlap = false;
+    for (int w = 0; w < OUTPUT_WORDS; w++)
+      overlap = overlap || (g.members.words[w] & namedGroupMembers.words[w]);
+    if (overlap)
+    {
+      LOG_W("Groups: '%s' berbagi channel dengan grup lain", name);
+      continue;
+    }
+
+    strlcpy(g.name, name, sizeof(g.name));
+    g.autoMode = item["autoMode"] | false;
+    g.intervalOn = (item["intervalOn"] | 5UL) * 1000;
+    g.intervalOff = (item["intervalOff"] | 5UL) * 1000;
+    if (g.intervalOn == 0 || g.intervalOff == 0)
+    {
+      LOG_W("Groups: '%s' interval tidak valid", name);
+      continue;
+    }
+    unsigned long phase = item["phase"] | 0UL;
+    unsigned long stagger = item["stagger"] | 0UL;
+    if (phase > UINT16_MAX || stagger > UINT16_MAX)
+    {
+      LOG_W("Groups: '%s' phase/stagger tidak valid", name);
+      phase = stagger = 0;
+    }
+    g.phaseMs = phase; // Checked against the interval by groupOffsetsCheck()
+    g.staggerMs = stagger;
+    g.lastToggle = millis(); // currentState: groupStatesSeed()
 
-  remoteConnected = false;
+    for (int w = 0; w < OUTPUT_WORDS; w++)
+      namedGroupMembers.words[w] |= g.members.words[w];
+    namedGroupCount++;
+  }
 
-  // Update config
-  config.commMode = newMode;
+  Serial.printf("   Groups: %d\n", namedGroupCount);
+}
 
-  if (saveToConfig)
+void namedGroupsToJson(JsonArray list)
+{
+  for (int i = 0; i < namedGroupCount; i++)
   {
-    saveConfig();
+    const NamedGroup &g = namedGroups[i];
+    JsonObject item = list.createNestedObject();
+    item["name"] = g.name;
+    item["channels"] = channelRangesFormat(g.members);
+    item["autoMode"] = g.autoMode;
+    item["intervalOn"] = g.intervalOn / 1000;
+    item["intervalOff"] = g.intervalOff / 1000;
+    if (g.phaseMs > 0)
+      item["phase"] = g.phaseMs;
+    if (g.staggerMs > 0)
+      item["stagger"] = g.staggerMs;
   }
+}
 
-  // Setup new mode
-  if (config.commMode == MODE_MQTT)
+// State each channel will have after this loop's queued commands
+OutputBits outputTargetState()
+{
+  OutputBits target;
+  for (int w = 0; w < OUTPUT_WORDS; w++)
+    target.words[w] = (outputState.words[w] & ~pendingOutputMask.words[w]) |
+                      (pendingOutputValue.words[w] & pendingOutputMask.words[w]);
+  return target;
+}
+
+bool isGroupAction(const String &action)
+{
+  return action == "setGroupState" || action == "toggleGroup" ||
+         action == "setGroupInterval" || action == "setGroupAutoMode" ||
+         action == "setGroupPhase";
+}
+
+// Shared by HTTP, WS/MQTT commands, RPC and serial. args: "group" plus
+// "state" / "intervalOn" + "intervalOff" (seconds) / "autoMode" /
+// "phase" + "stagger" (ms).
+// nullptr = done, else the error text.
+const char *namedGroupAction(const String &action, JsonVariantConst args, CmdSource source)
+{
+  int index = namedGroupFind(args["group"] | "");
+  if (index < 0)
+    return "Unknown group";
+  NamedGroup &g = namedGroups[index];
+
+  if (action == "setGroupState" && (g.phaseMs > 0 || g.staggerMs > 0))
+  {
+    // Switched on the group's own spacing, not as one batch. Members
+    // without an offset join this loop's commit like any other command.
+    outputScheduleMask(g.members, args["state"].as<bool>(), g.phaseMs, g.staggerMs, TIMER_MAX_MS + 1, source, true);
+    requestPublish();
+  }
+  else if (action == "setGroupState" || action == "toggleGroup")
   {
-    Serial.println("Setting up MQTT...");
-    if (wifiConnected && config.serverIP.length() > 0)
+    OutputBits values;
+    if (action == "toggleGroup")
+    {
+      OutputBits target = outputTargetState();
+      for (int w = 0; w < OUTPUT_WORDS; w++)
+        values.words[w] = ~target.words[w] & g.members.words[w];
+    }
+    else
     {
-      mqttClient.setServer(config.serverIP.c_str(), config.serverPort);
+      values = args["state"].as<bool>() ? g.members : OutputBits{};
     }
+    queueOutputMask(g.members, values, source);
+    requestPublish();
+  }
+  else if (action == "setGroupInterval")
+  {
+    unsigned long on = args["intervalOn"] | 0UL;
+    unsigned long off = args["intervalOff"] | 0UL;
+    if (on == 0 || off == 0)
+      return "Invalid interval";
+    if (!groupOffsetsFit(g.members, g.phaseMs, g.staggerMs, on * 1000, off * 1000))
+      return "Interval shorter than phase/stagger";
+    g.intervalOn = on * 1000;
+    g.intervalOff = off * 1000;
+    requestConfigSave();
+  }
+  else if (action == "setGroupAutoMode")
+  {
+    g.autoMode = args["autoMode"] | false;
+    g.lastToggle = millis();
+    g.currentState = outputTargetState().get(g.members.next(0));
+    requestConfigSave();
+  }
+  else if (action == "setGroupPhase")
+  {
+    unsigned long phase = args["phase"] | (unsigned long)g.phaseMs;
+    unsigned long stagger = args["stagger"] | (unsigned long)g.staggerMs;
+    if (phase > UINT16_MAX || stagger > UINT16_MAX)
+      return "Invalid offset";
+    if (!groupOffsetsFit(g.members, phase, stagger, g.intervalOn, g.intervalOff))
+      return "Phase/stagger longer than the interval";
+    g.phaseMs = phase;
+    g.staggerMs = stagger;
+    requestConfigSave();
   }
   else
   {
-    Serial.println("Setting up WebSocket...");
-    if (wifiConnected && config.serverIP.length() > 0)
-    {
-      wsClient.begin(config.serverIP.c_str(), config.serverPort, config.serverPath.c_str());
-      wsClient.setReconnectInterval(5000);
-    }
+    return "Unknown action";
   }
 
-  updateLCD();
-  modeSwitching = false;
-
-  Serial.println("Mode switched successfully\n");
+  namedGroupCommits++;
+  LOG_I("Group %s: %s (%s)", g.name, action.c_str(), cmdSourceName(source));
+  return nullptr;
 }
 
-// ==================== JSON HELPERS ====================
-String getStatusJSON()
+void processNamedGroups()
 {
-  StaticJsonDocument<3072> doc;
-  JsonArray arr = doc.createNestedArray("outputs");
+  unsigned long currentMillis = millis();
 
-  for (int i = 0; i < TOTAL_OUTPUTS; i++)
+  for (int i = 0; i < namedGroupCount; i++)
   {
-    JsonObject obj = arr.createNestedObject();
-    obj["id"] = i;
-    obj["channel"] = i + 1;
-    obj["name"] = outputs[i].name;
-    obj["state"] = outputs[i].state;
-    obj["intervalOn"] = outputs[i].intervalOn / 1000;
-    obj["intervalOff"] = outputs[i].intervalOff / 1000;
-    obj["autoMode"] = outputs[i].autoMode;
-    obj["maxToggles"] = outputs[i].maxToggles;
-    obj["currentToggles"] = outputs[i].currentToggles;
+    NamedGroup &g = namedGroups[i];
+    if (!g.autoMode)
+      continue;
 
-  }
+    unsigned long interval = g.currentState ? g.intervalOn : g.intervalOff;
+    if (currentMillis - g.lastToggle < interval)
+      continue;
 
-  doc["wifiConnected"] = wifiConnected;
-  doc["remoteConnected"] = remoteConnected;
-  doc["commMode"] = (int)config.commMode;
-  doc["modeName"] = config.commMode == MODE_WEBSOCKET ? "MQTT" : "WebSocket";
-  doc["totalOutputs"] = TOTAL_OUTPUTS;
+    g.currentState = !g.currentState;
+    g.lastToggle = currentMillis;
 
-  String json;
-  serializeJson(doc, json);
-  return json;
+    outputScheduleMask(g.members, g.currentState, g.phaseMs, g.staggerMs,
+                       min(g.intervalOn, g.intervalOff), SRC_SCHEDULER);
+    LOG_D("Group %s TOGGLE -> %s", g.name, g.currentState ? "ON" : "OFF");
+    requestPublish();
+  }
 }
 
-// ==================== JSON HELPERS (REMOTE) ====================
-String getRemoteStatusJSON()
+// ==================== TIMED OUTPUTS ====================
+// Pulses, delayed on/off and bursts on one channel, all as one timer heap
+// entry (see TIMER HEAP), so any number of them costs nothing per loop()
+// until one is due. Times are in ms, up to TIMER_MAX_MS.
+bool isTimedAction(const String &action)
 {
-  StaticJsonDocument<512> doc;
+  return action == "pulse" || action == "delayedOn" || action == "delayedOff" ||
+         action == "burst" || action == "cancelTimer";
+}
+
+// Shared by HTTP, WS/MQTT commands, RPC and serial. args: "channel" (1..N)
+// plus "ms" (+ optional "state", default ON) for pulse, "ms" for
+// delayedOn / delayedOff, "onMs" + "offMs" + "count" for burst.
+// nullptr = done, else the error text.
+const char *timedOutputAction(const String &action, JsonVariantConst args, CmdSource source)
+{
+  int channel = args["channel"] | 0;
+  if (channel < 1 || channel > outputCount)
+    return "Invalid channel";
+  int index = channel - 1;
+  uint32_t now = micros();
 
-  for (int i = 0; i < TOTAL_OUTPUTS; i++)
+  if (action == "cancelTimer")
   {
-    String key = "O" + String(i + 1);
-    doc[key] = outputs[i].state ? "1" : "0";
+    timerCancel(index);
+    return nullptr;
   }
 
-  String json;
-  serializeJson(doc, json);
-  return json;
+  if (action == "burst")
+  {
+    unsigned long onMs = args["onMs"] | 0UL;
+    unsigned long offMs = args["offMs"] | 0UL;
+    unsigned long count = args["count"] | 0UL;
+    if (onMs == 0 || offMs == 0 || onMs > TIMER_MAX_MS || offMs > TIMER_MAX_MS)
+      return "Invalid time";
+    if (count == 0 || count > UINT16_MAX / 2)
+      return "Invalid count";
+    timerSchedule(index, true, now, source, count * 2, onMs, offMs);
+  }
+  else
+  {
+    unsigned long ms = args["ms"] | 0UL;
+    if (ms > TIMER_MAX_MS || (ms == 0 && action == "pulse"))
+      return "Invalid time";
+
+    if (action == "pulse")
+    {
+      bool state = args["state"] | true;
+      timerSchedule(index, state, now, source, 2, ms, ms);
+    }
+    else
+    {
+      timerSchedule(index, action == "delayedOn", now + ms * 1000, source);
+    }
+  }
+
+  timerStarts++;
+  LOG_I("CH%02d: %s (%s)", channel, action.c_str(), cmdSourceName(source));
+  return nullptr;
 }
 
 // ==================== COMMAND PROCESSOR ====================
-void processCommand(String command, String source)
+void processCommand(String command, CmdSource source)
 {
   StaticJsonDocument<512> doc;
 
   if (deserializeJson(doc, command) != DeserializationError::Ok)
   {
-    Serial.println("Invalid JSON command");
+    LOG_W("Invalid JSON command");
     return;
   }
 
   String action = doc["action"].as<String>();
 
-  Serial.printf("Command from %s: %s\n", source.c_str(), action.c_str());
+  if (!admitCommand(source))
+    return;
+
+  LOG_I("Command from %s: %s", cmdSourceName(source), action.c_str());
 
   // Command: Switch Mode
   if (action == "switchMode" || action == "setMode")
@@ -684,66 +3867,304 @@ void processCommand(String command, String source)
     int channel = doc["channel"];
     bool state = doc["state"];
 
-    if (channel >= 1 && channel <= TOTAL_OUTPUTS)
+    if (channel >= 1 && channel <= outputCount)
+    {
+      queueOutput(channel, state, source);
+      requestPublish();
+    }
+  }
+
+  // Command: Get Status
+  else if (action == "getStatus")
+  {
+    requestPublish();
+  }
+
+  // Command: Set Interval
+  else if (action == "setInterval")
+  {
+    int id = doc["id"];
+    if (id >= 0 && id < outputCount)
+    {
+      outputs[id].intervalOn = doc["intervalOn"].as<unsigned long>() * 1000;
+      outputs[id].intervalOff = doc["intervalOff"].as<unsigned long>() * 1000;
+      markChannelConfigDirty();
+      syncGroupUpdate(id);
+    }
+  }
+
+  // Command: Set Auto Mode
+  else if (action == "setAutoMode")
+  {
+    int id = doc["id"];
+    if (id >= 0 && id < outputCount)
+    {
+      outputs[id].autoMode = doc["autoMode"];
+      outputs[id].lastToggle = millis();
+      markChannelConfigDirty();
+      syncGroupUpdate(id);
+    }
+  }
+
+  // Command: Set Phase (ms after the channel's group tick)
+  else if (action == "setPhase")
+  {
+    int id = doc["id"];
+    unsigned long phase = doc["phase"] | 0UL;
+    if (id >= 0 && id < outputCount && channelPhaseFits(id, phase))
+    {
+      outputs[id].phaseMs = phase;
+      markChannelConfigDirty();
+    }
+    else
     {
-      setOutput(channel, state);
+      LOG_W("setPhase: phase tidak valid atau melebihi interval grup");
+    }
+  }
 
-      if (remoteConnected)
+  // Command: Named group (setGroupState, toggleGroup, ...)
+  else if (isGroupAction(action))
+  {
+    const char *error = namedGroupAction(action, doc.as<JsonVariantConst>(), source);
+    if (error)
+      LOG_W("%s: %s", action.c_str(), error);
+  }
+
+  // Command: Timed output (pulse, delayedOn, delayedOff, burst, cancelTimer)
+  else if (isTimedAction(action))
+  {
+    const char *error = timedOutputAction(action, doc.as<JsonVariantConst>(), source);
+    if (error)
+      LOG_W("%s: %s", action.c_str(), error);
+  }
+
+  // Command: Restart
+  else if (action == "restart")
+  {
+    LOG_W("Restart command received");
+    scheduleRestart();
+  }
+}
+
+// ==================== THINGSBOARD ATTRIBUTES ====================
+// Shared attributes chN_intervalOn / chN_intervalOff (seconds),
+// chN_autoMode, chN_name, chN_maxToggles and chN_phase (ms) configure
+// channel N for a whole fleet. The full set is requested on every connect,
+// updates arrive as deltas. Only values that differ are applied, so a re-sent attribute does
+// not reset a phase or a toggle counter.
+#define ATTR_REQUEST_PREFIX "v1/devices/me/attributes/request/"
+#define ATTR_RESPONSE_PREFIX "v1/devices/me/attributes/response/"
+#define ATTR_CHANNELS_PER_REQUEST 16 // Keeps each response below MQTT_BUFFER_SIZE
+
+const char *const CHANNEL_ATTR_FIELDS[] = {"intervalOn", "intervalOff", "autoMode", "name", "maxToggles", "phase"};
+#define CHANNEL_ATTR_FIELD_COUNT (sizeof(CHANNEL_ATTR_FIELDS) / sizeof(CHANNEL_ATTR_FIELDS[0]))
+
+// Asks ThingsBoard for every channel attribute, ATTR_CHANNELS_PER_REQUEST
+// channels per request id (1, 2, ...), each answered on its own
+// ATTR_RESPONSE_PREFIX topic. Streamed, a key list is about 1.4 KB.
+void attributesRequest()
+{
+  int requests = 0;
+  for (int first = 0; first < outputCount; first += ATTR_CHANNELS_PER_REQUEST)
+  {
+    int last = min(first + ATTR_CHANNELS_PER_REQUEST, outputCount);
+    String keys;
+    keys.reserve((last - first) * CHANNEL_ATTR_FIELD_COUNT * 18);
+    for (int i = first; i < last; i++)
+    {
+      for (size_t f = 0; f < CHANNEL_ATTR_FIELD_COUNT; f++)
       {
-        if (config.commMode == MODE_MQTT)
-          mqttPublish();
-        else
-          wsPublish();
+        if (keys.length())
+          keys += ',';
+        keys += "ch" + String(i + 1) + "_" + CHANNEL_ATTR_FIELDS[f];
       }
     }
+
+    String topic = ATTR_REQUEST_PREFIX + String(++requests);
+    String payload = "{\"sharedKeys\":\"" + keys + "\"}";
+    if (!mqttClient.beginPublish(topic.c_str(), payload.length(), false) ||
+        mqttClient.write((const uint8_t *)payload.c_str(), payload.length()) != payload.length() ||
+        !mqttClient.endPublish())
+    {
+      LOG_W("Attributes: request %d gagal", requests);
+      return;
+    }
+  }
+  LOG_I("Attributes: requested %u keys in %d request(s)", outputCount * (unsigned)CHANNEL_ATTR_FIELD_COUNT, requests);
+}
+
+// Applies one "chN_field" value. Returns false for unknown keys or when the
+// value equals the current one, marks the channel in scheduleChanged for
+// interval/auto mode.
+bool applyChannelAttribute(const char *key, JsonVariantConst value, OutputBits &scheduleChanged)
+{
+  if (strncmp(key, "ch", 2) != 0)
+    return false;
+
+  char *end;
+  long channel = strtol(key + 2, &end, 10);
+  if (end == key + 2 || *end != '_' || channel < 1 || channel > outputCount)
+    return false;
+
+  OutputChannel &out = outputs[channel - 1];
+  const char *field = end + 1;
+
+  if (strcmp(field, "intervalOn") == 0 || strcmp(field, "intervalOff") == 0)
+  {
+    if (!value.is<unsigned long>() || value.as<unsigned long>() == 0)
+      return false;
+    unsigned long ms = value.as<unsigned long>() * 1000;
+    unsigned long &target = strcmp(field, "intervalOn") == 0 ? out.intervalOn : out.intervalOff;
+    if (target == ms)
+      return false;
+    target = ms;
+    scheduleChanged.set(channel - 1, true);
+  }
+  else if (strcmp(field, "autoMode") == 0)
+  {
+    bool autoMode = value.as<bool>();
+    if (out.autoMode == autoMode)
+      return false;
+    out.autoMode = autoMode;
+    out.lastToggle = millis();
+    scheduleChanged.set(channel - 1, true);
+  }
+  else if (strcmp(field, "name") == 0)
+  {
+    String name = value.as<String>().substring(0, CHANNEL_NAME_LEN - 1);
+    if (name.length() == 0 || out.name == name)
+      return false;
+    out.name = name;
+    lcdNeedsRedraw = true;
+  }
+  else if (strcmp(field, "maxToggles") == 0)
+  {
+    if (!value.is<int>() || out.maxToggles == value.as<int>())
+      return false;
+    out.maxToggles = value.as<int>();
+    out.currentToggles = 0; // Same as setToggleLimit
+    journalMark(channel - 1);
+  }
+  else if (strcmp(field, "phase") == 0)
+  {
+    if (!value.is<unsigned long>() || out.phaseMs == value.as<unsigned long>())
+      return false;
+    if (!channelPhaseFits(channel - 1, value.as<unsigned long>()))
+    {
+      LOG_W("Attributes: CH%02ld phase melebihi interval grup", channel);
+      return false;
+    }
+    out.phaseMs = value.as<unsigned long>();
+  }
+  else
+  {
+    return false;
+  }
+
+  LOG_D("Attributes: CH%02ld %s updated", channel, field);
+  return true;
+}
+
+// Shared attribute update (delta) or the response to attributesRequest()
+void handleAttributes(char *payload, unsigned int length, bool isResponse)
+{
+  StaticJsonDocument<3072> doc;
+  DeserializationError err = deserializeJson(doc, payload, length);
+  if (err)
+  {
+    LOG_W("Attributes: JSON error %s (%u bytes)", err.c_str(), length);
+    return;
   }
 
-  // Command: Get Status
-  else if (action == "getStatus")
+  JsonObjectConst attrs = isResponse ? doc["shared"].as<JsonObjectConst>() : doc.as<JsonObjectConst>();
+  if (attrs.isNull())
+    return;
+
+  int changed = 0;
+  OutputBits scheduleChanged = {};
+  for (JsonPairConst kv : attrs)
   {
-    if (remoteConnected)
-    {
-      if (config.commMode == MODE_MQTT)
-        mqttPublish();
-      else
-        wsPublish();
-    }
+    if (applyChannelAttribute(kv.key().c_str(), kv.value(), scheduleChanged))
+      changed++;
   }
 
-  // Command: Set Interval
-  else if (action == "setInterval")
+  attrUpdates++;
+  attrChanges += changed;
+  LOG_I("Attributes: %d channel setting(s) changed%s", changed, isResponse ? " (full set)" : "");
+
+  if (changed == 0)
+    return;
+
+  markChannelConfigDirty();
+  // After all fields, so intervalOn + intervalOff move the channel once
+  for (int i = scheduleChanged.next(0); i >= 0; i = scheduleChanged.next(i + 1))
+    syncGroupUpdate(i);
+}
+
+// ==================== MQTT FUNCTIONS ====================
+// ThingsBoard retries an unanswered RPC with the same request id. The last
+// RPC_CACHE_SIZE replies are kept (least recently used evicted) so a retry
+// is answered without running the method again. The server restarts its id
+// sequence with the session, so an entry only matches the same id with the
+// same payload, and the cache is emptied on every MQTT connect.
+#define RPC_CACHE_SIZE 8
+
+RpcCacheEntry rpcCache[RPC_CACHE_SIZE];
+uint32_t rpcCacheTick = 0;
+
+const String *rpcCacheLookup(uint32_t requestId, uint32_t requestHash)
+{
+  for (int i = 0; i < RPC_CACHE_SIZE; i++)
   {
-    int id = doc["id"];
-    if (id >= 0 && id < TOTAL_OUTPUTS)
+    if (rpcCache[i].lastUse && rpcCache[i].requestId == requestId && rpcCache[i].requestHash == requestHash)
     {
-      outputs[id].intervalOn = doc["intervalOn"].as<unsigned long>() * 1000;
-      outputs[id].intervalOff = doc["intervalOff"].as<unsigned long>() * 1000;
+      rpcCache[i].lastUse = ++rpcCacheTick;
+      return &rpcCache[i].response;
     }
   }
+  return nullptr;
+}
 
-  // Command: Set Auto Mode
-  else if (action == "setAutoMode")
+void rpcCacheStore(uint32_t requestId, uint32_t requestHash, const String &response)
+{
+  // A reused id replaces its old entry, otherwise the LRU one goes
+  int victim = 0;
+  for (int i = 0; i < RPC_CACHE_SIZE; i++)
   {
-    int id = doc["id"];
-    if (id >= 0 && id < TOTAL_OUTPUTS)
+    if (rpcCache[i].lastUse && rpcCache[i].requestId == requestId)
     {
-      outputs[id].autoMode = doc["autoMode"];
-      outputs[id].lastToggle = millis();
+      victim = i;
+      break;
     }
+    if (rpcCache[i].lastUse < rpcCache[victim].lastUse)
+      victim = i;
   }
+  rpcCache[victim].requestId = requestId;
+  rpcCache[victim].requestHash = requestHash;
+  rpcCache[victim].lastUse = ++rpcCacheTick;
+  rpcCache[victim].response = response;
+}
 
-  // Command: Restart
-  else if (action == "restart")
+void rpcCacheClear()
+{
+  for (int i = 0; i < RPC_CACHE_SIZE; i++)
   {
-    Serial.println("Restart command received");
-    delay(1000);
-    ESP.restart();
+    rpcCache[i].lastUse = 0;
+    rpcCache[i].response = String();
   }
 }
 
-// ==================== MQTT FUNCTIONS ====================
 void mqttCallback(char *topic, byte *payload, unsigned int length)
 {
+  // Attribute payloads can be several KB, parse them in place
+  bool isAttrResponse = strncmp(topic, ATTR_RESPONSE_PREFIX, strlen(ATTR_RESPONSE_PREFIX)) == 0;
+  if (isAttrResponse || strcmp(topic, "v1/devices/me/attributes") == 0)
+  {
+    LOG_I("MQTT rx [%s] %u bytes", topic, length);
+    handleAttributes((char *)payload, length, isAttrResponse);
+    return;
+  }
+
   String message;
   for (unsigned int i = 0; i < length; i++)
   {
@@ -751,32 +4172,52 @@ void mqttCallback(char *topic, byte *payload, unsigned int length)
   }
 
   String topicStr = String(topic);
-  Serial.println();
-  Serial.printf(" MQTT Message Received\n");
-  Serial.printf("   Topic: %s\n", topic);
-  Serial.printf("   Data : %s\n", message.c_str());
+  LOG_I("MQTT rx [%s] %u bytes", topic, length);
+  LOG_D("  Data: %s", message.c_str());
 
   // ========== THINGSBOARD RPC ==========
   if (topicStr.startsWith("v1/devices/me/rpc/request/"))
   {
-    Serial.println("🔧 Type: ThingsBoard RPC");
+    LOG_D("🔧 Type: ThingsBoard RPC");
     
     // Extract request ID
     int lastSlash = topicStr.lastIndexOf('/');
     String requestId = topicStr.substring(lastSlash + 1);
-    Serial.println("   Request ID: " + requestId);
+    LOG_D("   Request ID: %s", requestId.c_str());
+    String responseTopic = "v1/devices/me/rpc/response/" + requestId;
+
+    // Retried request: answer from cache, do not execute twice
+    uint32_t rpcId = strtoul(requestId.c_str(), nullptr, 10);
+    uint32_t rpcHash = crc32Calc(payload, length);
+    const String *cached = rpcCacheLookup(rpcId, rpcHash);
+    if (cached)
+    {
+      rpcDuplicates++;
+      LOG_I("   Duplicate RPC %s, replying from cache", requestId.c_str());
+      mqttClient.publish(responseTopic.c_str(), cached->c_str());
+      return;
+    }
+
+    // Not cached, so a retry after the bucket refilled still executes
+    if (!admitCommand(SRC_MQTT))
+    {
+      mqttClient.publish(responseTopic.c_str(), "{\"error\":\"Rate limited\"}");
+      return;
+    }
+    rpcExecuted++;
 
     StaticJsonDocument<512> doc;
     if (deserializeJson(doc, message) != DeserializationError::Ok)
     {
-      Serial.println(" JSON Parse Error");
+      LOG_W("JSON Parse Error");
       return;
     }
 
     String method = doc["method"].as<String>();
-    Serial.println("   Method: " + method);
+    LOG_D("   Method: %s", method.c_str());
 
-    StaticJsonDocument<256> response;
+    // getValues lists every channel
+    DynamicJsonDocument response(256 + STATE_JSON_SIZE(outputCount));
     bool success = false;
 
     if (method == "setValue")
@@ -785,11 +4226,11 @@ void mqttCallback(char *topic, byte *payload, unsigned int length)
       int channel = params["channel"] | 0;
       bool state = params["state"] | false;
 
-      Serial.printf("   Action: Set CH%d to %s\n", channel, state ? "ON" : "OFF");
+      LOG_I("   Action: Set CH%d to %s", channel, state ? "ON" : "OFF");
 
-      if (channel >= 1 && channel <= TOTAL_OUTPUTS)
+      if (channel >= 1 && channel <= outputCount)
       {
-        setOutput(channel, state);
+        queueOutput(channel, state, SRC_MQTT);
         response["result"] = "OK";
         response["channel"] = channel;
         response["state"] = state;
@@ -797,16 +4238,16 @@ void mqttCallback(char *topic, byte *payload, unsigned int length)
       }
       else
       {
-        response["error"] = "Invalid channel (1-20)";
+        response["error"] = "Invalid channel";
       }
     }
     // ===== COMMAND: getValues =====
     else if (method == "getValues")
     {
-      Serial.println("   Action: Get all channel status");
+      LOG_I("   Action: Get all channel status");
       
       JsonObject outputs_obj = response.createNestedObject("outputs");
-      for (int i = 0; i < TOTAL_OUTPUTS; i++)
+      for (int i = 0; i < outputCount; i++)
       {
         String key = "CH" + String(i + 1);
         outputs_obj[key] = outputs[i].state ? 1 : 0;
@@ -822,18 +4263,19 @@ void mqttCallback(char *topic, byte *payload, unsigned int length)
       int intervalOn = params["intervalOn"] | 5;
       int intervalOff = params["intervalOff"] | 5;
 
-      Serial.printf("   Action: Set CH%d AutoMode=%s (ON:%ds OFF:%ds)\n", 
-                    channel, autoMode ? "true" : "false", intervalOn, intervalOff);
+      LOG_I("  Action: Set CH%d AutoMode=%s (ON:%ds OFF:%ds)",
+            channel, autoMode ? "true" : "false", intervalOn, intervalOff);
 
-      if (channel >= 1 && channel <= TOTAL_OUTPUTS)
+      if (channel >= 1 && channel <= outputCount)
       {
         int idx = channel - 1;
         outputs[idx].autoMode = autoMode;
         outputs[idx].intervalOn = intervalOn * 1000;
         outputs[idx].intervalOff = intervalOff * 1000;
         outputs[idx].lastToggle = millis();
+        markChannelConfigDirty();
 
-        rebuildSyncGroups();
+        syncGroupUpdate(idx);
 
         response["result"] = "OK";
         response["channel"] = channel;
@@ -842,150 +4284,636 @@ void mqttCallback(char *topic, byte *payload, unsigned int length)
       }
       else
       {
-        response["error"] = "Invalid channel (1-20)";
+        response["error"] = "Invalid channel";
+      }
+    }
+    else if (isGroupAction(method))
+    {
+      const char *error = namedGroupAction(method, doc["params"].as<JsonVariantConst>(), SRC_MQTT);
+      if (error)
+      {
+        response["error"] = error;
+      }
+      else
+      {
+        response["result"] = "OK";
+        response["group"] = doc["params"]["group"];
+        success = true;
+      }
+    }
+    else if (isTimedAction(method))
+    {
+      const char *error = timedOutputAction(method, doc["params"].as<JsonVariantConst>(), SRC_MQTT);
+      if (error)
+      {
+        response["error"] = error;
+      }
+      else
+      {
+        response["result"] = "OK";
+        response["channel"] = doc["params"]["channel"];
+        success = true;
       }
     }
     else if (method == "restart")
     {
-      Serial.println("   Action: Restarting ESP32...");
+      LOG_I("   Action: Restarting ESP32...");
       
       response["result"] = "Restarting...";
       success = true;
 
-      // Send response first
-      String responseTopic = "v1/devices/me/rpc/response/" + requestId;
-      String responseJson;
-      serializeJson(response, responseJson);
-      mqttClient.publish(responseTopic.c_str(), responseJson.c_str());
-
-      delay(1000);
-      ESP.restart();
-      return;
+      scheduleRestart();
     }
     else
     {
-      Serial.println("   Unknown method!");
+      LOG_W("   Unknown method!");
       response["error"] = "Unknown method: " + method;
     }
 
     // Send RPC response
-    String responseTopic = "v1/devices/me/rpc/response/" + requestId;
     String responseJson;
     serializeJson(response, responseJson);
     
     mqttClient.publish(responseTopic.c_str(), responseJson.c_str());
+    rpcCacheStore(rpcId, rpcHash, responseJson);
 
-    Serial.println(" Response sent:");
-    Serial.println("   " + responseJson);
+    LOG_D("  Response sent: %s", responseJson.c_str());
 
-    // Publish updated telemetry if success
+    // Publish updated telemetry if success, a burst ends in one publish
     if (success)
     {
-      delay(100);
-      mqttPublish();
+      deferAction(100, actionPublishState, 0);
     }
   }
   else
   {
-    Serial.println(" Type: Standard MQTT Command");
-    processCommand(message, "MQTT");
+    LOG_D("Type: Standard MQTT Command");
+    processCommand(message, SRC_MQTT);
+  }
+}
+
+bool mqttPublish()
+{
+  if (!mqttConnected)
+    return false;
+
+  bool isThingsBoard = (config.mqtt.token.length() > 0);
+
+  const String &json = stateSnapshot(isThingsBoard ? SNAPSHOT_THINGSBOARD : SNAPSHOT_REMOTE);
+  String topic = isThingsBoard ? "v1/devices/me/telemetry" : config.mqtt.path;
+
+  // Publish
+  bool published = mqttClient.publish(topic.c_str(), json.c_str());
+
+  if (published)
+  {
+    LOG_D("MQTT published [%s] %s", topic.c_str(), json.c_str());
+  }
+  else
+  {
+    LOG_W("Publish failed!");
+  }
+  return published;
+}
+
+// ==================== MQTT CONNECT STATE MACHINE ====================
+// PubSubClient::connect() would block loop() for the whole TCP timeout on an
+// unreachable broker and again while it waits for CONNACK. Every step runs
+// here instead, on one non-blocking socket polled once per loop(): DNS
+// (lwIP's async dns_gethostbyname(), answer cached), TCP connect, sending
+// CONNECT, reading CONNACK. Only an accepted session is handed to
+// PubSubClient. Its connect() then returns at once (MqttSocketClient drops
+// its CONNECT and replays our CONNACK). The socket stays non-blocking
+// afterwards, so a publish on a congested link cannot stall loop() either.
+#define MQTT_BACKOFF_BASE_MS 1000
+#define MQTT_BACKOFF_MAX_MS 60000
+#define MQTT_TCP_CONNECT_TIMEOUT_MS 3000
+#define MQTT_DNS_TIMEOUT_MS 5000
+#define MQTT_DNS_CACHE_MS 600000
+#define MQTT_CONNACK_TIMEOUT_MS 5000 // CONNECT sent + CONNACK read
+#define MQTT_READ_TIMEOUT_S 1        // PubSubClient, per byte of a packet already arriving
+#define MQTT_KEEPALIVE_S 15
+#define MQTT_CONNECT_MAX 256
+#define MQTT_BUFFER_SIZE 4096
+
+uint8_t mqttConnectPacket[MQTT_CONNECT_MAX];
+size_t mqttConnectLen = 0;
+size_t mqttConnectSent = 0;
+uint8_t mqttConnack[4];
+size_t mqttConnackLen = 0;
+String mqttClientId;
+
+MqttSocketClient::MqttSocketClient(int fd, const uint8_t *connack)
+    : WiFiClient(fd), replayLeft(sizeof(replay)), dropConnect(true)
+{
+  memcpy(replay, connack, sizeof(replay));
+}
+
+size_t MqttSocketClient::write(uint8_t data)
+{
+  return write(&data, 1);
+}
+
+// Never waits: PubSubClient cannot resume half a packet, so whatever the
+// socket does not take right away ends the connection and mqttService()
+// reconnects
+size_t MqttSocketClient::write(const uint8_t *buf, size_t size)
+{
+  if (dropConnect)
+  {
+    dropConnect = false;
+    return size;
+  }
+
+  int sent = send(fd(), buf, size, MSG_DONTWAIT);
+  if (sent == (int)size)
+    return size;
+
+  LOG_W("MQTT: send buffer penuh (%d/%u byte), koneksi diputus", sent, (unsigned)size);
+  stop();
+  return sent > 0 ? sent : 0;
+}
+
+int MqttSocketClient::available()
+{
+  return replayLeft ? replayLeft : WiFiClient::available();
+}
+
+int MqttSocketClient::read()
+{
+  if (replayLeft)
+    return replay[sizeof(replay) - replayLeft--];
+  return WiFiClient::read();
+}
+
+int MqttSocketClient::peek()
+{
+  return replayLeft ? replay[sizeof(replay) - replayLeft] : WiFiClient::peek();
+}
+
+void mqttHandshake();
+void mqttPollConnectSend();
+void mqttConnectFailed(int code);
+const char *mqttStateName(int code);
+
+size_t mqttPutString(uint8_t *buf, size_t n, const String &text)
+{
+  buf[n++] = text.length() >> 8;
+  buf[n++] = text.length() & 0xFF;
+  memcpy(buf + n, text.c_str(), text.length());
+  return n + text.length();
+}
+
+// MQTT 3.1.1 CONNECT with the fields PubSubClient::connect() would send:
+// clean session, MQTT_KEEPALIVE_S, the token (ThingsBoard) as user name.
+// 0 = does not fit into cap.
+size_t mqttBuildConnect(uint8_t *buf, size_t cap, const String &clientId, const String &user)
+{
+  static const uint8_t protocol[] = {0, 4, 'M', 'Q', 'T', 'T', 4};
+  size_t body = sizeof(protocol) + 3 + 2 + clientId.length() + (user.length() ? 2 + user.length() : 0);
+  if (body > 127 * 128 || body + 3 > cap)
+    return 0;
+
+  size_t n = 0;
+  buf[n++] = 0x10;
+  if (body > 127)
+  {
+    buf[n++] = (body & 0x7F) | 0x80;
+    buf[n++] = body >> 7;
+  }
+  else
+  {
+    buf[n++] = body;
+  }
+
+  memcpy(buf + n, protocol, sizeof(protocol));
+  n += sizeof(protocol);
+  buf[n++] = 0x02 | (user.length() ? 0x80 : 0);
+  buf[n++] = MQTT_KEEPALIVE_S >> 8;
+  buf[n++] = MQTT_KEEPALIVE_S & 0xFF;
+  n = mqttPutString(buf, n, clientId);
+  if (user.length())
+    n = mqttPutString(buf, n, user);
+  return n;
+}
+
+void mqttCloseSocket()
+{
+  if (mqttSockFd >= 0)
+  {
+    close(mqttSockFd);
+    mqttSockFd = -1;
+  }
+}
+
+void mqttScheduleRetry()
+{
+  mqttCloseSocket();
+
+  mqttBackoffMs = mqttBackoffMs == 0 ? MQTT_BACKOFF_BASE_MS : min(mqttBackoffMs * 2, (unsigned long)MQTT_BACKOFF_MAX_MS);
+
+  // +/-25% jitter so a fleet does not reconnect in lockstep after a broker restart
+  long jitter = random(-(long)mqttBackoffMs / 4, (long)mqttBackoffMs / 4 + 1);
+  mqttNextAttempt = millis() + mqttBackoffMs + jitter;
+  mqttConnState = MQTT_CONN_BACKOFF;
+
+  LOG_I("MQTT: retry dalam %ld ms", (long)mqttBackoffMs + jitter);
+}
+
+void mqttConnReset()
+{
+  mqttCloseSocket();
+  mqttConnState = MQTT_CONN_IDLE;
+  mqttBackoffMs = 0;
+  mqttNextAttempt = 0;
+
+  if (mqttDisconnectedSince == 0)
+    mqttDisconnectedSince = max(millis(), 1UL);
+}
+
+void mqttConnectionLost()
+{
+  LOG_W("MQTT connection lost (state %d)", mqttClient.state());
+
+  mqttConnState = MQTT_CONN_IDLE;
+  mqttBackoffMs = 0;
+  mqttDisconnectedSince = max(millis(), 1UL);
+  mqttConnected = false;
+  remoteConnected = mqttConnected || wsConnected;
+
+  updateLCD();
+  lastLcdPageSwap = millis();
+  lcdNeedsRedraw = true;
+}
+
+unsigned long mqttDisconnectedMs()
+{
+  unsigned long total = mqttDisconnectedTotalMs;
+  if (mqttDisconnectedSince != 0)
+    total += millis() - mqttDisconnectedSince;
+  return total;
+}
+
+// lwIP task context: only hand the answer over, loop() picks it up. A reply
+// for an older lookup (gen mismatch) is dropped.
+void mqttDnsFound(const char *name, const ip_addr_t *ipaddr, void *arg)
+{
+  (void)name;
+  if ((uint32_t)(uintptr_t)arg != mqttDnsGen.load())
+    return;
+
+  if (ipaddr != NULL && IP_IS_V4(ipaddr))
+  {
+    mqttDnsAddr.store(ip4_addr_get_u32(ip_2_ip4(ipaddr)));
+    mqttDnsResult.store(MQTT_DNS_OK);
+  }
+  else
+  {
+    mqttDnsResult.store(MQTT_DNS_FAIL);
+  }
+}
+
+void mqttOpenSocket()
+{
+  mqttSockFd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+  if (mqttSockFd < 0)
+  {
+    mqttScheduleRetry();
+    return;
+  }
+  fcntl(mqttSockFd, F_SETFL, fcntl(mqttSockFd, F_GETFL, 0) | O_NONBLOCK);
+
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(config.mqtt.port);
+  addr.sin_addr.s_addr = (uint32_t)mqttServerAddr;
+
+  // The cached address survives a failed connect; a broker that is down is
+  // not a reason to hit DNS again on every backoff step
+  int res = connect(mqttSockFd, (struct sockaddr *)&addr, sizeof(addr));
+  if (res < 0 && errno != EINPROGRESS)
+  {
+    LOG_W("MQTT: connect() error %d", errno);
+    mqttScheduleRetry();
+    return;
   }
+
+  mqttConnStarted = millis();
+  mqttConnState = MQTT_CONN_TCP;
+}
+
+void mqttResolved(uint32_t addr)
+{
+  mqttServerAddr = IPAddress(addr);
+  mqttResolvedHost = config.mqtt.host;
+  mqttResolvedAt = max(millis(), 1UL);
+  LOG_D("MQTT: %s -> %s", mqttResolvedHost.c_str(), mqttServerAddr.toString().c_str());
+  mqttOpenSocket();
 }
 
-void mqttPublish()
+void mqttStartTcpConnect()
 {
-  if (!remoteConnected)
+  mqttReconnectAttempts++;
+  LOG_I("Connecting MQTT (attempt %lu)...", mqttReconnectAttempts);
+
+  // An IP literal never hits DNS, a hostname is reused until the cache ages out
+  IPAddress literal;
+  if (literal.fromString(config.mqtt.host.c_str()))
+  {
+    mqttServerAddr = literal;
+    mqttOpenSocket();
+    return;
+  }
+  if (mqttResolvedAt != 0 && mqttResolvedHost == config.mqtt.host &&
+      millis() - mqttResolvedAt < MQTT_DNS_CACHE_MS)
+  {
+    mqttOpenSocket();
     return;
+  }
 
-  String topic;
-  String json;
+  mqttDnsGen++;
+  mqttDnsResult.store(MQTT_DNS_PENDING);
+
+  ip_addr_t found;
+  err_t err = dns_gethostbyname(config.mqtt.host.c_str(), &found, mqttDnsFound,
+                                (void *)(uintptr_t)mqttDnsGen.load());
+  if (err == ERR_OK && IP_IS_V4(&found))
+  {
+    mqttDnsResult.store(MQTT_DNS_NONE);
+    mqttResolved(ip4_addr_get_u32(ip_2_ip4(&found)));
+    return;
+  }
+  if (err != ERR_INPROGRESS)
+  {
+    LOG_W("MQTT: DNS lookup failed (%d)", (int)err);
+    mqttDnsResult.store(MQTT_DNS_NONE);
+    mqttScheduleRetry();
+    return;
+  }
 
-  bool isThingsBoard = (config.serverToken.length() > 0);
+  mqttConnStarted = millis();
+  mqttConnState = MQTT_CONN_DNS;
+}
 
-  if (isThingsBoard)
+void mqttPollDns()
+{
+  uint8_t result = mqttDnsResult.load();
+
+  if (result == MQTT_DNS_OK)
+  {
+    mqttDnsResult.store(MQTT_DNS_NONE);
+    mqttResolved(mqttDnsAddr.load());
+    return;
+  }
+
+  if (result == MQTT_DNS_FAIL || millis() - mqttConnStarted >= MQTT_DNS_TIMEOUT_MS)
+  {
+    LOG_W("MQTT: DNS lookup %s", result == MQTT_DNS_FAIL ? "failed" : "timeout");
+    mqttDnsGen++; // a late answer belongs to this lookup, ignore it
+    mqttDnsResult.store(MQTT_DNS_NONE);
+
+    // Better a stale address than none while the resolver is unreachable
+    if (mqttResolvedAt != 0 && mqttResolvedHost == config.mqtt.host)
+    {
+      mqttResolvedAt = max(millis(), 1UL);
+      mqttOpenSocket();
+      return;
+    }
+    mqttScheduleRetry();
+  }
+}
+
+void mqttPollTcpConnect()
+{
+  fd_set writeSet;
+  FD_ZERO(&writeSet);
+  FD_SET(mqttSockFd, &writeSet);
+  struct timeval tv = {0, 0};
+
+  if (select(mqttSockFd + 1, NULL, &writeSet, NULL, &tv) <= 0)
   {
-    StaticJsonDocument<1024> doc;
-  
-    for (int i = 0; i < TOTAL_OUTPUTS; i++)
+    if (millis() - mqttConnStarted >= MQTT_TCP_CONNECT_TIMEOUT_MS)
     {
-      String key = "Q" + String(i + 1);
-      doc[key] = outputs[i].state ? 1 : 0;
+      LOG_W("MQTT: TCP connect timeout");
+      mqttScheduleRetry();
     }
+    return;
+  }
+
+  int sockErr = 0;
+  socklen_t len = sizeof(sockErr);
+  getsockopt(mqttSockFd, SOL_SOCKET, SO_ERROR, &sockErr, &len);
+  if (sockErr != 0)
+  {
+    LOG_W("MQTT: TCP connect failed (%d)", sockErr);
+    mqttScheduleRetry();
+    return;
+  }
+
+  int one = 1;
+  setsockopt(mqttSockFd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+  mqttClientId = "ESP32-" + String(random(0xffff), HEX);
+  mqttConnectLen = mqttBuildConnect(mqttConnectPacket, sizeof(mqttConnectPacket), mqttClientId, config.mqtt.token);
+  if (mqttConnectLen == 0)
+  {
+    LOG_E("MQTT: token terlalu panjang untuk CONNECT");
+    mqttScheduleRetry();
+    return;
+  }
+
+  mqttConnectSent = 0;
+  mqttConnackLen = 0;
+  mqttConnStarted = millis();
+  mqttConnState = MQTT_CONN_CONNECT;
+  mqttPollConnectSend();
+}
+
+// true = no answer yet, keep waiting; false = retry already scheduled
+bool mqttSocketWaiting(int res, const char *what)
+{
+  if (res < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+  {
+    if (millis() - mqttConnStarted < MQTT_CONNACK_TIMEOUT_MS)
+      return true;
+    LOG_W("MQTT: %s timeout", what);
+  }
+  else
+  {
+    LOG_W("MQTT: %s gagal (%d)", what, res < 0 ? errno : 0);
+  }
+  mqttScheduleRetry();
+  return false;
+}
+
+void mqttPollConnectSend()
+{
+  int res = send(mqttSockFd, mqttConnectPacket + mqttConnectSent, mqttConnectLen - mqttConnectSent, MSG_DONTWAIT);
+  if (res <= 0)
+  {
+    mqttSocketWaiting(res, "CONNECT");
+    return;
+  }
+
+  mqttConnectSent += res;
+  if (mqttConnectSent == mqttConnectLen)
+    mqttConnState = MQTT_CONN_CONNACK;
+}
+
+void mqttPollConnack()
+{
+  int res = recv(mqttSockFd, mqttConnack + mqttConnackLen, sizeof(mqttConnack) - mqttConnackLen, MSG_DONTWAIT);
+  if (res <= 0)
+  {
+    mqttSocketWaiting(res, "CONNACK");
+    return;
+  }
+
+  mqttConnackLen += res;
+  if (mqttConnackLen < sizeof(mqttConnack))
+    return;
+
+  if (mqttConnack[0] != 0x20 || mqttConnack[1] != 2)
+  {
+    LOG_W("MQTT: balasan CONNECT bukan CONNACK (0x%02X)", mqttConnack[0]);
+    mqttScheduleRetry();
+    return;
+  }
+  if (mqttConnack[3] != 0)
+  {
+    mqttConnectFailed(mqttConnack[3]);
+    return;
+  }
+
+  // The session is up: PubSubClient takes over the fd
+  espClient = MqttSocketClient(mqttSockFd, mqttConnack);
+  mqttSockFd = -1;
+  mqttHandshake();
+}
+
+// Non-blocking step, called every loop() while MQTT is down
+void mqttReconnect()
+{
+  switch (mqttConnState)
+  {
+  case MQTT_CONN_IDLE:
+    mqttStartTcpConnect();
+    break;
+
+  case MQTT_CONN_BACKOFF:
+    if ((long)(millis() - mqttNextAttempt) >= 0)
+      mqttStartTcpConnect();
+    break;
+
+  case MQTT_CONN_DNS:
+    mqttPollDns();
+    break;
 
-    serializeJson(doc, json);
-    topic = "v1/devices/me/telemetry";
-  }
-  else
-  {
-    json = getRemoteStatusJSON();
-    topic = config.serverPath;
-  }
+  case MQTT_CONN_TCP:
+    mqttPollTcpConnect();
+    break;
 
-  // Publish
-  bool published = mqttClient.publish(topic.c_str(), json.c_str());
+  case MQTT_CONN_CONNECT:
+    mqttPollConnectSend();
+    break;
 
-  if (published)
-  {
-    Serial.println(" Published:");
-    Serial.println("   Topic: " + topic);
-    Serial.println("   Data : " + json);
+  case MQTT_CONN_CONNACK:
+    mqttPollConnack();
+    break;
+
+  case MQTT_CONN_UP:
+    break;
   }
-  else
+}
+
+const char *mqttStateName(int code)
+{
+  switch (code)
   {
-    Serial.println(" Publish failed!");
+  case -4: return "Connection timeout";
+  case -3: return "Connection lost";
+  case -2: return "Connect failed";
+  case -1: return "Disconnected";
+  case 1: return "Bad protocol version";
+  case 2: return "ID rejected";
+  case 3: return "Server unavailable";
+  case 4: return "Bad credentials";
+  case 5: return "Unauthorized";
+  default: return "Unknown";
   }
 }
 
-void mqttReconnect()
+// Broker refused the session (CONNACK code) or the handover failed
+void mqttConnectFailed(int code)
 {
-  unsigned long now = millis();
-  if (now - lastRemoteReconnect < 5000)
-    return;
-
-  lastRemoteReconnect = now;
+  LOG_W("MQTT CONNECTION FAILED, code %d (%s)", code, mqttStateName(code));
 
-  Serial.print("Connecting MQTT...");
+  if (code == 4 || code == 5)
+  {
+    if (config.mqtt.token.length() > 0)
+      LOG_W("  Check Access Token is correct and the device exists in ThingsBoard");
+    else
+      LOG_W("  Check broker allows anonymous connection");
+  }
 
-  String clientId = "ESP32-" + String(random(0xffff), HEX);
+  mqttScheduleRetry();
+  mqttConnected = false;
+  remoteConnected = mqttConnected || wsConnected;
+  updateLCD();
+  lastLcdPageSwap = millis();
+  lcdNeedsRedraw = true;
+}
 
-  bool isThingsBoard = (config.serverToken.length() > 0);
+// After an accepted CONNACK: connect() only reads the replayed CONNACK
+void mqttHandshake()
+{
+  bool isThingsBoard = (config.mqtt.token.length() > 0);
   bool connected = false;
 
   if (isThingsBoard)
   {
     connected = mqttClient.connect(
-      clientId.c_str(),
-      config.serverToken.c_str(),
+      mqttClientId.c_str(),
+      config.mqtt.token.c_str(),
       NULL 
     );
   }
   else
   {
-    connected = mqttClient.connect(clientId.c_str());
+    connected = mqttClient.connect(mqttClientId.c_str());
   }
 
   if (connected)
   {
-    Serial.println(" MQTT CONNECTED!");
+    LOG_I("MQTT CONNECTED!");
+    mqttConnected = true;
     remoteConnected = true;
-    isRemoteReconnecting = false;
+
+    mqttConnState = MQTT_CONN_UP;
+    mqttBackoffMs = 0;
+    rpcCacheClear(); // New session, the server may reuse request ids
+    if (mqttDisconnectedSince != 0)
+    {
+      mqttDisconnectedTotalMs += millis() - mqttDisconnectedSince;
+      mqttDisconnectedSince = 0;
+    }
 
     if (isThingsBoard)
     {
       mqttClient.subscribe("v1/devices/me/rpc/request/+");
       mqttClient.subscribe("v1/devices/me/attributes");
+      mqttClient.subscribe(ATTR_RESPONSE_PREFIX "+");
       
-      Serial.println(" Subscribed to:");
-      Serial.println("   • v1/devices/me/rpc/request/+");
-      Serial.println("   • v1/devices/me/attributes");
+      LOG_I("Subscribed to v1/devices/me/rpc/request/+ and v1/devices/me/attributes");
+      attributesRequest();
     }
     else
     {
-      String controlTopic = config.serverPath + "/control";
+      String controlTopic = config.mqtt.path + "/control";
       mqttClient.subscribe(controlTopic.c_str());
       
-      Serial.println("Subscribed to:");
-      Serial.printf("   • %s\n", controlTopic.c_str());
+      LOG_I("Subscribed to %s", controlTopic.c_str());
     }
 
     mqttPublish();
@@ -997,43 +4925,7 @@ void mqttReconnect()
   }
   else
   {
-    Serial.println(" CONNECTION FAILED!");
-    Serial.printf("   Error Code: %d\n", mqttClient.state());
-    Serial.println();
-    Serial.println("    Error Reference:");
-    Serial.println("   -4 = Connection timeout");
-    Serial.println("   -3 = Connection lost");
-    Serial.println("   -2 = Connect failed");
-    Serial.println("   -1 = Disconnected");
-    Serial.println("    1 = Bad protocol version");
-    Serial.println("    2 = ID rejected");
-    Serial.println("    3 = Server unavailable");
-    Serial.println("    4 = Bad credentials");
-    Serial.println("    5 = Unauthorized");
-    Serial.println();
-    Serial.println("    Troubleshooting:");
-    
-    if (isThingsBoard)
-    {
-      Serial.println("   ✓ Check Access Token is correct");
-      Serial.println("   ✓ Check device exists in ThingsBoard");
-      Serial.println("   ✓ Server should be: mqtt.thingsboard.cloud");
-      Serial.println("   ✓ Port should be: 1883");
-    }
-    else
-    {
-      Serial.println("   ✓ Check MQTT broker is running");
-      Serial.println("   ✓ Check broker allows anonymous connection");
-      Serial.println("   ✓ Check server IP and port");
-      Serial.println("   ✓ Try: test.mosquitto.org:1883");
-    }
-    
-    Serial.println("========================================\n");
-
-    remoteConnected = false;
-    updateLCD();
-    lastLcdPageSwap = millis();
-    lcdNeedsRedraw = true;
+    mqttConnectFailed(mqttClient.state());
   }
 }
 
@@ -1043,15 +4935,9 @@ void wsEvent(WStype_t type, uint8_t *payload, size_t length)
   switch (type)
   {
   case WStype_DISCONNECTED:
-    Serial.println("WS Disconnected");
-    remoteConnected = false;
-
-    if (wifiConnected && !isRemoteReconnecting) 
-    {
-      Serial.printf("WS: Memulai 15 detik percobaan reconnect...\n");
-      isRemoteReconnecting = true;
-      remoteDisconnectTime = millis();
-    }
+    LOG_W("WS Disconnected");
+    wsConnected = false;
+    remoteConnected = mqttConnected || wsConnected;
 
     updateLCD(); 
     lastLcdPageSwap = millis();
@@ -1059,9 +4945,9 @@ void wsEvent(WStype_t type, uint8_t *payload, size_t length)
     break;
 
   case WStype_CONNECTED:
-    Serial.printf("WS Connected to: %s\n", payload);
+    LOG_I("WS Connected to: %s", payload);
+    wsConnected = true;
     remoteConnected = true;
-    isRemoteReconnecting = false;
 
     wsPublish();
 
@@ -1074,15 +4960,15 @@ void wsEvent(WStype_t type, uint8_t *payload, size_t length)
   case WStype_TEXT:
   {
     String message = String((char *)payload);
-    Serial.printf("WS Received: %s\n", message.c_str());
+    LOG_D("WS Received: %s", message.c_str());
 
     // Process command
-    processCommand(message, "WebSocket");
+    processCommand(message, SRC_WS);
     break;
   }
 
   case WStype_ERROR:
-    Serial.printf("WS Error: %s\n", payload);
+    LOG_E("WS Error: %s", payload);
     break;
 
   default:
@@ -1090,15 +4976,531 @@ void wsEvent(WStype_t type, uint8_t *payload, size_t length)
   }
 }
 
-void wsPublish()
+bool wsPublish()
+{
+  if (!wsConnected)
+    return false;
+
+  const String &json = stateSnapshot(SNAPSHOT_REMOTE);
+
+  bool sent = wsClient.sendTXT(json.c_str(), json.length());
+  LOG_D("WS Published");
+  return sent;
+}
+
+// ==================== OFFLINE TELEMETRY ====================
+// Toggles committed while MQTT is enabled but down are kept in a RAM ring
+// (oldest dropped when full) and uploaded after reconnect as batch telemetry
+// [{"ts":...,"values":{"Q1":1}},...], one size-capped publish per chunk.
+// ts needs the wall clock, so the upload waits until SNTP has synced.
+#define TELEMETRY_BUFFER_SIZE 512 // Events, power of two
+#define TELEMETRY_CHUNK_BYTES 2048
+#define TELEMETRY_CHUNK_INTERVAL_MS 100
+#define TELEMETRY_ENTRY_MAX 64 // Longest single {"ts":..,"values":{..}} entry
+
+TelemetryEvent telemetryRing[TELEMETRY_BUFFER_SIZE];
+char telemetryChunk[TELEMETRY_CHUNK_BYTES];
+
+void telemetryRecord(int channel, bool state)
+{
+  if (!config.mqtt.enabled || mqttConnected || journalRestoring)
+    return;
+
+  if (telemetryHead - telemetryTail >= TELEMETRY_BUFFER_SIZE)
+  {
+    telemetryTail++;
+    telemetryDropped++;
+  }
+
+  TelemetryEvent &e = telemetryRing[telemetryHead % TELEMETRY_BUFFER_SIZE];
+  e.uptimeMs = millis();
+  e.channel = channel;
+  e.state = state ? 1 : 0;
+  telemetryHead++;
+}
+
+// Wall clock in ms since epoch, false until SNTP has set the time
+bool wallClockMs(uint64_t &out)
+{
+  struct timeval tv;
+  gettimeofday(&tv, nullptr);
+  if (tv.tv_sec < 1600000000)
+    return false;
+  out = (uint64_t)tv.tv_sec * 1000ULL + tv.tv_usec / 1000;
+  return true;
+}
+
+// Publishes the next chunk of buffered events, called from mqttService()
+void telemetryFlushStep()
+{
+  if (telemetryHead == telemetryTail || !mqttConnected)
+    return;
+
+  unsigned long now = millis();
+  if (now - telemetryLastChunk < TELEMETRY_CHUNK_INTERVAL_MS)
+    return;
+
+  uint64_t epochMs;
+  if (!wallClockMs(epochMs))
+    return;
+  telemetryLastChunk = now;
+
+  bool isThingsBoard = (config.mqtt.token.length() > 0);
+  String topic = isThingsBoard ? "v1/devices/me/telemetry" : config.mqtt.path + "/history";
+
+  size_t len = 0;
+  uint32_t count = 0;
+  telemetryChunk[len++] = '[';
+
+  while (telemetryTail + count != telemetryHead && len + TELEMETRY_ENTRY_MAX < TELEMETRY_CHUNK_BYTES)
+  {
+    const TelemetryEvent &e = telemetryRing[(telemetryTail + count) % TELEMETRY_BUFFER_SIZE];
+    uint64_t ts = epochMs - (uint32_t)(now - e.uptimeMs);
+
+    len += snprintf(telemetryChunk + len, TELEMETRY_CHUNK_BYTES - len,
+                    isThingsBoard ? "%s{\"ts\":%llu,\"values\":{\"Q%u\":%u}}" : "%s{\"ts\":%llu,\"values\":{\"O%u\":\"%u\"}}",
+                    count ? "," : "", (unsigned long long)ts, e.channel, e.state);
+    count++;
+  }
+  telemetryChunk[len++] = ']';
+
+  if (!mqttClient.beginPublish(topic.c_str(), len, false) ||
+      mqttClient.write((const uint8_t *)telemetryChunk, len) != len ||
+      !mqttClient.endPublish())
+  {
+    LOG_W("Telemetry: upload %lu event gagal, dicoba lagi", (unsigned long)count);
+    return;
+  }
+
+  telemetryTail += count;
+  telemetryFlushed += count;
+  telemetryBatches++;
+  LOG_I("Telemetry: %lu event terkirim (%u bytes), sisa %lu",
+        (unsigned long)count, (unsigned)len, (unsigned long)(telemetryHead - telemetryTail));
+}
+
+// ==================== TRANSPORTS ====================
+// Registry of remote transports. Each enabled transport is serviced every
+// loop, publishes the full state every publishIntervalMs and, when
+// publishOnChange is set, right after a command changed outputs. Payloads
+// come from the shared stateSnapshot() cache.
+void mqttBegin()
+{
+  mqttConnReset();
+  mqttClient.setCallback(mqttCallback);
+  mqttClient.setBufferSize(MQTT_BUFFER_SIZE); // Full attribute response
+  mqttClient.setKeepAlive(MQTT_KEEPALIVE_S);  // Must match mqttBuildConnect()
+  mqttClient.setSocketTimeout(MQTT_READ_TIMEOUT_S);
+  if (wifiConnected && config.mqtt.host.length() > 0)
+  {
+    mqttClient.setServer(config.mqtt.host.c_str(), config.mqtt.port);
+  }
+}
+
+void mqttStop()
+{
+  if (mqttClient.connected())
+  {
+    LOG_I("Disconnecting MQTT...");
+    mqttClient.disconnect();
+  }
+  mqttConnReset();
+  mqttConnected = false;
+}
+
+void mqttService()
+{
+  if (mqttClient.connected())
+  {
+    mqttClient.loop();
+    telemetryFlushStep();
+    return;
+  }
+
+  if (mqttConnState == MQTT_CONN_UP)
+  {
+    mqttConnectionLost();
+  }
+
+  if (wifiConnected && config.mqtt.host.length() > 0)
+  {
+    mqttReconnect();
+  }
+}
+
+void wsBegin()
+{
+  if (wifiConnected && config.ws.host.length() > 0)
+  {
+    wsClient.begin(config.ws.host.c_str(), config.ws.port, config.ws.path.c_str());
+    wsClient.onEvent(wsEvent);
+    wsClient.setReconnectInterval(5000);
+  }
+}
+
+void wsStop()
+{
+  if (wsClient.isConnected())
+  {
+    LOG_I("Disconnecting WebSocket...");
+  }
+  wsClient.disconnect();
+  wsConnected = false;
+}
+
+void wsService()
+{
+  wsClient.loop();
+}
+
+void transportsRegister()
+{
+  transports[MODE_MQTT] = {"mqtt", &config.mqtt, mqttBegin, mqttStop, mqttService, mqttPublish, &mqttConnected};
+  transports[MODE_WEBSOCKET] = {"ws", &config.ws, wsBegin, wsStop, wsService, wsPublish, &wsConnected};
+}
+
+const char *transportsLabel()
+{
+  if (config.mqtt.enabled && config.ws.enabled)
+    return "MQTT+WS";
+  if (config.mqtt.enabled)
+    return "MQTT";
+  if (config.ws.enabled)
+    return "WS";
+  return "None";
+}
+
+void transportBegin(int id)
+{
+  Transport &t = transports[id];
+  t.reconnecting = false;
+  t.lastPublish = millis();
+  if (t.cfg->enabled)
+  {
+    LOG_I("Transport %s: %s:%d", t.name, t.cfg->host.c_str(), t.cfg->port);
+    t.begin();
+  }
+}
+
+void transportStop(int id)
+{
+  transports[id].stop();
+  transports[id].reconnecting = false;
+  remoteConnected = mqttConnected || wsConnected;
+}
+
+void transportsBegin()
+{
+  LOG_I("Setting up communication mode: %s", transportsLabel());
+  for (int i = 0; i < TRANSPORT_COUNT; i++)
+    transportBegin(i);
+}
+
+void transportsStop()
+{
+  for (int i = 0; i < TRANSPORT_COUNT; i++)
+    transportStop(i);
+}
+
+// Output change from any source: push to transports that want it now
+void publishState()
+{
+  for (int i = 0; i < TRANSPORT_COUNT; i++)
+  {
+    Transport &t = transports[i];
+    if (t.cfg->enabled && t.cfg->publishOnChange && *t.connected && t.publish())
+    {
+      t.publishes++;
+      t.lastPublish = millis();
+    }
+  }
+}
+
+// Falls back to AP mode once every enabled transport with a server has
+// failed to reconnect for REMOTE_RECONNECT_TIMEOUT
+void transportsLoop()
+{
+  unsigned long now = millis();
+  bool expired = false;
+  bool healthy = false;
+
+  for (int i = 0; i < TRANSPORT_COUNT; i++)
+  {
+    Transport &t = transports[i];
+    if (!t.cfg->enabled)
+      continue;
+
+    t.service();
+
+    if (*t.connected)
+    {
+      t.reconnecting = false;
+      healthy = true;
+
+      if (t.cfg->publishIntervalMs > 0 && now - t.lastPublish >= t.cfg->publishIntervalMs)
+      {
+        if (t.publish())
+          t.publishes++;
+        t.lastPublish = now;
+      }
+    }
+    else if (!wifiConnected || t.cfg->host.length() == 0)
+    {
+      t.reconnecting = false;
+    }
+    else if (!t.reconnecting)
+    {
+      LOG_I("%s disconnected. Memulai 15 detik percobaan reconnect...", t.name);
+      t.reconnecting = true;
+      t.disconnectTime = now;
+      healthy = true;
+    }
+    else if (now - t.disconnectTime >= REMOTE_RECONNECT_TIMEOUT)
+    {
+      expired = true;
+    }
+    else
+    {
+      healthy = true;
+    }
+  }
+
+  remoteConnected = mqttConnected || wsConnected;
+
+  if (expired && !healthy)
+  {
+    LOG_W("Transport: gagal reconnect selama 15 detik, pindah ke AP Mode.");
+
+    transportsStop();
+
+    WiFi.disconnect();
+    startApMode();
+
+    LOG_I("AP Mode Aktif. IP: %s", WiFi.softAPIP().toString().c_str());
+    lcdNeedsRedraw = true;
+  }
+}
+
+// ==================== UDP BINARY CONTROL ====================
+// Fixed-layout frames for low-latency LAN control. All fields little-endian.
+// Tag = first UDP_TAG_LEN bytes of HMAC-SHA256(udpKey, frame without tag).
+// Host client: testUDP/udpClient.js
+#define UDP_FRAME_MAGIC 0x4352 // "RC"
+#define UDP_FRAME_VERSION 1
+#define UDP_TAG_LEN 8
+#define UDP_MAX_FRAMES_PER_LOOP 4
+
+#define UDP_ACK_OK 0
+#define UDP_ACK_REPLAY 1
+#define UDP_ACK_PARTIAL 2
+
+// Replay protection survives a reboot: the accepted seq never passes a
+// mark persisted in UDP_SEQ_FILE, which is moved UDP_SEQ_RESERVE ahead
+// when it is reached (one small flash write per UDP_SEQ_RESERVE frames).
+// After a reboot every seq up to the mark counts as a replay; the replay
+// ack carries the mark in rejectedMask so a client can jump past it.
+#define UDP_SEQ_FILE "/udpseq.bin"
+#define UDP_SEQ_RESERVE 1024
+
+struct __attribute__((packed)) UdpCmdFrame
+{
+  uint16_t magic;
+  uint8_t version;
+  uint8_t bank;         // Channel base = bank * 32 + 1
+  uint32_t seq;         // Must increase per command, 0 is never accepted
+  uint32_t channelMask; // Bit n = channel (bank * 32 + n + 1) is addressed
+  uint32_t valueMask;   // Bit n = requested state for that channel
+  uint8_t tag[UDP_TAG_LEN];
+};
+
+struct __attribute__((packed)) UdpAckFrame
+{
+  uint16_t magic;
+  uint8_t version;
+  uint8_t status;
+  uint32_t seq;          // Echo of the command seq
+  uint32_t stateMask;    // Applied output state of the bank after the command
+  uint32_t rejectedMask; // Addressed channels that could not be switched,
+                         // on UDP_ACK_REPLAY the highest seq seen so far
+  uint8_t tag[UDP_TAG_LEN];
+};
+
+// A bank is one word of outputState, bits past outputCount are always 0
+uint32_t getOutputStateMask(uint8_t bank)
+{
+  return bank < OUTPUT_WORDS ? outputState.words[bank] : 0;
+}
+
+void udpComputeTag(const uint8_t *data, size_t length, uint8_t *tagOut)
+{
+  uint8_t digest[32];
+
+  mbedtls_md_hmac(mbedtls_md_info_from_type(MBEDTLS_MD_SHA256),
+                  (const unsigned char *)config.udpKey.c_str(), config.udpKey.length(),
+                  data, length, digest);
+  memcpy(tagOut, digest, UDP_TAG_LEN);
+}
+
+bool udpTagValid(const UdpCmdFrame &frame)
+{
+  uint8_t expected[UDP_TAG_LEN];
+  udpComputeTag((const uint8_t *)&frame, offsetof(UdpCmdFrame, tag), expected);
+
+  // Constant-time compare
+  uint8_t diff = 0;
+  for (int i = 0; i < UDP_TAG_LEN; i++)
+  {
+    diff |= expected[i] ^ frame.tag[i];
+  }
+  return diff == 0;
+}
+
+void udpSendAck(uint32_t seq, uint8_t bank, uint8_t status, uint32_t rejectedMask)
+{
+  UdpAckFrame ack;
+  ack.magic = UDP_FRAME_MAGIC;
+  ack.version = UDP_FRAME_VERSION;
+  ack.status = status;
+  ack.seq = seq;
+  ack.stateMask = getOutputStateMask(bank);
+  ack.rejectedMask = rejectedMask;
+  udpComputeTag((const uint8_t *)&ack, offsetof(UdpAckFrame, tag), ack.tag);
+
+  udpCtrl.beginPacket(udpCtrl.remoteIP(), udpCtrl.remotePort());
+  udpCtrl.write((const uint8_t *)&ack, sizeof(ack));
+  udpCtrl.endPacket();
+}
+
+struct __attribute__((packed)) UdpSeqRecord
+{
+  uint32_t mark;
+  uint32_t crc;
+};
+
+// The file value is never below udpLastSeq, reloading it is always safe
+void udpSeqLoad()
+{
+  UdpSeqRecord r;
+  File f = LittleFS.open(UDP_SEQ_FILE, "r");
+  if (!f)
+    return;
+  bool ok = f.read((uint8_t *)&r, sizeof(r)) == sizeof(r) &&
+            r.crc == crc32Calc((const uint8_t *)&r, offsetof(UdpSeqRecord, crc));
+  f.close();
+
+  if (ok)
+    udpLastSeq = udpSeqReserved = r.mark;
+  else
+    LOG_W("UDP control: %s tidak valid", UDP_SEQ_FILE);
+}
+
+// Before seq is accepted. false = the mark could not be saved, the frame
+// must not be applied.
+bool udpSeqReserve(uint32_t seq)
+{
+  if ((int32_t)(seq - udpSeqReserved) <= 0)
+    return true;
+
+  UdpSeqRecord r;
+  r.mark = seq + UDP_SEQ_RESERVE;
+  r.crc = crc32Calc((const uint8_t *)&r, offsetof(UdpSeqRecord, crc));
+  File f = LittleFS.open(UDP_SEQ_FILE, "w");
+  if (!f)
+    return false;
+  bool ok = f.write((const uint8_t *)&r, sizeof(r)) == sizeof(r);
+  f.close();
+  if (ok)
+    udpSeqReserved = r.mark;
+  return ok;
+}
+
+void udpControlBegin()
+{
+  if (udpCtrlRunning)
+  {
+    udpCtrl.stop();
+    udpCtrlRunning = false;
+  }
+
+  if (!config.udpEnabled)
+    return;
+
+  if (config.udpKey.length() == 0)
+  {
+    LOG_W("UDP control: udpKey kosong, listener tidak dijalankan");
+    return;
+  }
+
+  udpSeqLoad();
+  udpCtrlRunning = udpCtrl.begin(config.udpPort);
+  LOG_I("UDP control %s on port %d", udpCtrlRunning ? "listening" : "FAILED", config.udpPort);
+}
+
+void udpControlLoop()
 {
-  if (!remoteConnected)
+  if (!udpCtrlRunning)
     return;
 
-  String json = getRemoteStatusJSON();
+  for (int n = 0; n < UDP_MAX_FRAMES_PER_LOOP; n++)
+  {
+    int size = udpCtrl.parsePacket();
+    if (size <= 0)
+      return;
+
+    UdpCmdFrame frame;
+    if (size != sizeof(frame) || udpCtrl.read((uint8_t *)&frame, sizeof(frame)) != sizeof(frame) ||
+        frame.magic != UDP_FRAME_MAGIC || frame.version != UDP_FRAME_VERSION ||
+        frame.bank * 32 >= outputCount)
+    {
+      udpBadFrames++;
+      continue;
+    }
+
+    // Unauthenticated frames are dropped silently, never acked
+    if (!udpTagValid(frame))
+    {
+      udpBadTags++;
+      continue;
+    }
+
+    udpRxFrames++;
+
+    // Signed comparison so the sequence may wrap around
+    if (frame.seq == 0 || (int32_t)(frame.seq - udpLastSeq) <= 0)
+    {
+      udpReplays++;
+      udpSendAck(frame.seq, frame.bank, UDP_ACK_REPLAY, udpLastSeq);
+      continue;
+    }
+    if (!udpSeqReserve(frame.seq))
+    {
+      LOG_E("UDP control: %s gagal ditulis, frame ditolak", UDP_SEQ_FILE);
+      udpBadFrames++;
+      continue;
+    }
+    udpLastSeq = frame.seq;
+
+    // Whole bank in one pass, one write per expander
+    int base = frame.bank * 32;
+    uint32_t valid = outputCount - base >= 32 ? 0xFFFFFFFFUL : (1UL << (outputCount - base)) - 1;
+    OutputBits mask = {};
+    OutputBits values = {};
+    mask.words[frame.bank] = frame.channelMask & valid;
+    values.words[frame.bank] = frame.valueMask;
+
+    uint32_t before = getOutputStateMask(frame.bank);
+    applyOutputMask(mask, values, SRC_UDP);
+    uint32_t after = getOutputStateMask(frame.bank);
 
-  wsClient.sendTXT(json);
-  Serial.println("WS Published");
+    uint32_t rejectedMask = (after ^ frame.valueMask) & mask.words[frame.bank];
+    bool changed = before != after;
+
+    // Ack first, the remote publish is not part of the latency path
+    udpSendAck(frame.seq, frame.bank, rejectedMask ? UDP_ACK_PARTIAL : UDP_ACK_OK, rejectedMask);
+
+    if (changed)
+      requestPublish();
+  }
 }
 
 // ==================== WEB SERVER HANDLERS ====================
@@ -1153,9 +5555,53 @@ void handleLogin()
   server.send(200, "application/json", json);
 }
 
-void handleGetStatus()
+void handleGetStatus()
+{
+  server.send(200, "application/json", getStatusJSON());
+}
+
+void handleMetrics()
 {
-  server.send(200, "application/json", getStatusJSON());
+  server.send(200, "text/plain; version=0.0.4", getMetricsText());
+}
+
+// Binary trace download: TraceHeader followed by events, oldest first.
+// ?source=flash returns the spilled TRACE_FILE instead (same header, count 0).
+void handleTrace()
+{
+  if (server.arg("source") == "flash")
+  {
+    if (config.traceSpill)
+      traceSpill();
+    serveFile(TRACE_FILE, "application/octet-stream");
+    return;
+  }
+
+  uint32_t head = traceRing.head;
+  uint32_t count = min(head, (uint32_t)TRACE_CAPACITY);
+
+  TraceHeader hdr;
+  hdr.magic = TRACE_MAGIC;
+  hdr.version = TRACE_VERSION;
+  hdr.eventSize = sizeof(TraceEvent);
+  hdr.count = count;
+  hdr.nowUs = micros();
+  hdr.totalEvents = head;
+
+  server.setContentLength(sizeof(hdr) + count * sizeof(TraceEvent));
+  server.sendHeader("Content-Disposition", "attachment; filename=trace.bin");
+  server.send(200, "application/octet-stream", "");
+  server.sendContent((const char *)&hdr, sizeof(hdr));
+
+  // Oldest part first (ring may have wrapped), then the newest part
+  uint32_t start = head - count;
+  while (start != head)
+  {
+    uint32_t idx = start & (TRACE_CAPACITY - 1);
+    uint32_t n = min(head - start, (uint32_t)(TRACE_CAPACITY - idx));
+    server.sendContent((const char *)&traceRing.events[idx], n * sizeof(TraceEvent));
+    start += n;
+  }
 }
 
 // Handler untuk switch mode via web
@@ -1199,6 +5645,12 @@ void handleSetOutput()
     return;
   }
 
+  if (!admitCommand(SRC_HTTP, (uint32_t)server.client().remoteIP()))
+  {
+    server.send(429, "application/json", "{\"success\":false,\"message\":\"Rate limited\"}");
+    return;
+  }
+
   StaticJsonDocument<512> doc;
   deserializeJson(doc, server.arg("plain"));
 
@@ -1209,17 +5661,10 @@ void handleSetOutput()
     int id = doc["id"];
     bool state = doc["state"];
 
-    if (id >= 0 && id < TOTAL_OUTPUTS)
+    if (id >= 0 && id < outputCount)
     {
-      setOutput(id + 1, state);
-
-      if (remoteConnected)
-      {
-        if (config.commMode == MODE_MQTT)
-          mqttPublish();
-        else
-          wsPublish();
-      }
+      queueOutput(id + 1, state, SRC_HTTP);
+      requestPublish();
 
       server.send(200, "application/json", "{\"success\":true}");
     }
@@ -1231,13 +5676,12 @@ void handleSetOutput()
   else if (action == "setAutoMode")
   {
     int id = doc["id"];
-    if (id >= 0 && id < TOTAL_OUTPUTS)
+    if (id >= 0 && id < outputCount)
     {
       outputs[id].autoMode = doc["autoMode"];
       outputs[id].lastToggle = millis();
-
-      // Rebuild sync groups
-      rebuildSyncGroups();
+      markChannelConfigDirty();
+      syncGroupUpdate(id);
 
       server.send(200, "application/json", "{\"success\":true}");
     }
@@ -1249,16 +5693,28 @@ void handleSetOutput()
   else if (action == "setInterval")
   {
     int id = doc["id"];
-    if (id >= 0 && id < TOTAL_OUTPUTS)
+    if (id >= 0 && id < outputCount)
     {
       outputs[id].intervalOn = doc["intervalOn"].as<unsigned long>() * 1000;
       outputs[id].intervalOff = doc["intervalOff"].as<unsigned long>() * 1000;
+      markChannelConfigDirty();
+      syncGroupUpdate(id);
 
-      // Rebuild sync groups jika output dalam auto mode
-      if (outputs[id].autoMode)
-      {
-        rebuildSyncGroups();
-      }
+      server.send(200, "application/json", "{\"success\":true}");
+    }
+    else
+    {
+      server.send(400, "application/json", "{\"success\":false}");
+    }
+  }
+  else if (action == "setPhase")
+  {
+    int id = doc["id"];
+    unsigned long phase = doc["phase"] | 0UL;
+    if (id >= 0 && id < outputCount && channelPhaseFits(id, phase))
+    {
+      outputs[id].phaseMs = phase;
+      markChannelConfigDirty();
 
       server.send(200, "application/json", "{\"success\":true}");
     }
@@ -1272,9 +5728,10 @@ void handleSetOutput()
     int id = doc["id"];
     String name = doc["name"].as<String>();
 
-    if (id >= 0 && id < TOTAL_OUTPUTS)
+    if (id >= 0 && id < outputCount)
     {
-      outputs[id].name = name;
+      outputs[id].name = name.substring(0, CHANNEL_NAME_LEN - 1);
+      markChannelConfigDirty();
       server.send(200, "application/json", "{\"success\":true}");
     }
     else
@@ -1290,11 +5747,13 @@ void handleSetOutput()
   else if (action == "setToggleLimit")
   {
     int id = doc["id"];
-    if (id >= 0 && id < TOTAL_OUTPUTS)
+    if (id >= 0 && id < outputCount)
     {
       outputs[id].maxToggles = doc["limit"].as<int>();
       outputs[id].currentToggles = 0; // Otomatis reset meteran saat set baru
-      Serial.printf("CH%02d: Batasan perpindahan diatur ke %d. Meteran direset.\n", id + 1, outputs[id].maxToggles);
+      journalMark(id);
+      markChannelConfigDirty();
+      LOG_I("CH%02d: Batasan perpindahan diatur ke %d. Meteran direset.", id + 1, outputs[id].maxToggles);
       server.send(200, "application/json", "{\"success\":true}");
     }
     else { server.send(400, "application/json", "{\"success\":false}"); }
@@ -1302,14 +5761,69 @@ void handleSetOutput()
   else if (action == "resetToggleCounter")
   {
     int id = doc["id"];
-    if (id >= 0 && id < TOTAL_OUTPUTS)
+    if (id >= 0 && id < outputCount)
     {
       outputs[id].currentToggles = 0;
-      Serial.printf("CH%02d: Meteran perpindahan direset.\n", id + 1);
+      journalMark(id);
+      LOG_I("CH%02d: Meteran perpindahan direset.", id + 1);
       server.send(200, "application/json", "{\"success\":true}");
     }
     else { server.send(400, "application/json", "{\"success\":false}"); }
   }
+  else if (action == "setAll")
+  {
+    // Bulk edit of every channel in one request (and one rate-limit token):
+    // optional limit, intervalOn/intervalOff, autoMode, then state
+    bool setLimit = doc.containsKey("limit");
+    bool setInterval = doc.containsKey("intervalOn") && doc.containsKey("intervalOff");
+    bool setAuto = doc.containsKey("autoMode");
+
+    for (int i = 0; i < outputCount; i++)
+    {
+      if (setLimit)
+      {
+        outputs[i].maxToggles = doc["limit"].as<int>();
+        outputs[i].currentToggles = 0;
+        journalMark(i);
+      }
+      if (setInterval)
+      {
+        outputs[i].intervalOn = doc["intervalOn"].as<unsigned long>() * 1000;
+        outputs[i].intervalOff = doc["intervalOff"].as<unsigned long>() * 1000;
+      }
+      if (setAuto)
+      {
+        outputs[i].autoMode = doc["autoMode"];
+        outputs[i].lastToggle = millis();
+      }
+      if (setInterval || setAuto)
+        syncGroupUpdate(i);
+      if (doc.containsKey("state"))
+        queueOutput(i + 1, doc["state"], SRC_HTTP);
+    }
+
+    if (setLimit || setInterval || setAuto)
+      markChannelConfigDirty();
+    requestPublish();
+    LOG_I("setAll: %d channel(s) updated", outputCount);
+    server.send(200, "application/json", "{\"success\":true}");
+  }
+  else if (isGroupAction(action))
+  {
+    const char *error = namedGroupAction(action, doc.as<JsonVariantConst>(), SRC_HTTP);
+    if (error)
+      server.send(400, "application/json", String("{\"success\":false,\"message\":\"") + error + "\"}");
+    else
+      server.send(200, "application/json", "{\"success\":true}");
+  }
+  else if (isTimedAction(action))
+  {
+    const char *error = timedOutputAction(action, doc.as<JsonVariantConst>(), SRC_HTTP);
+    if (error)
+      server.send(400, "application/json", String("{\"success\":false,\"message\":\"") + error + "\"}");
+    else
+      server.send(200, "application/json", "{\"success\":true}");
+  }
   else
   {
     server.send(400, "application/json", "{\"success\":false}");
@@ -1318,14 +5832,15 @@ void handleSetOutput()
 
 void handleGetConfig()
 {
-  StaticJsonDocument<1024> doc;
+  StaticJsonDocument<2048> doc;
   doc["wifiSSID"] = config.wifiSSID;
-  doc["serverIP"] = config.serverIP;
-  doc["serverPort"] = config.serverPort;
-  doc["serverPath"] = config.serverPath;
-  doc["serverToken"] = config.serverToken;
+  transportConfigToJson(config.mqtt, doc.createNestedObject("mqtt"), true);
+  transportConfigToJson(config.ws, doc.createNestedObject("ws"), false);
   doc["webUsername"] = config.webUsername;
-  doc["commMode"] = (int)config.commMode;
+  doc["udpEnabled"] = config.udpEnabled;
+  doc["udpPort"] = config.udpPort;
+  doc["syncStagger"] = config.syncStaggerMs;
+  namedGroupsToJson(doc.createNestedArray("groups"));
 
   String json;
   serializeJson(doc, json);
@@ -1340,46 +5855,94 @@ void handleSaveConfig()
     return;
   }
 
-  StaticJsonDocument<1024> doc;
+  StaticJsonDocument<1536> doc;
   deserializeJson(doc, server.arg("plain"));
 
+  Config old = config;
+
   config.wifiSSID = doc["wifiSSID"].as<String>();
-  config.wifiPassword = doc["wifiPassword"].as<String>();
-  config.serverIP = doc["serverIP"].as<String>();
-  config.serverPort = doc["serverPort"] | 1883;
-  config.serverPath = doc["serverPath"].as<String>();
-  config.serverToken = doc["serverToken"].as<String>();
   config.webUsername = doc["webUsername"].as<String>();
 
-  CommMode newMode = (CommMode)(doc["commMode"] | config.commMode);
+  // GET /api/config never returns it: empty means "keep the current one",
+  // like webPassword, so an unrelated edit does not reconnect WiFi
+  if (doc.containsKey("wifiPassword") && doc["wifiPassword"].as<String>().length() > 0)
+  {
+    config.wifiPassword = doc["wifiPassword"].as<String>();
+  }
 
-  if (doc.containsKey("webPassword") && doc["webPassword"].as<String>().length() > 0)
+  if (doc.containsKey("mqtt") || doc.containsKey("ws"))
   {
-    config.webPassword = doc["webPassword"].as<String>();
+    transportConfigFromJson(config.mqtt, doc["mqtt"]);
+    transportConfigFromJson(config.ws, doc["ws"]);
+  }
+  else if (doc.containsKey("serverIP"))
+  {
+    // Old clients: one server block + exclusive commMode
+    CommMode mode = (CommMode)(doc["commMode"] | (int)MODE_WEBSOCKET);
+    TransportConfig &t = mode == MODE_MQTT ? config.mqtt : config.ws;
+    config.mqtt.enabled = mode == MODE_MQTT;
+    config.ws.enabled = mode != MODE_MQTT;
+    t.host = doc["serverIP"].as<String>();
+    t.port = doc["serverPort"] | t.port;
+    t.path = doc["serverPath"].as<String>();
+    t.token = doc["serverToken"].as<String>();
   }
 
-  // Switch mode jika berbeda (saveToConfig=false karena kita save manual)
-  if (newMode != config.commMode)
+  if (doc.containsKey("webPassword") && doc["webPassword"].as<String>().length() > 0)
   {
-    config.commMode = newMode;
-    saveConfig();
-    switchMode(newMode, false);
+    config.webPassword = doc["webPassword"].as<String>();
   }
+
+  config.udpEnabled = doc["udpEnabled"] | config.udpEnabled;
+  config.udpPort = doc["udpPort"] | config.udpPort;
+  unsigned long syncStagger = doc["syncStagger"] | (unsigned long)config.syncStaggerMs;
+  if (syncStaggerFits(syncStagger))
+    config.syncStaggerMs = syncStagger;
   else
+    LOG_W("syncStagger %lu ms melebihi interval sync group, diabaikan", syncStagger);
+
+  // Same rule as webPassword: empty key means "keep the current one"
+  if (doc.containsKey("udpKey") && doc["udpKey"].as<String>().length() > 0)
   {
-    saveConfig();
+    config.udpKey = doc["udpKey"].as<String>();
   }
 
-  StaticJsonDocument<100> response;
+  uint8_t changes = 0;
+  if (config.wifiSSID != old.wifiSSID || config.wifiPassword != old.wifiPassword)
+    changes |= CFG_CHANGE_WIFI;
+  if (transportConfigChanged(config.mqtt, old.mqtt))
+    changes |= CFG_CHANGE_MQTT;
+  if (transportConfigChanged(config.ws, old.ws))
+    changes |= CFG_CHANGE_WS;
+  if (config.udpEnabled != old.udpEnabled || config.udpPort != old.udpPort || config.udpKey != old.udpKey)
+    changes |= CFG_CHANGE_UDP;
+  if (config.webUsername != old.webUsername || config.webPassword != old.webPassword)
+    changes |= CFG_CHANGE_CREDENTIALS;
+
+  requestConfigSave();
+
+  StaticJsonDocument<256> response;
   response["success"] = true;
-  response["message"] = "Config saved. Restarting...";
+  response["message"] = "Config saved and applied";
+  response["reboot"] = false;
+  JsonArray applied = response.createNestedArray("applied");
+  if (changes & CFG_CHANGE_WIFI)
+    applied.add("wifi");
+  if (changes & CFG_CHANGE_MQTT)
+    applied.add("mqtt");
+  if (changes & CFG_CHANGE_WS)
+    applied.add("ws");
+  if (changes & CFG_CHANGE_UDP)
+    applied.add("udp");
+  if (changes & CFG_CHANGE_CREDENTIALS)
+    applied.add("credentials");
 
   String json;
   serializeJson(response, json);
   server.send(200, "application/json", json);
 
-  delay(1000);
-  ESP.restart();
+  // Applied from loop() so this response leaves before WiFi is touched
+  configHotApply(changes);
 }
 
 void handleNotFound()
@@ -1398,11 +5961,462 @@ void handleNotFound()
     message += " " + server.argName(i) + ": " + server.arg(i) + "\n";
   }
 
-  Serial.println("404 Not Found: " + server.uri());
+  LOG_W("404 Not Found: %s", server.uri().c_str());
   server.send(404, "text/plain", message);
 }
 
+// ==================== I2C FAULT INJECTION ====================
+// Bench builds only (-D I2C_FAULT_INJECT). One scripted fault at a time is
+// applied inside i2cTransact(), below the retries and the bus recovery, so
+// the real detection and recovery paths run:
+//   NACK   the address NACKs the next n transactions
+//   READ   the next n port reads of the address come back inverted
+//   STUCK  every transaction times out for n ms (SDA held low), each one
+//          after the I2C_TIMEOUT_MS a real stuck bus costs
+//   RESET  the device loses its port: it is written to all HIGH, as after
+//          a power-on reset, and has to be found and repaired
+// FAULT BENCH <ch> runs each fault through setOutput() and through
+// processSyncGroups() (a temporary group of every channel on the same
+// expander) and prints time-to-detect, time-to-recover and whether the
+// pins and outputs[] agree afterwards. It switches real relays.
+#ifdef I2C_FAULT_INJECT
+#define FAULT_RECOVER_LIMIT_US 1000000
+
+enum I2cFaultKind : uint8_t
+{
+  FAULT_NONE,
+  FAULT_NACK,
+  FAULT_BAD_READ,
+  FAULT_STUCK,
+  FAULT_RESET
+};
+
+struct I2cFault
+{
+  I2cFaultKind kind;
+  uint8_t addr;
+  uint16_t remaining;    // NACK / READ: transactions left
+  unsigned long untilMs; // STUCK
+};
+
+I2cFault i2cFault = {FAULT_NONE, 0, 0, 0};
+unsigned long i2cFaultHits = 0;
+
+// Port write of every pin HIGH, behind the bus manager's back
+uint8_t i2cFaultResetPort(IoDevice &dev)
+{
+  uint16_t shadow = dev.shadow;
+  dev.shadow = 0xFFFF;
+  uint8_t status = dev.type == IO_PCF8574   ? ioPortWrite<IO_PCF8574>(dev)
+                   : dev.type == IO_PCF8575 ? ioPortWrite<IO_PCF8575>(dev)
+                                            : ioPortWrite<IO_MCP23017>(dev);
+  dev.shadow = shadow;
+  return status;
+}
+
+void i2cFaultArm(I2cFaultKind kind, uint8_t addr, unsigned long arg)
+{
+  i2cFault.kind = kind;
+  i2cFault.addr = addr;
+  i2cFault.remaining = arg > 0 ? arg : 1;
+  i2cFault.untilMs = millis() + arg;
+
+  if (kind != FAULT_RESET)
+    return;
+  // The reset is done at once; detecting it is up to ioAudit()
+  i2cFault.kind = FAULT_NONE;
+  for (int d = 0; d < ioDeviceCount; d++)
+  {
+    IoDevice &dev = ioDevices[d];
+    if (dev.type != IO_VIRTUAL && dev.addr == addr && i2cFaultResetPort(dev) == I2C_OK)
+      i2cFaultHits++;
+  }
+}
+
+bool i2cFaultStuck()
+{
+  return i2cFault.kind == FAULT_STUCK && (long)(millis() - i2cFault.untilMs) < 0;
+}
+
+uint8_t i2cFaultRun(IoDevice &dev, uint8_t (*txn)(IoDevice &))
+{
+  I2cFault &f = i2cFault;
+  bool read = txn == ioPortRead;
+
+  switch (f.kind)
+  {
+  case FAULT_STUCK:
+    if (i2cFaultStuck())
+    {
+      i2cFaultHits++;
+      delay(I2C_TIMEOUT_MS); // Wire waits this long before giving up
+      return I2C_TIMEOUT;
+    }
+    f.kind = FAULT_NONE;
+    break;
+  case FAULT_NACK:
+    if (dev.addr != f.addr)
+      break;
+    i2cFaultHits++;
+    if (--f.remaining == 0)
+      f.kind = FAULT_NONE;
+    return I2C_NACK_ADDR;
+  case FAULT_BAD_READ:
+    if (dev.addr != f.addr || !read)
+      break;
+    {
+      uint8_t status = txn(dev);
+      dev.readback ^= dev.usedMask;
+      i2cFaultHits++;
+      if (--f.remaining == 0)
+        f.kind = FAULT_NONE;
+      return status;
+    }
+  default:
+    break;
+  }
+  return txn(dev);
+}
+
+struct FaultScenario
+{
+  const char *name;
+  I2cFaultKind kind;
+  uint16_t arg;
+  bool afterCommand; // Fault hits once the command is committed
+};
+
+const FaultScenario FAULT_SCENARIOS[] = {
+    {"nack x1", FAULT_NACK, 1, false}, // Absorbed by the retries
+    {"nack x5", FAULT_NACK, 5, false}, // Outlasts them, the command is repeated
+    {"bad read", FAULT_BAD_READ, 1, false},
+    {"stuck 20ms", FAULT_STUCK, 20, false},
+    {"reset", FAULT_RESET, 0, true}, // Found by ioAudit()
+};
+
+// The command under test. false = not every member reached state.
+bool faultCommand(bool group, int index, const OutputBits &members, bool state)
+{
+  if (!group)
+  {
+    setOutput(index + 1, state, SRC_SERIAL);
+  }
+  else
+  {
+    // One due group with those members; the real groups are put back after
+    SyncGroup saved[SYNC_GROUP_SLOTS];
+    memcpy(saved, syncGroups, sizeof(saved));
+    int savedActive = activeSyncGroups;
+
+    // Due right now, with room for any offset outputScheduleMask() allows
+    memset(syncGroups, 0, sizeof(syncGroups));
+    SyncGroup &g = syncGroups[0];
+    g.intervalOn = TIMER_MAX_MS + 1;
+    g.intervalOff = TIMER_MAX_MS + 1;
+    g.lastToggle = millis() - g.intervalOff;
+    g.currentState = !state;
+    g.members = members;
+    g.memberCount = 0;
+    for (int i = members.next(0); i >= 0; i = members.next(i + 1))
+      g.memberCount++;
+    activeSyncGroups = 1;
+
+    // syncStagger / channel phases. Only the members are waited for,
+    // unrelated pulses and bursts keep running on their own schedule.
+    processSyncGroups();
+    for (int i = members.next(0); i >= 0; i = members.next(i + 1))
+    {
+      while (timerPending(i))
+        timersService();
+    }
+
+    memcpy(syncGroups, saved, sizeof(saved));
+    activeSyncGroups = savedActive;
+  }
+
+  for (int i = members.next(0); i >= 0; i = members.next(i + 1))
+  {
+    if (outputs[i].state != state)
+      return false;
+  }
+  return true;
+}
+
+// Pins (read without faults) agree with outputs[] for every member
+bool faultStateCorrect(int device, const OutputBits &members, bool state)
+{
+  IoDevice &d = ioDevices[device];
+  if (!i2cTransact(d, ioPortRead))
+    return false;
+
+  for (int i = members.next(0); i >= 0; i = members.next(i + 1))
+  {
+    const ChannelMap &ch = outputMap[i];
+    bool level = (d.readback >> ch.pin) & 1;
+    if (outputs[i].state != state || level != (state != ch.activeLow))
+      return false;
+  }
+  return true;
+}
+
+void faultRun(const FaultScenario &sc, bool group, int index)
+{
+  int device = outputMap[index].device;
+  OutputBits members = {};
+  OutputBits none = {};
+  for (int i = 0; i < outputCount; i++)
+  {
+    if (group ? outputMap[i].device == device : i == index)
+      members.set(i, true);
+  }
+  bool original = outputs[index].state;
+  bool target = !original;
+  // Group members all start where the channel under test is
+  applyOutputMask(members, original ? members : none, SRC_SERIAL);
+
+  i2cFirstErrorUs = 0;
+  unsigned long t0 = micros();
+  if (!sc.afterCommand)
+    i2cFaultArm(sc.kind, ioDevices[device].addr, sc.arg);
+  bool done = faultCommand(group, index, members, target);
+  if (sc.afterCommand)
+    i2cFaultArm(sc.kind, ioDevices[device].addr, sc.arg);
+
+  unsigned long recoverUs = 0;
+  while (micros() - t0 < FAULT_RECOVER_LIMIT_US)
+  {
+    if (!done)
+      done = faultCommand(group, index, members, target); // The sender repeats it
+    if (done && ioAudit(device))
+    {
+      recoverUs = micros() - t0;
+      break;
+    }
+    delay(1);
+  }
+  i2cFault.kind = FAULT_NONE;
+
+  bool correct = faultStateCorrect(device, members, target);
+  String detect = i2cFirstErrorUs ? String(i2cFirstErrorUs - t0) : String("-");
+  String recover = recoverUs ? String(recoverUs) : String("FAIL");
+  Serial.printf("%-10s %-6s detect:%8s us  recover:%8s us  %s\n", sc.name, group ? "group" : "single",
+                detect.c_str(), recover.c_str(), correct ? "OK" : "WRONG");
+
+  applyOutputMask(members, original ? members : none, SRC_SERIAL);
+}
+
+void faultBench(int channel)
+{
+  if (channel < 1 || channel > outputCount || outputMap[channel - 1].device == IO_DEVICE_GPIO ||
+      ioDevices[outputMap[channel - 1].device].type == IO_VIRTUAL)
+  {
+    Serial.println("FAULT BENCH: channel must be on an I2C expander");
+    return;
+  }
+
+  Serial.printf("\nFault bench on CH%02d (IO%d 0x%02X)\n", channel, outputMap[channel - 1].device,
+                ioDevices[outputMap[channel - 1].device].addr);
+  for (size_t s = 0; s < sizeof(FAULT_SCENARIOS) / sizeof(FAULT_SCENARIOS[0]); s++)
+  {
+    faultRun(FAULT_SCENARIOS[s], false, channel - 1);
+    faultRun(FAULT_SCENARIOS[s], true, channel - 1);
+  }
+  Serial.printf("Fault hits: %lu, bus recoveries: %lu\n", i2cFaultHits, i2cRecoveries);
+}
+
+// FAULT NACK|READ <addr> [n], FAULT STUCK <ms>, FAULT RESET <addr>,
+// FAULT OFF, FAULT BENCH <ch>
+void faultCommandLine(const String &args)
+{
+  char buf[48];
+  strlcpy(buf, args.c_str(), sizeof(buf));
+  char *kind = strtok(buf, " ");
+  char *a1 = strtok(nullptr, " ");
+  char *a2 = strtok(nullptr, " ");
+  unsigned long v1 = a1 ? strtoul(a1, nullptr, 0) : 0;
+  unsigned long v2 = a2 ? strtoul(a2, nullptr, 0) : 1;
+
+  if (!kind)
+    Serial.println("FAULT NACK|READ <addr> [n], STUCK <ms>, RESET <addr>, OFF, BENCH <ch>");
+  else if (!strcmp(kind, "NACK"))
+    i2cFaultArm(FAULT_NACK, v1, v2);
+  else if (!strcmp(kind, "READ"))
+    i2cFaultArm(FAULT_BAD_READ, v1, v2);
+  else if (!strcmp(kind, "STUCK"))
+    i2cFaultArm(FAULT_STUCK, 0, v1);
+  else if (!strcmp(kind, "RESET"))
+    i2cFaultArm(FAULT_RESET, v1, 0);
+  else if (!strcmp(kind, "OFF"))
+    i2cFault.kind = FAULT_NONE;
+  else if (!strcmp(kind, "BENCH"))
+    faultBench(v1);
+  else
+    Serial.println("Unknown fault");
+}
+#endif
+
 // ==================== SERIAL COMMANDS ====================
+// CH<n> PULSE <ms>, DELAYON|DELAYOFF <ms>, BURST <on> <off> <count>, CANCEL.
+// false = not a timed command (plain ON/OFF).
+bool serialTimedCommand(int channel, const String &args)
+{
+  char buf[48];
+  strlcpy(buf, args.c_str(), sizeof(buf));
+  char *op = strtok(buf, " ");
+  char *a1 = strtok(nullptr, " ");
+  char *a2 = strtok(nullptr, " ");
+  char *a3 = strtok(nullptr, " ");
+  StaticJsonDocument<128> doc;
+  doc["channel"] = channel;
+  String action;
+
+  if (!op)
+    return false;
+  if (!strcmp(op, "PULSE") && a1)
+  {
+    action = "pulse";
+    doc["ms"] = strtoul(a1, nullptr, 10);
+  }
+  else if ((!strcmp(op, "DELAYON") || !strcmp(op, "DELAYOFF")) && a1)
+  {
+    action = !strcmp(op, "DELAYON") ? "delayedOn" : "delayedOff";
+    doc["ms"] = strtoul(a1, nullptr, 10);
+  }
+  else if (!strcmp(op, "BURST") && a1 && a2 && a3)
+  {
+    action = "burst";
+    doc["onMs"] = strtoul(a1, nullptr, 10);
+    doc["offMs"] = strtoul(a2, nullptr, 10);
+    doc["count"] = strtoul(a3, nullptr, 10);
+  }
+  else if (!strcmp(op, "CANCEL"))
+  {
+    action = "cancelTimer";
+  }
+  else
+  {
+    return false;
+  }
+
+  const char *error = timedOutputAction(action, doc.as<JsonVariantConst>(), SRC_SERIAL);
+  Serial.println(error ? error : "OK");
+  return true;
+}
+
+// GROUP: list. GROUP <name> ON|OFF|TOGGLE, AUTO ON|OFF, INTERVAL <on> <off>,
+// PHASE <ms> [stagger ms]
+void serialGroupCommand(const String &args)
+{
+  char buf[64];
+  strlcpy(buf, args.c_str(), sizeof(buf));
+  char *name = strtok(buf, " ");
+  if (!name)
+  {
+    for (int i = 0; i < namedGroupCount; i++)
+    {
+      const NamedGroup &g = namedGroups[i];
+      Serial.printf("%-15s CH %s  auto:%s %lus/%lus  phase:%ums stagger:%ums\n", g.name,
+                    channelRangesFormat(g.members).c_str(), g.autoMode ? "ON" : "OFF",
+                    g.intervalOn / 1000, g.intervalOff / 1000, g.phaseMs, g.staggerMs);
+    }
+    if (namedGroupCount == 0)
+      Serial.println("No groups (config.json \"groups\")");
+    return;
+  }
+
+  char *op = strtok(nullptr, " ");
+  char *a1 = strtok(nullptr, " ");
+  char *a2 = strtok(nullptr, " ");
+  StaticJsonDocument<128> doc;
+  doc["group"] = (const char *)name;
+  String action;
+
+  if (op && (!strcmp(op, "ON") || !strcmp(op, "OFF")))
+  {
+    action = "setGroupState";
+    doc["state"] = !strcmp(op, "ON");
+  }
+  else if (op && !strcmp(op, "TOGGLE"))
+  {
+    action = "toggleGroup";
+  }
+  else if (op && !strcmp(op, "AUTO") && a1)
+  {
+    action = "setGroupAutoMode";
+    doc["autoMode"] = !strcmp(a1, "ON");
+  }
+  else if (op && !strcmp(op, "INTERVAL") && a1 && a2)
+  {
+    action = "setGroupInterval";
+    doc["intervalOn"] = strtoul(a1, nullptr, 10);
+    doc["intervalOff"] = strtoul(a2, nullptr, 10);
+  }
+  else if (op && !strcmp(op, "PHASE") && a1)
+  {
+    action = "setGroupPhase";
+    doc["phase"] = strtoul(a1, nullptr, 10);
+    if (a2)
+      doc["stagger"] = strtoul(a2, nullptr, 10);
+  }
+  else
+  {
+    Serial.println("GROUP <name> ON|OFF|TOGGLE, AUTO ON|OFF, INTERVAL <on> <off>, PHASE <ms> [stagger]");
+    return;
+  }
+
+  const char *error = namedGroupAction(action, doc.as<JsonVariantConst>(), SRC_SERIAL);
+  Serial.println(error ? error : "OK");
+}
+
+// BENCH: stage + flush of every channel and the state / status renders on
+// an all-virtual topology of `channels`, swapped in for the measurement
+// only. No pin or bus is touched and outputs[] is only read.
+void benchTopology(int channels, int iterations)
+{
+  static IoDevice savedDevices[MAX_IO_DEVICES];
+  static ChannelMap savedMap[MAX_OUTPUTS];
+  static ChannelMap map[MAX_OUTPUTS];
+  memcpy(savedDevices, ioDevices, sizeof(ioDevices));
+  memcpy(savedMap, outputMap, sizeof(outputMap));
+  int savedDeviceCount = ioDeviceCount;
+  int savedCount = outputCount;
+
+  IoDeviceConfig devs[MAX_IO_DEVICES];
+  int devCount = (channels + 15) / 16;
+  for (int d = 0; d < devCount; d++)
+    devs[d] = {IO_VIRTUAL, 0};
+  for (int i = 0; i < channels; i++)
+    map[i] = {(int8_t)(i / 16), (uint8_t)(i % 16), true};
+  ioTopologyApply(devs, devCount, map, channels);
+
+  unsigned long t0 = micros();
+  for (int k = 0; k < iterations; k++)
+  {
+    for (int i = 0; i < channels; i++)
+      ioStageLevel(outputMap[i], k & 1);
+    ioFlushDirty();
+  }
+  unsigned long commitUs = micros() - t0;
+
+  t0 = micros();
+  for (int k = 0; k < iterations; k++)
+    getThingsBoardTelemetryJSON();
+  unsigned long telemetryUs = micros() - t0;
+
+  t0 = micros();
+  for (int k = 0; k < iterations; k++)
+    getStatusJSON();
+  unsigned long statusUs = micros() - t0;
+
+  memcpy(ioDevices, savedDevices, sizeof(ioDevices));
+  memcpy(outputMap, savedMap, sizeof(outputMap));
+  ioDeviceCount = savedDeviceCount;
+  outputCount = savedCount;
+
+  Serial.printf("BENCH %3d ch: commit %lu us, telemetry %lu us, status %lu us (avg of %d)\n",
+                channels, commitUs / iterations, telemetryUs / iterations, statusUs / iterations, iterations);
+}
+
 void handleSerialCommand()
 {
   if (!Serial.available())
@@ -1420,18 +6434,12 @@ void handleSerialCommand()
       int channel = cmd.substring(2, spacePos).toInt();
       String state = cmd.substring(spacePos + 1);
 
-      if (channel >= 1 && channel <= 20)
+      if (channel >= 1 && channel <= outputCount && !serialTimedCommand(channel, state))
       {
         bool newState = (state == "ON" || state == "1");
-        setOutput(channel, newState);
+        setOutput(channel, newState, SRC_SERIAL);
 
-        if (remoteConnected)
-        {
-          if (config.commMode == MODE_MQTT)
-            mqttPublish();
-          else
-            wsPublish();
-        }
+        requestPublish();
       }
     }
   }
@@ -1442,20 +6450,33 @@ void handleSerialCommand()
     {
       String mode = cmd.substring(spacePos + 1);
 
+      // Diffed against the old flags, so the transport that was running is
+      // the one hot-apply stops
+      TransportConfig oldMqtt = config.mqtt;
+      TransportConfig oldWs = config.ws;
+
       if (mode == "MQTT" || mode == "0")
       {
-        config.commMode = MODE_MQTT;
+        config.mqtt.enabled = true;
+        config.ws.enabled = false;
         Serial.println("Mode set to: MQTT");
       }
       else if (mode == "WS" || mode == "WEBSOCKET" || mode == "1")
       {
-        config.commMode = MODE_WEBSOCKET;
+        config.mqtt.enabled = false;
+        config.ws.enabled = true;
         Serial.println("Mode set to: WebSocket");
       }
 
-      saveConfig();
-      Serial.println("Config saved");
-      Serial.println("Please restart ESP32");
+      uint8_t changes = 0;
+      if (transportConfigChanged(config.mqtt, oldMqtt))
+        changes |= CFG_CHANGE_MQTT;
+      if (transportConfigChanged(config.ws, oldWs))
+        changes |= CFG_CHANGE_WS;
+
+      requestConfigSave();
+      configHotApply(changes);
+      Serial.println("Config saved and applied");
     }
   }
   else if (cmd.startsWith("MODE"))
@@ -1480,7 +6501,30 @@ void handleSerialCommand()
     }
     else
     {
-      Serial.printf("Current mode: %s\n", config.commMode == MODE_MQTT ? "MQTT" : "WebSocket");
+      Serial.printf("Current mode: %s\n", transportsLabel());
+    }
+  }
+  else if (cmd.startsWith("TRANSPORT "))
+  {
+    // TRANSPORT MQTT ON / TRANSPORT WS OFF: enable any subset at runtime
+    String args = cmd.substring(10);
+    int spacePos = args.indexOf(' ');
+    String name = args.substring(0, spacePos);
+    bool on = args.substring(spacePos + 1) == "ON";
+    int id = name == "MQTT" ? MODE_MQTT : (name == "WS" ? MODE_WEBSOCKET : -1);
+
+    if (id < 0 || spacePos < 0)
+    {
+      Serial.println("Usage: TRANSPORT MQTT|WS ON|OFF");
+    }
+    else if (transports[id].cfg->enabled != on)
+    {
+      transportStop(id);
+      transports[id].cfg->enabled = on;
+      transportBegin(id);
+      requestConfigSave();
+      lcdNeedsRedraw = true;
+      Serial.printf("Transports: %s\n", transportsLabel());
     }
   }
   else if (cmd == "STATUS")
@@ -1488,13 +6532,37 @@ void handleSerialCommand()
     Serial.println("\n╔════════════════════════════════════╗");
     Serial.println("║      SYSTEM STATUS                  ║");
     Serial.println("╠═════════════════════════════=═══════╣");
-    Serial.printf("║ Mode: %-28s ║\n", config.commMode == MODE_MQTT ? "MQTT" : "WebSocket");
+    Serial.printf("║ Mode: %-28s ║\n", transportsLabel());
     Serial.printf("║ WiFi: %-28s ║\n", wifiConnected ? "Connected" : "AP Mode");
     Serial.printf("║ Remote: %-26s ║\n", remoteConnected ? "Connected" : "Disconnected");
-    Serial.printf("║ Server: %-26s ║\n", config.serverIP.c_str());
-    Serial.printf("║ Port: %-28d ║\n", config.serverPort);
+    for (int i = 0; i < TRANSPORT_COUNT; i++)
+    {
+      if (!transports[i].cfg->enabled)
+        continue;
+      String endpoint = transports[i].cfg->host + ":" + String(transports[i].cfg->port);
+      Serial.printf("║ %-4s %-20s %-8s ║\n", transports[i].name, endpoint.c_str(),
+                    *transports[i].connected ? "UP" : "DOWN");
+    }
+    if (config.mqtt.enabled)
+    {
+      Serial.printf("║ MQTT attempts: %-19lu ║\n", mqttReconnectAttempts);
+      Serial.printf("║ MQTT down: %-20lu ms ║\n", mqttDisconnectedMs());
+    }
+    Serial.printf("║ Max loop stall: %-15u us ║\n", loopHist[SEC_LOOP].maxUs);
+    Serial.printf("║ Journal: %-6u rec, %-4lu compact ║\n", journalFileRecords, journalCompactions);
+    Serial.printf("║ UDP: %-29s ║\n", udpCtrlRunning ? ("port " + String(config.udpPort)).c_str() : "Disabled");
+    if (udpCtrlRunning)
+    {
+      Serial.printf("║ UDP rx:%lu bad:%lu tag:%lu rep:%lu ║\n", udpRxFrames, udpBadFrames, udpBadTags, udpReplays);
+    }
+    for (int d = 0; d < ioDeviceCount; d++)
+    {
+      const IoDevice &dev = ioDevices[d];
+      Serial.printf("║ IO%d %-8s 0x%02X w:%-6lu e:%-5lu ║\n", d, ioTypeName(dev.type), dev.addr, dev.writes, dev.errors);
+    }
+    Serial.printf("║ I2C: %-4lu kHz, %-8lu recoveries ║\n", (unsigned long)(i2cClockHz / 1000), i2cRecoveries);
     Serial.println("╠════════════════════════════════════╣");
-    for (int i = 0; i < TOTAL_OUTPUTS; i++)
+    for (int i = 0; i < outputCount; i++)
     {
       Serial.printf("║ CH%02d %-15s [%s] ║\n",
                     i + 1, outputs[i].name.c_str(), outputs[i].state ? "ON " : "OFF");
@@ -1504,20 +6572,12 @@ void handleSerialCommand()
   else if (cmd == "TEST")
   {
     Serial.println("\nTesting all channels...");
-    for (int i = 1; i <= TOTAL_OUTPUTS; i++)
-    {
-      Serial.printf("CH%02d... ", i);
-      setOutput(i, true);
-      delay(300);
-      setOutput(i, false);
-      delay(100);
-      Serial.println("OK");
-    }
-    Serial.println("Complete\n");
+    deferAction(0, actionTestStep, 2); // CH01, switch on
   }
   else if (cmd == "SCAN")
   {
     Serial.println("\nI2C Scan...");
+    i2cUseClock(I2C_STD_HZ); // Unknown parts may not do fast mode
     byte count = 0;
     for (byte i = 1; i < 127; i++)
     {
@@ -1525,10 +6585,11 @@ void handleSerialCommand()
       if (Wire.endTransmission() == 0)
       {
         Serial.printf("0x%02X", i);
-        if (i == ADDR_PCF1)
-          Serial.print(" (PCF1)");
-        if (i == ADDR_PCF2)
-          Serial.print(" (PCF2)");
+        for (int d = 0; d < ioDeviceCount; d++)
+        {
+          if (ioDevices[d].type != IO_VIRTUAL && ioDevices[d].addr == i)
+            Serial.printf(" (IO%d %s)", d, ioTypeName(ioDevices[d].type));
+        }
         if (i == ADDR_LCD)
           Serial.print(" (LCD)");
         Serial.println();
@@ -1551,22 +6612,106 @@ void handleSerialCommand()
     Serial.println("Resetting credentials to default...");
     config.webUsername = "admin";
     config.webPassword = "admin123";
-    saveConfig();
+    requestConfigSave();
     Serial.println("   Credentials reset to:");
     Serial.println("   Username: admin");
     Serial.println("   Password: admin123");
     Serial.println("Please restart ESP32 or just try login again.\n");
   }
+  else if (cmd == "BOOT")
+  {
+    printBootReport();
+  }
+  else if (cmd == "TRACE")
+  {
+    uint32_t head = traceRing.head;
+    uint32_t count = min(traceCount(), (uint32_t)20);
+    Serial.printf("Trace: %lu events total, last %lu:\n", (unsigned long)head, (unsigned long)count);
+    for (uint32_t n = head - count; n != head; n++)
+    {
+      const TraceEvent &e = traceRing.events[n & (TRACE_CAPACITY - 1)];
+      Serial.printf("  %10lu us  type=%u src=%-9s CH%02u val=%u bank%u=0x%08lX\n",
+                    (unsigned long)e.tsUs, e.type, cmdSourceName(e.source), e.channel, e.value, e.bank,
+                    (unsigned long)e.stateMask);
+    }
+  }
+  else if (cmd == "TRACE SAVE")
+  {
+    traceSpill();
+    Serial.println("Trace written to " TRACE_FILE);
+  }
+  else if (cmd == "TRACE CLEAR")
+  {
+    traceClear();
+    Serial.println("Trace cleared");
+  }
+  else if (cmd == "METRICS")
+  {
+    Serial.print(getMetricsText());
+  }
+  else if (cmd == "METRICS RESET")
+  {
+    resetLoopMetrics();
+    for (int i = 0; i < i2cDeviceCount; i++)
+      memset(&i2cDevices[i].latency, 0, sizeof(i2cDevices[i].latency));
+    Serial.println("Loop metrics reset");
+  }
+  else if (cmd == "BENCH" || cmd.startsWith("BENCH "))
+  {
+    // Per-write cost of each expander. The latched port is written again,
+    // so no relay actually switches.
+    int n = cmd.length() > 6 ? cmd.substring(6).toInt() : 1000;
+    if (n <= 0)
+      n = 1000;
+
+    for (int d = 0; d < ioDeviceCount; d++)
+    {
+      IoDevice &dev = ioDevices[d];
+      unsigned long t0 = micros();
+      for (int k = 0; k < n; k++)
+        ioFlush(d);
+      unsigned long us = micros() - t0;
+
+      Serial.printf("BENCH IO%d %s: %d writes, %lu.%02lu us/write\n", d, ioTypeName(dev.type), n,
+                    us / n, (us % n) * 100 / n);
+    }
+
+    // Scaling of the commit and render paths with the channel count
+    const int sizes[] = {20, 64, 128};
+    for (int channels : sizes)
+      benchTopology(channels, max(1, n / 10));
+  }
+#ifdef I2C_FAULT_INJECT
+  else if (cmd == "FAULT" || cmd.startsWith("FAULT "))
+  {
+    faultCommandLine(cmd.substring(5));
+  }
+#endif
+  else if (cmd == "GROUP" || cmd.startsWith("GROUP "))
+  {
+    serialGroupCommand(cmd.substring(5));
+  }
   else if (cmd == "HELP")
   {
     Serial.println("\n╔════════════════════════════════════╗");
     Serial.println("║        COMMANDS                    ║");
     Serial.println("╠════════════════════════════════════╣");
-    Serial.println("║ CH[1-20] ON/OFF - Toggle output    ║");
+    Serial.println("║ CH<n> ON/OFF    - Toggle output    ║");
+    Serial.println("║ CH<n> PULSE|DELAYON|DELAYOFF <ms>  ║");
+    Serial.println("║ CH<n> BURST <on> <off> <n>|CANCEL  ║");
+    Serial.println("║ GROUP [name ..] - Named groups     ║");
     Serial.println("║ MODE [MQTT/WS]  - Switch mode      ║");
+    Serial.println("║ TRANSPORT MQTT|WS ON|OFF           ║");
     Serial.println("║ STATUS          - Show status      ║");
     Serial.println("║ TEST            - Test outputs     ║");
     Serial.println("║ SCAN            - I2C scan         ║");
+    Serial.println("║ BENCH [n]       - IO + scaling     ║");
+#ifdef I2C_FAULT_INJECT
+    Serial.println("║ FAULT ...       - I2C fault inject ║");
+#endif
+    Serial.println("║ BOOT            - Boot timing      ║");
+    Serial.println("║ METRICS [RESET] - Loop timing      ║");
+    Serial.println("║ TRACE [SAVE|CLEAR] - Event trace   ║");
     Serial.println("║ CRED            - Show credentials ║");
     Serial.println("║ RESETCRED       - Reset to default ║");
     Serial.println("║ HELP            - This help        ║");
@@ -1574,70 +6719,120 @@ void handleSerialCommand()
   }
 }
 
-// ==================== SYNC GROUP MANAGEMENT ====================
-void rebuildSyncGroups()
+// ==================== SYNC GROUP MANAGEMENT ====================
+int syncGroupSlot(unsigned long intervalOn, unsigned long intervalOff)
+{
+  uint32_t h = (uint32_t)intervalOn * 2654435761u ^ (uint32_t)intervalOff;
+  return (h >> 16) & (SYNC_GROUP_SLOTS - 1);
+}
+
+// Slot of the group with that key, else the first free slot on the probe
+// path, -1 if the table is full
+int syncGroupFind(unsigned long intervalOn, unsigned long intervalOff)
+{
+  int start = syncGroupSlot(intervalOn, intervalOff);
+  int free = -1;
+  for (int n = 0; n < SYNC_GROUP_SLOTS; n++)
+  {
+    int g = (start + n) & (SYNC_GROUP_SLOTS - 1);
+    const SyncGroup &grp = syncGroups[g];
+    if (grp.memberCount == 0)
+    {
+      if (free < 0)
+        free = g;
+    }
+    else if (grp.intervalOn == intervalOn && grp.intervalOff == intervalOff)
+    {
+      return g;
+    }
+  }
+  return free;
+}
+
+void syncGroupRemove(int index)
 {
-  // Reset all groups
-  activeSyncGroups = 0;
-  for (int i = 0; i < 5; i++)
+  int g = outputGroupMap[index];
+  if (g < 0)
+    return;
+
+  outputGroupMap[index] = -1;
+  syncGroups[g].members.set(index, false);
+  if (--syncGroups[g].memberCount == 0)
   {
-    syncGroups[i].memberCount = 0;
+    activeSyncGroups--;
+    LOG_I("Sync Group %d removed", g);
   }
-  for (int i = 0; i < TOTAL_OUTPUTS; i++)
+  LOG_D("└─ CH%02d left Group %d", index + 1, g);
+}
+
+void syncGroupAdd(int index)
+{
+  if (namedGroupMembers.get(index))
+    return;
+
+  const OutputChannel &out = outputs[index];
+  int g = syncGroupFind(out.intervalOn, out.intervalOff);
+  if (g < 0)
   {
-    outputGroupMap[i] = -1; // No group
+    LOG_W("CH%02d: Semua %d sync group terpakai, channel tidak ikut grup", index + 1, SYNC_GROUP_SLOTS);
+    return;
   }
 
-  // Build groups based on auto mode outputs with same intervals
-  for (int i = 0; i < TOTAL_OUTPUTS; i++)
+  SyncGroup &grp = syncGroups[g];
+  if (grp.memberCount == 0)
   {
-    if (!outputs[i].autoMode)
-      continue;
+    // New group: its phase starts now, from the first member's state
+    grp.intervalOn = out.intervalOn;
+    grp.intervalOff = out.intervalOff;
+    grp.lastToggle = millis();
+    grp.currentState = out.state;
+    grp.members.clear();
+    activeSyncGroups++;
+
+    LOG_I("New Sync Group %d: ON=%lums OFF=%lums", g, grp.intervalOn, grp.intervalOff);
+  }
 
-    // Cari grup yang cocok
-    int groupIdx = -1;
-    for (int g = 0; g < activeSyncGroups; g++)
-    {
-      if (syncGroups[g].intervalOn == outputs[i].intervalOn &&
-          syncGroups[g].intervalOff == outputs[i].intervalOff)
-      {
-        groupIdx = g;
-        break;
-      }
-    }
+  outputGroupMap[index] = g;
+  grp.memberCount++;
+  grp.members.set(index, true);
+  LOG_D("└─ CH%02d assigned to Group %d", index + 1, g);
+}
 
-    // Jika belum ada grup, buat baru
-    if (groupIdx == -1 && activeSyncGroups < 5)
-    {
-      groupIdx = activeSyncGroups;
-      syncGroups[groupIdx].intervalOn = outputs[i].intervalOn;
-      syncGroups[groupIdx].intervalOff = outputs[i].intervalOff;
-      syncGroups[groupIdx].lastToggle = millis();
-      syncGroups[groupIdx].currentState = outputs[i].state;
-      syncGroups[groupIdx].memberCount = 0;
-      activeSyncGroups++;
+// Moves one channel to the group its autoMode / intervals call for. A
+// channel that stays in its group and every other group keep their phase.
+void syncGroupUpdate(int index)
+{
+  const OutputChannel &out = outputs[index];
+  int g = outputGroupMap[index];
+  if (g >= 0 && out.autoMode && syncGroups[g].intervalOn == out.intervalOn &&
+      syncGroups[g].intervalOff == out.intervalOff)
+    return;
 
-      Serial.printf("New Sync Group %d: ON=%lums OFF=%lums\n",
-                    groupIdx, syncGroups[groupIdx].intervalOn, syncGroups[groupIdx].intervalOff);
-    }
+  syncGroupRemove(index);
+  if (out.autoMode)
+    syncGroupAdd(index);
+}
 
-    // Assign output ke grup
-    if (groupIdx >= 0)
-    {
-      outputGroupMap[i] = groupIdx;
-      syncGroups[groupIdx].memberCount++;
-      Serial.printf("  └─ CH%02d assigned to Group %d\n", i + 1, groupIdx);
-    }
+// From scratch (boot, "rebuildGroups"): every group restarts its phase
+void rebuildSyncGroups()
+{
+  memset(syncGroups, 0, sizeof(syncGroups));
+  activeSyncGroups = 0;
+  for (int i = 0; i < outputCount; i++)
+  {
+    outputGroupMap[i] = -1; // No group
+    if (outputs[i].autoMode)
+      syncGroupAdd(i);
   }
 
-  Serial.printf("Sync Groups rebuilt: %d active groups\n", activeSyncGroups);
+  LOG_I("Sync Groups rebuilt: %d active groups", activeSyncGroups);
 }
 
 void processSyncGroups()
 {
   unsigned long currentMillis = millis();
 
-  for (int g = 0; g < activeSyncGroups; g++)
+  for (int g = 0; g < SYNC_GROUP_SLOTS; g++)
   {
     if (syncGroups[g].memberCount == 0)
       continue;
@@ -1652,30 +6847,210 @@ void processSyncGroups()
       syncGroups[g].currentState = !syncGroups[g].currentState;
       syncGroups[g].lastToggle = currentMillis;
 
-      Serial.printf("\nGROUP %d TOGGLE → %s (Members: %d)\n",
-                    g, syncGroups[g].currentState ? "ON" : "OFF", syncGroups[g].memberCount);
+      LOG_D("GROUP %d TOGGLE -> %s (Members: %d)",
+            g, syncGroups[g].currentState ? "ON" : "OFF", syncGroups[g].memberCount);
 
-      // Apply ke semua member
-      int toggledCount = 0;
-      for (int i = 0; i < TOTAL_OUTPUTS; i++)
-      {
-        if (outputGroupMap[i] == g)
-        {
-          setOutput(i + 1, syncGroups[g].currentState);
-          toggledCount++;
-        }
-      }
+      // Apply ke semua member, satu write per expander (atau bertahap
+      // kalau syncStagger diset)
+      outputScheduleMask(syncGroups[g].members, syncGroups[g].currentState, 0, config.syncStaggerMs,
+                         min(syncGroups[g].intervalOn, syncGroups[g].intervalOff), SRC_SCHEDULER);
 
-      Serial.printf("Toggled %d outputs in Group %d\n\n", toggledCount, g);
+      LOG_D("Toggled %d outputs in Group %d", syncGroups[g].memberCount, g);
 
-      // Publish status update
-      if (remoteConnected)
-      {
-        if (config.commMode == MODE_MQTT)
-          mqttPublish();
-        else
-          wsPublish();
-      }
+      // Publish status update, once per loop() for all groups
+      requestPublish();
+    }
+  }
+}
+
+// ==================== WIFI BRING-UP ====================
+#define WIFI_CONNECT_TIMEOUT_MS 10000
+
+// Called once the first network (STA or fallback AP) is usable
+void onNetworkUp()
+{
+  LOG_I("Web: http://%s", (wifiConnected ? WiFi.localIP().toString() : WiFi.softAPIP().toString()).c_str());
+
+  lcdNeedsRedraw = true;
+
+  // SNTP runs in the background, offline telemetry waits for it for its ts
+  if (wifiConnected)
+    configTime(0, 0, "pool.ntp.org", "time.google.com");
+
+  if (networkServicesStarted)
+    return;
+  networkServicesStarted = true;
+
+  transportsBegin();
+  udpControlBegin();
+}
+
+void startApMode()
+{
+  LOG_I("AP Mode");
+  WiFi.mode(WIFI_AP);
+  WiFi.softAP(AP_SSID, AP_PASSWORD);
+  LOG_I("IP: %s", WiFi.softAPIP().toString().c_str());
+
+  wifiConnected = false;
+  wifiState = WIFI_STATE_AP;
+}
+
+void wifiBegin()
+{
+  WiFi.mode(WIFI_STA);
+
+  if (config.wifiSSID.length() == 0)
+  {
+    startApMode();
+    onNetworkUp();
+    return;
+  }
+
+  LOG_I("Connecting WiFi: %s", config.wifiSSID.c_str());
+  WiFi.begin(config.wifiSSID.c_str(), config.wifiPassword.c_str());
+  wifiConnectStart = millis();
+  wifiState = WIFI_STATE_CONNECTING;
+}
+
+void wifiLoop()
+{
+  switch (wifiState)
+  {
+  case WIFI_STATE_CONNECTING:
+    if (WiFi.status() == WL_CONNECTED)
+    {
+      wifiConnected = true;
+      wifiState = WIFI_STATE_CONNECTED;
+      bootMark("wifi_up");
+
+      LOG_I("WiFi OK");
+      LOG_I("IP: %s", WiFi.localIP().toString().c_str());
+      LOG_I("WiFi up %lu ms after boot", millis());
+      onNetworkUp();
+    }
+    else if (millis() - wifiConnectStart >= WIFI_CONNECT_TIMEOUT_MS)
+    {
+      LOG_W("WiFi timeout");
+      startApMode();
+      onNetworkUp();
+    }
+    break;
+
+  case WIFI_STATE_CONNECTED:
+    if (WiFi.status() != WL_CONNECTED && wifiConnected)
+    {
+      LOG_W("WiFi connection lost, menunggu auto-reconnect...");
+      wifiConnected = false;
+      lcdNeedsRedraw = true;
+    }
+    else if (WiFi.status() == WL_CONNECTED && !wifiConnected)
+    {
+      wifiConnected = true;
+      onNetworkUp();
+    }
+    break;
+
+  case WIFI_STATE_AP:
+    break;
+  }
+}
+
+// ==================== CONFIG HOT-APPLY ====================
+// A config save restarts only what changed, outputs and sync groups keep
+// running. Downtime (until WiFi / the remote server is back) is logged and
+// exported per kind of change.
+#define HOT_APPLY_DELAY_MS 200
+
+void configHotApply(uint8_t changes)
+{
+  hotApplyPending |= changes;
+  hotApplyAt = millis() + HOT_APPLY_DELAY_MS;
+}
+
+bool hotApplyWaitsFor(int id)
+{
+  return transports[id].cfg->enabled && transports[id].cfg->host.length() > 0;
+}
+
+void hotApplyNow(uint8_t changes)
+{
+  hotApplyCount++;
+  unsigned long now = millis();
+
+  if (changes & CFG_CHANGE_WIFI)
+  {
+    LOG_I("Hot-apply: WiFi -> reconnect ke '%s'", config.wifiSSID.c_str());
+    transportsStop();
+    WiFi.disconnect();
+    networkServicesStarted = false; // Transport + UDP start again in onNetworkUp()
+    wifiConnected = false;
+    wifiBegin();
+    hotApplyWifiSince = now;
+    for (int i = 0; i < TRANSPORT_COUNT; i++)
+      hotApplyTransportSince[i] = hotApplyWaitsFor(i) ? now : 0;
+    lcdNeedsRedraw = true;
+  }
+  else
+  {
+    // Only the transport that changed reconnects, the other keeps running
+    for (int i = 0; i < TRANSPORT_COUNT; i++)
+    {
+      uint8_t bit = i == MODE_MQTT ? CFG_CHANGE_MQTT : CFG_CHANGE_WS;
+      if (!(changes & bit))
+        continue;
+
+      LOG_I("Hot-apply: transport %s -> re-init", transports[i].name);
+      transportStop(i);
+      transportBegin(i);
+      hotApplyTransportSince[i] = hotApplyWaitsFor(i) ? now : 0;
+      lcdNeedsRedraw = true;
+    }
+
+    if (changes & CFG_CHANGE_UDP)
+    {
+      unsigned long t0 = micros();
+      udpControlBegin();
+      hotApplyUdpDowntimeUs = micros() - t0;
+      LOG_I("Hot-apply: UDP listener restart (%lu us)", hotApplyUdpDowntimeUs);
+    }
+  }
+
+  if (changes & CFG_CHANGE_CREDENTIALS)
+    LOG_I("Hot-apply: web login diperbarui (tanpa downtime)");
+}
+
+void hotApplyLoop()
+{
+  if (hotApplyPending && (long)(millis() - hotApplyAt) >= 0)
+  {
+    uint8_t changes = hotApplyPending;
+    hotApplyPending = 0;
+    hotApplyNow(changes);
+  }
+
+  if (hotApplyWifiSince && wifiState != WIFI_STATE_CONNECTING)
+  {
+    hotApplyWifiDowntimeMs = millis() - hotApplyWifiSince;
+    hotApplyWifiSince = 0;
+    LOG_I("Hot-apply: WiFi %s setelah %lu ms",
+          wifiState == WIFI_STATE_CONNECTED ? "tersambung" : "gagal, AP mode", hotApplyWifiDowntimeMs);
+  }
+
+  for (int i = 0; i < TRANSPORT_COUNT; i++)
+  {
+    if (hotApplyTransportSince[i] == 0)
+      continue;
+
+    if (*transports[i].connected)
+    {
+      hotApplyTransportDowntimeMs[i] = millis() - hotApplyTransportSince[i];
+      hotApplyTransportSince[i] = 0;
+      LOG_I("Hot-apply: %s tersambung lagi setelah %lu ms", transports[i].name, hotApplyTransportDowntimeMs[i]);
+    }
+    else if (wifiState == WIFI_STATE_AP)
+    {
+      hotApplyTransportSince[i] = 0; // No server to wait for in AP mode
     }
   }
 }
@@ -1683,70 +7058,62 @@ void processSyncGroups()
 // ==================== SETUP ====================
 void setup()
 {
+  Serial.setTxBufferSize(SERIAL_TX_BUFFER);
   Serial.begin(115200);
-  delay(1000);
+  traceInit();
+  bootMark("serial");
+
   Serial.println("\n╔════════════════════════════════════════════╗");
-  Serial.println("║   ESP32 - 20 Channel Control (v3.1)       ║");
+  Serial.println("║   ESP32 - Multi Channel Control (v3.1)    ║");
   Serial.println("║   Dynamic Mode Switching                   ║");
   Serial.println("╚════════════════════════════════════════════╝\n");
 
-  Wire.begin();
+  i2cBegin();
+  lcdBus = i2cRegister(ADDR_LCD, "lcd", I2C_PCF8574_HZ); // PCF8574 backpack
 
-  lcd.init();
-  lcd.backlight();
-  lcd.clear();
-  lcd.setCursor(0, 0);
-  lcd.print("ESP32 Control");
-  lcd.setCursor(0, 1);
-  lcd.print("v3.1 Booting...");
+  // Relay outputs first: they must be in a defined state before anything
+  // slow runs, and LittleFS.begin(true) may format the partition for
+  // seconds. Until then GPIOs float and expanders sit at their power-on
+  // level. The board layout is driven OFF here; a topology from
+  // config.json is applied once the config is read.
+  ioTopologyDefault();
+  initHardwarePins();
+  bootMark("io_init");
 
-  // Init LittleFS
   Serial.println("Mounting LittleFS...");
   if (!LittleFS.begin(true))
   {
     Serial.println("✗ LittleFS Mount Failed!");
-    lcd.setCursor(0, 1);
+    lcd.init();
+    lcd.backlight();
     lcd.print("FS Error!");
     while (1)
       delay(1000);
   }
   Serial.println("LittleFS Mounted OK");
+  bootMark("littlefs_mount");
 
-  // ============ FORCE DELETE CONFIG.JSON ============
-  Serial.println("\nChecking for old config...");
-  if (LittleFS.exists(CONFIG_FILE))
-  {
-    Serial.println("Old config.json found!");
-
-    // Baca dulu untuk cek mode
-    File checkFile = LittleFS.open(CONFIG_FILE, "r");
-    if (checkFile)
-    {
-      String content = checkFile.readString();
-      checkFile.close();
-
-      Serial.println("Current config content:");
-      Serial.println(content);
+  loadConfig();
 
-      // Cek apakah ada commMode
-      if (content.indexOf("\"commMode\":0") >= 0)
-      {
-        Serial.println("MQTT mode detected in config!");
-        Serial.println("Deleting old config.json...");
+  Serial.printf("   Final mode: %s\n\n", transportsLabel());
+  bootMark("config_load");
 
-        if (LittleFS.remove(CONFIG_FILE))
-        {
-          Serial.println("Config deleted successfully");
-          Serial.println("Will create new config with WebSocket mode");
-        }
-        else
-        {
-          Serial.println("Failed to delete config");
-        }
-      }
-    }
+  if (ioTopologyCustom)
+  {
+    initHardwarePins(); // Board pins it does not use stay driven OFF
+    bootMark("io_topology");
   }
-  // ==================================================
+  initOutputs();
+
+  i2cUseClock(i2cDevices[lcdBus].clockHz);
+  lcd.init();
+  lcd.backlight();
+  lcd.clear();
+  lcd.setCursor(0, 0);
+  lcd.print("ESP32 Control");
+  lcd.setCursor(0, 1);
+  lcd.print("v3.1 Booting...");
+  bootMark("lcd_init");
 
   // List files
   Serial.println("\nFiles in LittleFS:");
@@ -1770,88 +7137,23 @@ void setup()
     Serial.println("NO FILES FOUND!");
   }
   Serial.println();
+  bootMark("fs_list");
 
-  // Load config (sekarang akan create baru dengan default WebSocket)
-  loadConfig();
-
-  Serial.printf("   Final mode: %s\n\n", config.commMode == MODE_MQTT ? "MQTT" : "WebSocket");
-
-  Serial.println("\nInitializing PCF8574...");
-
-  if (pcf1.begin(ADDR_PCF1))
-  {
-    Serial.printf("PCF1 initialized at 0x%02X\n", ADDR_PCF1);
-  }
-  else
-  {
-    Serial.printf("PCF1 NOT FOUND at 0x%02X!\n", ADDR_PCF1);
-  }
-
-  if (pcf2.begin(ADDR_PCF2))
-  {
-    Serial.printf("PCF2 initialized at 0x%02X\n", ADDR_PCF2);
-  }
-  else
-  {
-    Serial.printf("PCF2 NOT FOUND at 0x%02X!\n", ADDR_PCF2);
-  }
-
-  initChannelMap();
-  initHardwarePins();
-  initOutputs();
-
-  // WiFi
-  WiFi.mode(WIFI_STA);
-
-  if (config.wifiSSID.length() > 0)
-  {
-    Serial.println("Connecting WiFi: " + config.wifiSSID);
-    WiFi.begin(config.wifiSSID.c_str(), config.wifiPassword.c_str());
-
-    int timeout = 0;
-    while (WiFi.status() != WL_CONNECTED && timeout < 20)
-    {
-      delay(500);
-      Serial.print(".");
-      timeout++;
-    }
+  loadChannelConfig();
+  rebuildSyncGroups(); // Also initializes outputGroupMap
+  groupOffsetsCheck();
+  bootMark("channels_load");
 
-    if (WiFi.status() == WL_CONNECTED)
-    {
-      wifiConnected = true;
-      Serial.println("\nWiFi OK");
-      Serial.println("IP: " + WiFi.localIP().toString());
-    }
-  }
+  // Relay positions + toggle counters from before the reset
+  journalRestore();
+  groupStatesSeed();
+  bootMark("journal_restore");
 
-  if (!wifiConnected)
-  {
-    Serial.println("AP Mode");
-    WiFi.softAP(AP_SSID, AP_PASSWORD);
-    Serial.println("IP: " + WiFi.softAPIP().toString());
-  }
+  transportsRegister();
 
-  // Setup mode sesuai config
-  Serial.println("\nSetting up communication mode...");
-  if (config.commMode == MODE_MQTT)
-  {
-    Serial.println("Initial Mode: MQTT");
-    if (wifiConnected && config.serverIP.length() > 0)
-    {
-      mqttClient.setServer(config.serverIP.c_str(), config.serverPort);
-      mqttClient.setCallback(mqttCallback);
-    }
-  }
-  else
-  {
-    Serial.println("Initial Mode: WebSocket"); // INI YANG SEHARUSNYA MUNCUL
-    if (wifiConnected && config.serverIP.length() > 0)
-    {
-      wsClient.begin(config.serverIP.c_str(), config.serverPort, config.serverPath.c_str());
-      wsClient.onEvent(wsEvent);
-      wsClient.setReconnectInterval(5000);
-    }
-  }
+  // WiFi connects in the background, see wifiLoop()
+  wifiBegin();
+  bootMark("wifi_start");
 
   // Web Server
   server.on("/", HTTP_GET, handleRoot);
@@ -1861,6 +7163,8 @@ void setup()
   server.on("/script.js", HTTP_GET, handleJS);
   server.on("/api/login", HTTP_POST, handleLogin);
   server.on("/api/status", HTTP_GET, handleGetStatus);
+  server.on("/api/metrics", HTTP_GET, handleMetrics);
+  server.on("/api/trace", HTTP_GET, handleTrace);
   server.on("/api/output", HTTP_POST, handleSetOutput);
   server.on("/api/setmode", HTTP_POST, handleSetMode);
   server.on("/api/config", HTTP_GET, handleGetConfig);
@@ -1871,127 +7175,56 @@ void setup()
 
   server.begin();
   Serial.println("HTTP Server started");
+  bootMark("server_start");
 
   updateLCD();
+  bootMark("ready");
 
   Serial.println("\n╔════════════════════════════════════════════╗");
   Serial.println("║          READY!                            ║");
   Serial.println("╠════════════════════════════════════════════╣");
-  Serial.println("║ Web: http://" + (wifiConnected ? WiFi.localIP().toString() : WiFi.softAPIP().toString()) + "               ║");
   Serial.println("║ Login: " + config.webUsername + " / " + config.webPassword + "              ║");
   Serial.println("║                                            ║");
   Serial.println("║ Serial: TYPE 'HELP' for commands          ║");
   Serial.println("╚════════════════════════════════════════════╝\n");
+
+  printBootReport();
 }
 
 // ==================== LOOP ====================
 void loop()
 {
+  unsigned long loopStartUs = micros();
+  unsigned long lapUs = loopStartUs;
+
+  wifiLoop();
+  lapUs = metricLap(SEC_WIFI, lapUs);
+
+  udpControlLoop();
+  lapUs = metricLap(SEC_UDP, lapUs);
+
   handleSerialCommand();
+  lapUs = metricLap(SEC_SERIAL, lapUs);
+
   server.handleClient();
+  lapUs = metricLap(SEC_HTTP, lapUs);
 
   unsigned long currentMillis = millis();
 
-  // Handle MQTT atau WebSocket
-  if (config.commMode == MODE_MQTT)
-  {
-    if (mqttClient.connected())
-    {
-      mqttClient.loop();
-      isRemoteReconnecting = false;
-      
-      if (currentMillis - lastRemotePublish >= 5000)
-      {
-          mqttPublish();
-          lastRemotePublish = currentMillis;
-      }
-    }
-    else
-    {
-      if (!wifiConnected || config.serverIP.length() == 0)
-      {
-          isRemoteReconnecting = false;
-      }
-      else if (!isRemoteReconnecting)
-      {
-        Serial.println("MQTT Disconnected. Memulai 15 detik percobaan reconnect...");
-        isRemoteReconnecting = true;
-        remoteDisconnectTime = millis();
-      }
-      else
-      {
-        if (currentMillis - remoteDisconnectTime >= REMOTE_RECONNECT_TIMEOUT)
-        {
-          Serial.println("\nMQTT: Gagal reconnect selama 15 detik.");
-          Serial.println("Menghentikan percobaan STA dan pindah ke AP Mode.");
-          
-          isRemoteReconnecting = false;
-          mqttClient.disconnect(); 
-          
-          WiFi.disconnect();
-          WiFi.mode(WIFI_AP);
-          WiFi.softAP(AP_SSID, AP_PASSWORD);
-          wifiConnected = false;
-          
-          Serial.println("AP Mode Aktif. IP: " + WiFi.softAPIP().toString());
-          lcdNeedsRedraw = true; 
-        }
-        else
-        {
-          Serial.print(".");
-          mqttReconnect(); 
-        }
-      }
-    }
-  }
-  else
-  {
-    wsClient.loop(); 
+  // Service every enabled transport (MQTT and/or WebSocket)
+  transportsLoop();
 
-    if (remoteConnected)
-    {
-      isRemoteReconnecting = false; 
-      
-      if (currentMillis - lastRemotePublish >= 5000)
-      {
-        wsPublish();
-        lastRemotePublish = currentMillis;
-      }
-    }
-    else
-    {
-      if (!wifiConnected || config.serverIP.length() == 0)
-      {
-        isRemoteReconnecting = false; 
-      }
-      else if (isRemoteReconnecting)
-      {
-        if (currentMillis - remoteDisconnectTime >= REMOTE_RECONNECT_TIMEOUT)
-        {
-          Serial.println("\nWS: Gagal reconnect selama 15 detik.");
-          Serial.println("Menghentikan percobaan STA dan pindah ke AP Mode.");
-          
-          isRemoteReconnecting = false;
-          wsClient.disconnect();
-          
-          WiFi.disconnect();
-          WiFi.mode(WIFI_AP);
-          WiFi.softAP(AP_SSID, AP_PASSWORD);
-          wifiConnected = false;
-          
-          Serial.println("AP Mode Aktif. IP: " + WiFi.softAPIP().toString());
-          lcdNeedsRedraw = true; 
-        }
-        else
-        {
-          Serial.print(".");
-        }
-      }
-    }
-  }
+  lapUs = metricLap(SEC_TRANSPORT, lapUs);
 
-  // Process Sync Groups
+  // Commit this loop's coalesced commands, then the scheduler
+  applyPendingOutputs();
+  deferredActionsLoop();
   processSyncGroups();
+  processNamedGroups();
+  timersService();
+  ioAuditLoop();
+  publishPendingState();
+  lapUs = metricLap(SEC_SYNC, lapUs);
 
   // Update LCD
   if (remoteConnected && (currentMillis - lastLcdPageSwap >= LCD_PAGE_SWAP_MS))
@@ -1999,15 +7232,26 @@ void loop()
     lastLcdPageSwap = currentMillis;
 
     lcdOutputPage++;
-    if (lcdOutputPage >= LCD_PAGES) {
+    if (lcdOutputPage >= (outputCount + 3) / 4) {
         lcdOutputPage = 0;
     }
     lcdNeedsRedraw = true;
   }
 
-  if (lcdNeedsRedraw) 
-  {
-    lcdNeedsRedraw = false;
-    updateLCD(); 
-  }
+  lcdLoop();
+
+  lapUs = metricLap(SEC_LCD, lapUs);
+
+  hotApplyLoop();
+
+  // Idle time: push queued log lines to the UART
+  logDrain();
+  lapUs = metricLap(SEC_LOG, lapUs);
+
+  traceSpillLoop();
+  journalLoop();
+  persistLoop();
+  metricLap(SEC_PERSIST, lapUs);
+
+  metricRecord(SEC_LOOP, micros() - loopStartUs);
 }
\ No newline at end of file
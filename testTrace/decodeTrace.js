@@ -0,0 +1,129 @@
+// Decoder untuk binary event trace dari ESP32 (/api/trace atau /trace.bin).
+//
+// Pemakaian:
+//   node decodeTrace.js http://192.168.1.50/api/trace
+//   node decodeTrace.js http://192.168.1.50/api/trace?source=flash
+//   node decodeTrace.js trace.bin [channels=20]
+//
+// Mencetak timeline: waktu relatif, jenis event, sumber perintah, channel
+// dan state output setelah event tersebut. Trace versi 2 menyimpan 32
+// channel dari bank channel event itu (CH1..32, CH33..64, ...), versi 1
+// dan file flash tanpa header hanya CH1..32.
+
+const fs = require('fs');
+
+const TRACE_MAGIC = 0x43525452;
+const HEADER_SIZE = 16;
+const EVENT_SIZE_V1 = 12;
+
+const TYPES = ['BOOT', 'COMMIT', 'REJECT_LIMIT', 'I2C_FAIL', 'WRITE_FAIL'];
+const SOURCES = ['?', 'boot', 'http', 'ws', 'mqtt', 'serial', 'scheduler', 'udp'];
+// esp_reset_reason_t
+const RESET_REASONS = ['UNKNOWN', 'POWERON', 'EXT', 'SW', 'PANIC', 'INT_WDT', 'TASK_WDT', 'WDT',
+    'DEEPSLEEP', 'BROWNOUT', 'SDIO'];
+
+const [input, channelsArg] = process.argv.slice(2);
+const channels = parseInt(channelsArg || '20', 10);
+
+if (!input) {
+    console.log('Usage: node decodeTrace.js <url|file> [channels=20]');
+    process.exit(1);
+}
+
+async function load(src) {
+    if (/^https?:\/\//.test(src)) {
+        const res = await fetch(src);
+        if (!res.ok) throw new Error(`HTTP ${res.status}`);
+        return Buffer.from(await res.arrayBuffer());
+    }
+    return fs.readFileSync(src);
+}
+
+// 32 bit dari satu bank, dipotong di jumlah channel
+function stateString(mask, bank) {
+    const first = bank * 32;
+    const count = channels > first ? Math.min(32, channels - first) : 32;
+    let out = `CH${first + 1}: `;
+    for (let i = 0; i < count; i++) {
+        out += (mask >>> i) & 1 ? '1' : '.';
+        if (i % 10 === 9 && i !== count - 1) out += ' ';
+    }
+    return out;
+}
+
+function decode(buf) {
+    let offset = 0;
+    let version = 1;
+    let eventSize = EVENT_SIZE_V1;
+
+    if (buf.length >= HEADER_SIZE && buf.readUInt32LE(0) === TRACE_MAGIC) {
+        version = buf.readUInt8(4);
+        eventSize = buf.readUInt8(5);
+        const count = buf.readUInt16LE(6);
+        const total = buf.readUInt32LE(12);
+        if (version > 2 || eventSize < (version >= 2 ? 13 : EVENT_SIZE_V1)) {
+            throw new Error(`Unsupported trace version ${version} / event size ${eventSize}`);
+        }
+        offset = HEADER_SIZE;
+        const events = count || Math.floor((buf.length - offset) / eventSize); // count 0 = file flash
+        console.log(`[TRACE] v${version}, ${events} event (total ditulis sejak reset RAM: ${total})`);
+    } else {
+        console.log(`[TRACE] File mentah dari flash (v1), ${Math.floor(buf.length / eventSize)} event`);
+    }
+
+    console.log('     t(ms)      dt(ms)  event         source     ch  val  state');
+
+    let wraps = 0;
+    let prevTs = null;
+    let t0 = null;
+    let prevT = null;
+    const stats = { COMMIT: 0, REJECT_LIMIT: 0, I2C_FAIL: 0, WRITE_FAIL: 0, BOOT: 0 };
+
+    for (; offset + eventSize <= buf.length; offset += eventSize) {
+        const ts = buf.readUInt32LE(offset);
+        const mask = buf.readUInt32LE(offset + 4);
+        const type = buf.readUInt8(offset + 8);
+        const source = buf.readUInt8(offset + 9);
+        const channel = buf.readUInt8(offset + 10);
+        const value = buf.readUInt8(offset + 11);
+        const bank = version >= 2 ? buf.readUInt8(offset + 12) : 0;
+        const typeName = TYPES[type] || `TYPE${type}`;
+
+        if (typeName === 'BOOT') {
+            // micros() mulai dari 0 lagi setelah reset
+            wraps = 0;
+            prevTs = null;
+            t0 = null;
+            prevT = null;
+            console.log(`---------- BOOT (reset reason: ${RESET_REASONS[value] || value}) ----------`);
+        } else if (prevTs !== null && ts < prevTs) {
+            wraps++;
+        }
+        prevTs = ts;
+
+        const tUs = wraps * 0x100000000 + ts;
+        if (t0 === null) t0 = tUs;
+        const tMs = (tUs - t0) / 1000;
+        const dtMs = prevT === null ? 0 : tMs - prevT;
+        prevT = tMs;
+
+        if (stats[typeName] !== undefined) stats[typeName]++;
+        if (typeName === 'BOOT') continue;
+
+        const valueStr = typeName === 'COMMIT' ? (value ? 'ON ' : 'OFF') : (value ? 'ON?' : 'OF?');
+        console.log(
+            `${tMs.toFixed(3).padStart(10)}  ${dtMs.toFixed(3).padStart(10)}  ${typeName.padEnd(12)}  ` +
+            `${(SOURCES[source] || source).toString().padEnd(9)}  ${String(channel).padStart(2, '0')}  ${valueStr}  ${stateString(mask, bank)}`
+        );
+    }
+
+    console.log(`\n[RINGKASAN] commit=${stats.COMMIT} reject_limit=${stats.REJECT_LIMIT} ` +
+        `i2c_fail=${stats.I2C_FAIL} write_fail=${stats.WRITE_FAIL} boot=${stats.BOOT}`);
+}
+
+load(input)
+    .then(decode)
+    .catch((err) => {
+        console.error('[ERROR]', err.message);
+        process.exit(1);
+    });
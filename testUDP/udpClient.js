@@ -0,0 +1,133 @@
+// Host-side client untuk UDP binary control channel + pengukuran latency.
+//
+// Pemakaian:
+//   node udpClient.js <esp32-ip> <udpKey> [channel=1] [count=200] [port=4210] [intervalMs=20]
+//
+// Mengirim `count` frame yang men-toggle `channel`, menunggu ack untuk setiap
+// frame, lalu mencetak round-trip latency percentiles (p50/p90/p99/max).
+
+const dgram = require('dgram');
+const crypto = require('crypto');
+
+const MAGIC = 0x4352;
+const VERSION = 1;
+const TAG_LEN = 8;
+const CMD_SIZE = 24;
+const ACK_SIZE = 24;
+const ACK_STATUS = ['OK', 'REPLAY', 'PARTIAL'];
+
+const [host, key, channelArg, countArg, portArg, intervalArg] = process.argv.slice(2);
+
+if (!host || !key) {
+    console.log('Usage: node udpClient.js <esp32-ip> <udpKey> [channel=1] [count=200] [port=4210] [intervalMs=20]');
+    process.exit(1);
+}
+
+const channel = parseInt(channelArg || '1', 10);
+const count = parseInt(countArg || '200', 10);
+const port = parseInt(portArg || '4210', 10);
+const intervalMs = parseInt(intervalArg || '20', 10);
+const TIMEOUT_MS = 500;
+
+const bank = Math.floor((channel - 1) / 32);
+const bit = (channel - 1) % 32;
+
+function tag(buf) {
+    return crypto.createHmac('sha256', key).update(buf).digest().subarray(0, TAG_LEN);
+}
+
+function buildFrame(seq, channelMask, valueMask) {
+    const buf = Buffer.alloc(CMD_SIZE);
+    buf.writeUInt16LE(MAGIC, 0);
+    buf.writeUInt8(VERSION, 2);
+    buf.writeUInt8(bank, 3);
+    buf.writeUInt32LE(seq >>> 0, 4);
+    buf.writeUInt32LE(channelMask >>> 0, 8);
+    buf.writeUInt32LE(valueMask >>> 0, 12);
+    tag(buf.subarray(0, 16)).copy(buf, 16);
+    return buf;
+}
+
+function parseAck(buf) {
+    if (buf.length !== ACK_SIZE || buf.readUInt16LE(0) !== MAGIC) return null;
+    if (!tag(buf.subarray(0, 16)).equals(buf.subarray(16, 24))) return null;
+    return {
+        status: buf.readUInt8(3),
+        seq: buf.readUInt32LE(4),
+        stateMask: buf.readUInt32LE(8),
+        rejectedMask: buf.readUInt32LE(12),
+    };
+}
+
+function percentile(sorted, p) {
+    const idx = Math.min(sorted.length - 1, Math.ceil((p / 100) * sorted.length) - 1);
+    return sorted[Math.max(0, idx)];
+}
+
+const socket = dgram.createSocket('udp4');
+
+// Seq diawali dari waktu sekarang supaya tetap naik setelah client restart
+let seq = (Math.floor(Date.now() / 1000) & 0x7fffffff) || 1;
+let pending = null;
+let sent = 0;
+let lost = 0;
+let rejected = 0;
+const rtts = [];
+
+socket.on('message', (msg) => {
+    const ack = parseAck(msg);
+    if (!ack || !pending || ack.seq !== pending.seq) return;
+
+    const rttMs = Number(process.hrtime.bigint() - pending.t0) / 1e6;
+    clearTimeout(pending.timer);
+    pending = null;
+
+    if (ack.status !== 0) {
+        rejected++;
+        console.log(`[ACK] seq=${ack.seq} status=${ACK_STATUS[ack.status] || ack.status} rejected=0x${ack.rejectedMask.toString(16)}`);
+    }
+    if (ack.status === 1) {
+        // REPLAY: rejectedMask = seq tertinggi di ESP32 (mis. setelah reboot), lompati
+        seq = ack.rejectedMask >>> 0;
+    }
+    rtts.push(rttMs);
+    setTimeout(sendNext, intervalMs);
+});
+
+function sendNext() {
+    if (sent >= count) return finish();
+
+    seq = (seq + 1) >>> 0;
+    const mask = 1 << bit;
+    const value = sent % 2 === 0 ? mask : 0;
+    const frame = buildFrame(seq, mask, value);
+
+    pending = {
+        seq,
+        t0: process.hrtime.bigint(),
+        timer: setTimeout(() => {
+            lost++;
+            pending = null;
+            sendNext();
+        }, TIMEOUT_MS),
+    };
+    sent++;
+    socket.send(frame, port, host);
+}
+
+function finish() {
+    socket.close();
+
+    const sorted = rtts.slice().sort((a, b) => a - b);
+    console.log(`\n[HASIL] CH${channel} @ ${host}:${port}`);
+    console.log(`  sent=${sent} acked=${rtts.length} lost=${lost} non-OK=${rejected}`);
+    if (sorted.length === 0) return;
+
+    const avg = sorted.reduce((a, b) => a + b, 0) / sorted.length;
+    console.log(`  min=${sorted[0].toFixed(2)}ms avg=${avg.toFixed(2)}ms`);
+    console.log(`  p50=${percentile(sorted, 50).toFixed(2)}ms p90=${percentile(sorted, 90).toFixed(2)}ms ` +
+        `p99=${percentile(sorted, 99).toFixed(2)}ms max=${sorted[sorted.length - 1].toFixed(2)}ms`);
+}
+
+console.log(`[CLIENT] Toggle CH${channel} x${count} ke ${host}:${port} (interval ${intervalMs}ms)`);
+sendNext();